@@ -0,0 +1,397 @@
+#include "audioconvert.h"
+
+#include <SDL.h>
+#include <emmintrin.h>
+#include <string.h>
+
+// FFmpeg's channel bits, AV_CH_* in libavutil/channel_layout.h.
+#define CH_FL   0x00000001ULL
+#define CH_FR   0x00000002ULL
+#define CH_FC   0x00000004ULL
+#define CH_LFE  0x00000008ULL
+#define CH_BL   0x00000010ULL
+#define CH_BR   0x00000020ULL
+#define CH_FLC  0x00000040ULL
+#define CH_FRC  0x00000080ULL
+#define CH_BC   0x00000100ULL
+#define CH_SL   0x00000200ULL
+#define CH_SR   0x00000400ULL
+#define CH_TC   0x00000800ULL
+#define CH_TFL  0x00001000ULL
+#define CH_TFC  0x00002000ULL
+#define CH_TFR  0x00004000ULL
+#define CH_TBL  0x00008000ULL
+#define CH_TBC  0x00010000ULL
+#define CH_TBR  0x00020000ULL
+#define CH_STEREO_L 0x20000000ULL
+#define CH_STEREO_R 0x40000000ULL
+#define CH_WL   0x0000000080000000ULL
+#define CH_WR   0x0000000100000000ULL
+#define CH_SDL  0x0000000200000000ULL
+#define CH_SDR  0x0000000400000000ULL
+#define CH_LFE2 0x0000000800000000ULL
+
+// audio_mix() works through this many samples at a time, so a block of
+// every channel stays in the L1 cache between the passes.
+#define MIX_BLOCK 256
+
+#define SQRT1_2 0.70710678f
+
+static int use_sse2()
+{
+	static int sse2 = -1;
+
+	if(sse2 < 0)
+		sse2 = SDL_HasSSE2() ? 1 : 0;
+	return sse2;
+}
+
+/**************************/
+// Interleave
+
+void audio_interleave_f32(float *dst, const float *left, const float *right, int samples)
+{
+	int i = 0;
+
+	if(use_sse2()) {
+		for(; i + 4 <= samples; i += 4) {
+			__m128 l = _mm_loadu_ps(left + i);
+			__m128 r = _mm_loadu_ps(right + i);
+			_mm_storeu_ps(dst + i*2, _mm_unpacklo_ps(l, r));
+			_mm_storeu_ps(dst + i*2 + 4, _mm_unpackhi_ps(l, r));
+		}
+	}
+
+	for(; i < samples; i++) {
+		dst[i*2] = left[i];
+		dst[i*2 + 1] = right[i];
+	}
+}
+
+void audio_interleave_s16(int16_t *dst, const int16_t *left, const int16_t *right, int samples)
+{
+	int i = 0;
+
+	if(use_sse2()) {
+		for(; i + 8 <= samples; i += 8) {
+			__m128i l = _mm_loadu_si128((const __m128i*)(left + i));
+			__m128i r = _mm_loadu_si128((const __m128i*)(right + i));
+			_mm_storeu_si128((__m128i*)(dst + i*2), _mm_unpacklo_epi16(l, r));
+			_mm_storeu_si128((__m128i*)(dst + i*2 + 8), _mm_unpackhi_epi16(l, r));
+		}
+	}
+
+	for(; i < samples; i++) {
+		dst[i*2] = left[i];
+		dst[i*2 + 1] = right[i];
+	}
+}
+
+/**************************/
+// Mix matrix
+
+uint64_t audio_device_layout(int channels)
+{
+	switch(channels) {
+		case 1: return CH_FC;
+		case 2: return CH_FL | CH_FR;
+		case 3: return CH_FL | CH_FR | CH_LFE;
+		case 4: return CH_FL | CH_FR | CH_BL | CH_BR;
+		case 5: return CH_FL | CH_FR | CH_LFE | CH_BL | CH_BR;
+		case 6: return CH_FL | CH_FR | CH_FC | CH_LFE | CH_BL | CH_BR;
+		case 7: return CH_FL | CH_FR | CH_FC | CH_LFE | CH_BC | CH_SL | CH_SR;
+		case 8: return CH_FL | CH_FR | CH_FC | CH_LFE | CH_BL | CH_BR | CH_SL | CH_SR;
+		default: return 0;
+	}
+}
+
+static int layout_channels(uint64_t layout)
+{
+	int n = 0;
+
+	for(; layout; layout &= layout - 1)
+		n++;
+	return n;
+}
+
+// Where channel ch is in layout's order.
+static int layout_index(uint64_t layout, uint64_t ch)
+{
+	return layout_channels(layout & (ch - 1));
+}
+
+// Adds gain of input column col to the output channel ch, or if the
+// output doesn't have ch, to the ones nearest it.
+static void mix_channel(float *matrix, uint64_t outLayout, int inChannels, int col,
+						uint64_t ch, float gain)
+{
+	if(outLayout & ch) {
+		matrix[layout_index(outLayout, ch) * inChannels + col] += gain;
+		return;
+	}
+
+	switch(ch) {
+		case CH_FL:
+		case CH_FR:
+			if(outLayout & CH_FC)
+				mix_channel(matrix, outLayout, inChannels, col, CH_FC, gain * SQRT1_2);
+			break;
+		case CH_FC:
+			if((outLayout & (CH_FL | CH_FR)) == (CH_FL | CH_FR)) {
+				mix_channel(matrix, outLayout, inChannels, col, CH_FL, gain * SQRT1_2);
+				mix_channel(matrix, outLayout, inChannels, col, CH_FR, gain * SQRT1_2);
+			}
+			break;
+		case CH_LFE2:
+			mix_channel(matrix, outLayout, inChannels, col, CH_LFE, gain);
+			break;
+		case CH_BL:
+		case CH_BR:
+			if(outLayout & (CH_SL | CH_SR))
+				mix_channel(matrix, outLayout, inChannels, col, ch == CH_BL ? CH_SL : CH_SR, gain);
+			else
+				mix_channel(matrix, outLayout, inChannels, col, ch == CH_BL ? CH_FL : CH_FR, gain * SQRT1_2);
+			break;
+		case CH_SL:
+		case CH_SR:
+		case CH_SDL:
+		case CH_SDR:
+			if(outLayout & (CH_BL | CH_BR))
+				mix_channel(matrix, outLayout, inChannels, col, (ch == CH_SL || ch == CH_SDL) ? CH_BL : CH_BR, gain);
+			else
+				mix_channel(matrix, outLayout, inChannels, col, (ch == CH_SL || ch == CH_SDL) ? CH_FL : CH_FR, gain * SQRT1_2);
+			break;
+		case CH_BC:
+		case CH_TBC:
+			mix_channel(matrix, outLayout, inChannels, col, CH_BL, gain * SQRT1_2);
+			mix_channel(matrix, outLayout, inChannels, col, CH_BR, gain * SQRT1_2);
+			break;
+		case CH_FLC:
+		case CH_WL:
+		case CH_STEREO_L:
+		case CH_TFL:
+			mix_channel(matrix, outLayout, inChannels, col, CH_FL, gain);
+			break;
+		case CH_FRC:
+		case CH_WR:
+		case CH_STEREO_R:
+		case CH_TFR:
+			mix_channel(matrix, outLayout, inChannels, col, CH_FR, gain);
+			break;
+		case CH_TBL:
+			mix_channel(matrix, outLayout, inChannels, col, CH_BL, gain);
+			break;
+		case CH_TBR:
+			mix_channel(matrix, outLayout, inChannels, col, CH_BR, gain);
+			break;
+		case CH_LFE:
+			// Dropped, as swresample does by default.
+			break;
+		default:
+			// Top centre and anything newer.
+			mix_channel(matrix, outLayout, inChannels, col, CH_FC, gain);
+			break;
+	}
+}
+
+int audio_mix_matrix(float *matrix, uint64_t outLayout, uint64_t inLayout)
+{
+	int outChannels = layout_channels(outLayout);
+	int inChannels = layout_channels(inLayout);
+	int identity = (outChannels == inChannels);
+	float loudest = 0;
+	int col = 0;
+
+	if(outChannels > AUDIO_OUT_MAX_CHANNELS || inChannels > AUDIO_MIX_MAX_CHANNELS)
+		return -1;
+
+	memset(matrix, 0, outChannels * inChannels * sizeof(float));
+
+	for(uint64_t ch = 1; ch && ch <= inLayout; ch <<= 1) {
+		if(inLayout & ch)
+			mix_channel(matrix, outLayout, inChannels, col++, ch, 1.0f);
+	}
+
+	for(int o = 0; o < outChannels; o++) {
+		float sum = 0;
+
+		for(int i = 0; i < inChannels; i++) {
+			sum += matrix[o*inChannels + i];
+			if(matrix[o*inChannels + i] != (o == i ? 1.0f : 0.0f))
+				identity = 0;
+		}
+		if(sum > loudest)
+			loudest = sum;
+	}
+
+	if(!identity && loudest > 1) {
+		for(int i = 0; i < outChannels * inChannels; i++)
+			matrix[i] /= loudest;
+	}
+
+	return identity;
+}
+
+/**************************/
+// Mix
+
+// Block of channel c as float, converted into tmp unless it's a float
+// plane already.
+static const float *mix_load(float *tmp, const uint8_t *const *src, enum AVSampleFormat format,
+							 int planar, int channels, int c, int offset, int n)
+{
+	int bytes = av_get_bytes_per_sample(format);
+	int stride = planar ? 1 : channels;
+	const uint8_t *p = planar ? src[c] + offset * bytes : src[0] + (offset * channels + c) * bytes;
+	int i = 0;
+
+	switch(av_get_packed_sample_fmt(format)) {
+		case AV_SAMPLE_FMT_FLT:
+			if(planar)
+				return (const float *)p;
+			for(; i < n; i++)
+				tmp[i] = ((const float *)p)[i * stride];
+			break;
+
+		case AV_SAMPLE_FMT_S16:
+			if(planar && use_sse2()) {
+				__m128 scale = _mm_set1_ps(1.0f / 32768);
+
+				for(; i + 8 <= n; i += 8) {
+					__m128i x = _mm_loadu_si128((const __m128i*)(p + i*2));
+					__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+					__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+					_mm_storeu_ps(tmp + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+					_mm_storeu_ps(tmp + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+				}
+			}
+			for(; i < n; i++)
+				tmp[i] = ((const int16_t *)p)[i * stride] * (1.0f / 32768);
+			break;
+
+		case AV_SAMPLE_FMT_S32:
+			if(planar && use_sse2()) {
+				__m128 scale = _mm_set1_ps(1.0f / 2147483648.0f);
+
+				for(; i + 4 <= n; i += 4) {
+					__m128i x = _mm_loadu_si128((const __m128i*)(p + i*4));
+					_mm_storeu_ps(tmp + i, _mm_mul_ps(_mm_cvtepi32_ps(x), scale));
+				}
+			}
+			for(; i < n; i++)
+				tmp[i] = ((const int32_t *)p)[i * stride] * (1.0f / 2147483648.0f);
+			break;
+
+		case AV_SAMPLE_FMT_U8:
+			for(; i < n; i++)
+				tmp[i] = (p[i * stride] - 128) * (1.0f / 128);
+			break;
+
+		case AV_SAMPLE_FMT_DBL:
+			for(; i < n; i++)
+				tmp[i] = (float)((const double *)p)[i * stride];
+			break;
+
+		default:
+			memset(tmp, 0, n * sizeof(float));
+			break;
+	}
+
+	return tmp;
+}
+
+// dst = gain * src, or dst += gain * src.
+static void mix_accumulate(float *dst, const float *src, float gain, int add, int n)
+{
+	int i = 0;
+
+	if(use_sse2()) {
+		__m128 g = _mm_set1_ps(gain);
+
+		if(add) {
+			for(; i + 4 <= n; i += 4)
+				_mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_mul_ps(_mm_loadu_ps(src + i), g)));
+		} else {
+			for(; i + 4 <= n; i += 4)
+				_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(src + i), g));
+		}
+	}
+
+	if(add) {
+		for(; i < n; i++)
+			dst[i] += src[i] * gain;
+	} else {
+		for(; i < n; i++)
+			dst[i] = src[i] * gain;
+	}
+}
+
+// Clamped to -1..1 first, so loud float samples don't wrap.
+static void mix_store_s16(int16_t *dst, const float *src, int n)
+{
+	int i = 0;
+
+	if(use_sse2()) {
+		__m128 lo = _mm_set1_ps(-1.0f), hi = _mm_set1_ps(32767.0f / 32768);
+		__m128 scale = _mm_set1_ps(32768.0f);
+
+		for(; i + 8 <= n; i += 8) {
+			__m128 a = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(src + i), lo), hi);
+			__m128 b = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(src + i + 4), lo), hi);
+			__m128i x = _mm_packs_epi32(_mm_cvtps_epi32(_mm_mul_ps(a, scale)),
+										_mm_cvtps_epi32(_mm_mul_ps(b, scale)));
+			_mm_storeu_si128((__m128i*)(dst + i), x);
+		}
+	}
+
+	for(; i < n; i++) {
+		float v = src[i] * 32768.0f;
+		dst[i] = (int16_t)(v >= 32767.0f ? 32767 : v <= -32768.0f ? -32768 : (int)(v + (v < 0 ? -0.5f : 0.5f)));
+	}
+}
+
+void audio_mix(uint8_t *dst, enum AVSampleFormat dstFormat, int outChannels,
+			   const uint8_t *const *src, enum AVSampleFormat srcFormat, int inChannels,
+			   const float *matrix, int samples)
+{
+	float in[AUDIO_MIX_MAX_CHANNELS][MIX_BLOCK];
+	float out[AUDIO_OUT_MAX_CHANNELS][MIX_BLOCK];
+	float mixed[AUDIO_OUT_MAX_CHANNELS * MIX_BLOCK];
+	const float *planes[AUDIO_MIX_MAX_CHANNELS];
+	int planar = av_sample_fmt_is_planar(srcFormat);
+	int s16 = (dstFormat == AV_SAMPLE_FMT_S16);
+
+	for(int offset = 0; offset < samples; offset += MIX_BLOCK) {
+		int n = (samples - offset < MIX_BLOCK) ? samples - offset : MIX_BLOCK;
+		float *interleaved = s16 ? mixed : (float *)dst + offset * outChannels;
+
+		for(int c = 0; c < inChannels; c++)
+			planes[c] = mix_load(in[c], src, srcFormat, planar, inChannels, c, offset, n);
+
+		for(int o = 0; o < outChannels; o++) {
+			const float *row = matrix + o * inChannels;
+			int add = 0;
+
+			for(int c = 0; c < inChannels; c++) {
+				if(row[c] != 0) {
+					mix_accumulate(out[o], planes[c], row[c], add, n);
+					add = 1;
+				}
+			}
+			if(!add)
+				memset(out[o], 0, n * sizeof(float));
+		}
+
+		if(outChannels == 2) {
+			audio_interleave_f32(interleaved, out[0], out[1], n);
+		} else {
+			for(int i = 0; i < n; i++) {
+				for(int o = 0; o < outChannels; o++)
+					interleaved[i*outChannels + o] = out[o][i];
+			}
+		}
+
+		if(s16)
+			mix_store_s16((int16_t *)dst + offset * outChannels, mixed, n * outChannels);
+	}
+}
@@ -0,0 +1,41 @@
+#ifndef AUDIOCONVERT_H
+#define AUDIOCONVERT_H
+
+extern "C" {
+#include <libavutil/samplefmt.h>
+}
+
+#include <stdint.h>
+
+// Sample layout conversions and channel mixing for the audio path, so
+// that swresample is only needed to change the sample rate. SSE2 when
+// the CPU has it, checked once at runtime.
+
+// Most channels audio_mix() takes in, and the most it gives out.
+#define AUDIO_MIX_MAX_CHANNELS 16
+#define AUDIO_OUT_MAX_CHANNELS 8
+
+// Interleaves two planes into L R L R ...
+void audio_interleave_f32(float *dst, const float *left, const float *right, int samples);
+void audio_interleave_s16(int16_t *dst, const int16_t *left, const int16_t *right, int samples);
+
+// The FFmpeg channel layout of what SDL plays for a device with that
+// many channels. SDL's channel order is the same as FFmpeg's bit order.
+uint64_t audio_device_layout(int channels);
+
+// Fills in the mix from inLayout to outLayout: a row per output channel
+// with a column per input channel. Channels the output doesn't have are
+// folded into the nearest ones it does, and the LFE is dropped if it has
+// no LFE. A downmix is scaled so the loudest output channel can't clip.
+// Returns 1 if the mix is just a copy, 0 if it mixes and -1 if either
+// layout has more channels than it takes.
+int audio_mix_matrix(float *matrix, uint64_t outLayout, uint64_t inLayout);
+
+// Mixes samples of inChannels in srcFormat, any of FFmpeg's packed or
+// planar U8, S16, S32, FLT or DBL, into interleaved outChannels in
+// dstFormat, which is AV_SAMPLE_FMT_FLT or AV_SAMPLE_FMT_S16.
+void audio_mix(uint8_t *dst, enum AVSampleFormat dstFormat, int outChannels,
+			   const uint8_t *const *src, enum AVSampleFormat srcFormat, int inChannels,
+			   const float *matrix, int samples);
+
+#endif // AUDIOCONVERT_H
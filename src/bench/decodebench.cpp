@@ -0,0 +1,147 @@
+// Headless decode benchmark: plays a file through video.cpp as fast as
+// it decodes, with no window, HMD or audio device. It goes through the
+// same I/O, packet queues, video_thread and colour conversion as the
+// player, with every picture put up in order (VIDEO_OPEN_UNTIMED) and
+// none dropped. Reports fps, how long each picture took to turn up, the
+// per stage timings from the metrics registry, CPU time and peak memory.
+//
+// source is a file, or "lavfi:" and a filter graph for a generated one,
+// e.g. lavfi:testsrc=size=3840x2160:rate=60:duration=10,format=yuv420p
+// which takes the disk and the decoder out of it. With min fps the exit
+// code is 2 when it's slower than that, so it can gate changes to the
+// video module.
+//
+// Usage: decodebench source [yuv|rgba] [conversion threads] [min fps]
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+#include "../video.h"
+#include "../metrics.h"
+#include <SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <Psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+// CPU seconds the process has used on all its threads, and the most
+// memory it's had resident, in MB.
+static void process_usage(double *cpuSeconds, double *peakMB) {
+#ifdef _WIN32
+	FILETIME created, exited, kernel, user;
+	PROCESS_MEMORY_COUNTERS mem;
+
+	GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user);
+	*cpuSeconds = ((((ULONGLONG)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime)
+				   + (((ULONGLONG)user.dwHighDateTime << 32) | user.dwLowDateTime)) / 1e7;
+
+	GetProcessMemoryInfo(GetCurrentProcess(), &mem, sizeof(mem));
+	*peakMB = mem.PeakWorkingSetSize / 1048576.0;
+#else
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	*cpuSeconds = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec
+				  + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+	*peakMB = ru.ru_maxrss / 1024.0;
+#endif
+}
+
+static void print_stage(const char *label, const char *name) {
+	MetricSnapshot s;
+
+	if(!metrics_find(name, &s) || s.count == 0) {
+		return;
+	}
+	printf("  %-8s %8lld %8.3f %8.3f %8.3f %8.3f %8.3f %8.2f\n", label, s.count,
+		   s.mean, s.p50, s.p90, s.p99, s.max, s.mean * s.count / 1000);
+}
+
+int main(int argc, char *argv[]) {
+	VideoOutputFormat format = VIDEO_OUTPUT_YUV;
+	int threads = (argc > 3) ? atoi(argv[3]) : 0;
+	double minFps = (argc > 4) ? atof(argv[4]) : 0;
+	VideoState *video;
+	VideoStats stats;
+	unsigned int serial = 0;
+	int frames = 0;
+	int64_t first = 0, last = 0;
+	Uint64 frameStart = 0;
+	double cpuStart, cpuEnd, peakMB, seconds, fps;
+
+	if(argc < 2) {
+		fprintf(stderr, "Usage: %s source [yuv|rgba] [conversion threads] [min fps]\n", argv[0]);
+		return 1;
+	}
+	if(argc > 2 && strcmp(argv[2], "rgba") == 0) {
+		format = VIDEO_OUTPUT_RGBA;
+	}
+
+	SDL_Init(0);
+	metrics_set_enabled(1);
+	Metric *frameMetric = metric_timer("bench_picture");
+
+	video_set_conversion_threads(threads);
+	process_usage(&cpuStart, &peakMB);
+
+	video = video_open(argv[1], format, VIDEO_OPEN_NO_AUDIO | VIDEO_OPEN_UNTIMED);
+	if(!video) {
+		fprintf(stderr, "Can't play %s\n", argv[1]);
+		return 1;
+	}
+
+	while(!video_is_finished(video, video_get_time())) {
+		VideoFrame frame;
+
+		// Waits for the next picture.
+		video_refresh(video, video_get_time());
+
+		if(video_get_frame_serial(video) == serial || !video_acquire_frame(video, &frame)) {
+			continue;
+		}
+		serial = frame.serial;
+		video_release_frame(video, &frame);
+
+		// Timed from the first picture so opening the file isn't in the fps.
+		last = av_gettime();
+		if(frames++ == 0) {
+			first = last;
+		} else {
+			metric_time_end(frameMetric, frameStart);
+		}
+		frameStart = metric_time_begin();
+	}
+
+	process_usage(&cpuEnd, &peakMB);
+	video_get_stats(video, &stats);
+
+	seconds = (last - first) / 1000000.0;
+	fps = (frames > 1 && seconds > 0) ? (frames - 1) / seconds : 0;
+
+	printf("\n%s, %s output\n", argv[1], format == VIDEO_OUTPUT_YUV ? "YUV" : "RGBA");
+	printf("%d pictures in %.2f s, %.1f fps, first after %.1f ms\n",
+		   frames, seconds, fps, stats.time_to_first_frame);
+	printf("  stage     samples  mean ms      p50      p90      p99      max   busy s\n");
+	print_stage("picture", "bench_picture");
+	print_stage("demux", "demux");
+	print_stage("decode", "decode_video");
+	print_stage("convert", "convert");
+	printf("CPU %.2f s, %.0f%% of one core, peak memory %.1f MB\n",
+		   cpuEnd - cpuStart, seconds > 0 ? (cpuEnd - cpuStart) * 100 / seconds : 0.0, peakMB);
+
+	video_close(video);
+	SDL_Quit();
+
+	if(minFps > 0 && fps < minFps) {
+		printf("FAIL: below %.1f fps\n", minFps);
+		return 2;
+	}
+	return 0;
+}
@@ -0,0 +1,127 @@
+// Demux throughput: reads every packet of a file with av_read_frame,
+// once through the read ahead AVIOContext in readahead.cpp, once through
+// the memory mapped one in mappedio.cpp and once through libavformat's
+// own file I/O, and reports MB/s and packets/s. Use a big file (several
+// GB) so the numbers aren't just startup. The first run warms the page
+// cache, so run it twice and look at the second.
+//
+// throttle makes the read ahead source pretend to be slow storage, in
+// the same "MB/s[,hiccup ms[,every MB]]" form as CINEMA_IO_THROTTLE, and
+// the read ahead line then shows how many reads had to wait for it.
+//
+// Usage: demuxbench file [runs] [window MB] [throttle]
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavutil/time.h>
+}
+
+#include "../mappedio.h"
+#include "../readahead.h"
+#include <SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+	IO_READ_AHEAD,
+	IO_MAPPED,
+	IO_LIBAVFORMAT
+};
+
+static const char *io_names[3] = { "read ahead", "mmap", "libavformat" };
+
+typedef struct DemuxResult {
+	int64_t bytes;
+	int64_t packets;
+	double seconds;
+	ReadAheadStats io;
+} DemuxResult;
+
+// Returns 0 and fills in the totals, or -1 if the file can't be opened.
+static int demux_file(const char *filename, int io, int window, const ReadAheadThrottle *throttle,
+					  DemuxResult *result) {
+	AVFormatContext *fmt = avformat_alloc_context();
+	AVIOContext *pb = NULL;
+	AVPacket pkt;
+	int64_t start;
+
+	memset(result, 0, sizeof(DemuxResult));
+
+	if(io == IO_READ_AHEAD) {
+		pb = read_ahead_open(filename, window, throttle, NULL);
+	} else if(io == IO_MAPPED) {
+		pb = mapped_io_open(filename);
+	}
+	if(io != IO_LIBAVFORMAT) {
+		if(!pb) {
+			avformat_free_context(fmt);
+			return -1;
+		}
+		fmt->pb = pb;
+	}
+
+	start = av_gettime();
+
+	if(avformat_open_input(&fmt, filename, NULL, NULL) != 0) {
+		if(io == IO_READ_AHEAD) {
+			read_ahead_close(&pb);
+		} else {
+			mapped_io_close(&pb);
+		}
+		return -1;
+	}
+
+	while(av_read_frame(fmt, &pkt) >= 0) {
+		result->bytes += pkt.size;
+		result->packets++;
+		av_free_packet(&pkt);
+	}
+
+	result->seconds = (av_gettime() - start) / 1000000.0;
+
+	avformat_close_input(&fmt);
+	if(io == IO_READ_AHEAD) {
+		read_ahead_get_stats(pb, &result->io);
+		read_ahead_close(&pb);
+	} else {
+		mapped_io_close(&pb);
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	int runs = (argc > 2) ? atoi(argv[2]) : 2;
+	int window = ((argc > 3) ? atoi(argv[3]) : 64) * 1024 * 1024;
+	ReadAheadThrottle throttle;
+	int throttled = read_ahead_parse_throttle((argc > 4) ? argv[4] : NULL, &throttle);
+
+	if(argc < 2) {
+		fprintf(stderr, "Usage: %s file [runs] [window MB] [throttle]\n", argv[0]);
+		return 1;
+	}
+
+	av_register_all();
+
+	for(int run = 0; run < runs; run++) {
+		for(int io = IO_READ_AHEAD; io <= IO_LIBAVFORMAT; io++) {
+			DemuxResult r;
+
+			if(demux_file(argv[1], io, window, throttled ? &throttle : NULL, &r) < 0) {
+				printf("run %d %-11s couldn't open %s\n", run + 1, io_names[io], argv[1]);
+				continue;
+			}
+
+			printf("run %d %-11s %8.1f MB in %6.2f s  %8.1f MB/s  %9.0f packets/s\n",
+				   run + 1, io_names[io], r.bytes / 1048576.0, r.seconds,
+				   r.bytes / 1048576.0 / r.seconds, r.packets / r.seconds);
+			if(io == IO_READ_AHEAD) {
+				printf("      %lld hits, %lld misses, %.1f ms stalled, %.1f MB read\n",
+					   (long long)r.io.hits, (long long)r.io.misses, r.io.stall_seconds * 1000,
+					   r.io.bytes_read / 1048576.0);
+			}
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,307 @@
+// Benchmark for the channel mixing in audioconvert.cpp against
+// swresample doing the same mix, timed per decoded frame. With a file it
+// mixes every frame of the first audio stream, which is meant for long
+// 7.1 TrueHD or DTS tracks. Without one it makes up 7.1 frames shaped
+// like those decoders' output: 40 samples of packed S32 for TrueHD and
+// 512 of planar float for DTS, a minute of each at 48 kHz.
+//
+// Each frame is mixed to the devices the player opens for it: stereo
+// float, stereo 16 bit and 5.1 float. Also checks audio_mix() agrees
+// with swresample given the same matrix.
+//
+// Usage: mixbench [file] [max frames]
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/opt.h>
+#include <libswresample/swresample.h>
+}
+
+#include "../audioconvert.h"
+#include "../metrics.h"
+#include <SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define TARGETS 3
+
+typedef struct MixTarget {
+	char label[32];
+	int channels;
+	enum AVSampleFormat format;
+	float matrix[AUDIO_OUT_MAX_CHANNELS * AUDIO_MIX_MAX_CHANNELS];
+	SwrContext *swr;
+	char mixName[64], swrName[64];
+	Metric *mixTime, *swrTime;
+	uint8_t *mixOut, *swrOut;
+	int outSize;
+	double maxDiff;
+	int checked;
+} MixTarget;
+
+typedef struct MixBench {
+	MixTarget targets[TARGETS];
+	int frames;
+	long long samples;
+	int rate;
+} MixBench;
+
+static void target_init(MixTarget *t, const char *source, int channels, enum AVSampleFormat format,
+						uint64_t inLayout, enum AVSampleFormat inFormat, int rate) {
+	uint64_t outLayout = audio_device_layout(channels);
+	int inChannels = av_get_channel_layout_nb_channels(inLayout);
+	double matrix[AUDIO_OUT_MAX_CHANNELS * AUDIO_MIX_MAX_CHANNELS];
+
+	memset(t, 0, sizeof(MixTarget));
+	SDL_snprintf(t->label, sizeof(t->label), "%d ch %s", channels, av_get_sample_fmt_name(format));
+	t->channels = channels;
+	t->format = format;
+	audio_mix_matrix(t->matrix, outLayout, inLayout);
+
+	for(int i = 0; i < channels * inChannels; i++) {
+		matrix[i] = t->matrix[i];
+	}
+
+	t->swr = swr_alloc();
+	av_opt_set_int(t->swr, "in_channel_layout", inLayout, 0);
+	av_opt_set_int(t->swr, "in_sample_fmt", inFormat, 0);
+	av_opt_set_int(t->swr, "in_sample_rate", rate, 0);
+	av_opt_set_int(t->swr, "out_channel_layout", outLayout, 0);
+	av_opt_set_int(t->swr, "out_sample_fmt", format, 0);
+	av_opt_set_int(t->swr, "out_sample_rate", rate, 0);
+	swr_set_matrix(t->swr, matrix, inChannels);
+	if(swr_init(t->swr) < 0) {
+		fprintf(stderr, "swr_init failed for %s\n", t->label);
+		swr_free(&t->swr);
+	}
+
+	SDL_snprintf(t->mixName, sizeof(t->mixName), "%s %d%s mix", source, channels, av_get_sample_fmt_name(format));
+	t->mixTime = metric_timer(t->mixName);
+	SDL_snprintf(t->swrName, sizeof(t->swrName), "%s %d%s swr", source, channels, av_get_sample_fmt_name(format));
+	t->swrTime = metric_timer(t->swrName);
+}
+
+static void target_free(MixTarget *t) {
+	swr_free(&t->swr);
+	av_free(t->mixOut);
+	av_free(t->swrOut);
+}
+
+static void target_run(MixTarget *t, const uint8_t *const *src, enum AVSampleFormat format,
+					   int inChannels, int samples) {
+	int size = samples * t->channels * av_get_bytes_per_sample(t->format);
+	Uint64 start;
+
+	if(size > t->outSize) {
+		av_free(t->mixOut);
+		av_free(t->swrOut);
+		t->mixOut = (uint8_t *)av_malloc(size);
+		t->swrOut = (uint8_t *)av_malloc(size);
+		t->outSize = size;
+	}
+
+	start = metric_time_begin();
+	audio_mix(t->mixOut, t->format, t->channels, src, format, inChannels, t->matrix, samples);
+	metric_time_end(t->mixTime, start);
+
+	if(!t->swr) {
+		return;
+	}
+
+	start = metric_time_begin();
+	swr_convert(t->swr, &t->swrOut, samples, (const uint8_t **)src, samples);
+	metric_time_end(t->swrTime, start);
+
+	// The first few frames are enough to see they agree.
+	if(t->checked++ < 16) {
+		for(int i = 0; i < samples * t->channels; i++) {
+			double a, b;
+
+			if(t->format == AV_SAMPLE_FMT_S16) {
+				a = ((int16_t *)t->mixOut)[i] / 32768.0;
+				b = ((int16_t *)t->swrOut)[i] / 32768.0;
+			} else {
+				a = ((float *)t->mixOut)[i];
+				b = ((float *)t->swrOut)[i];
+			}
+			if(fabs(a - b) > t->maxDiff) {
+				t->maxDiff = fabs(a - b);
+			}
+		}
+	}
+}
+
+static void bench_init(MixBench *b, const char *source, uint64_t layout, enum AVSampleFormat format, int rate) {
+	memset(b, 0, sizeof(MixBench));
+	b->rate = rate;
+	target_init(&b->targets[0], source, 2, AV_SAMPLE_FMT_FLT, layout, format, rate);
+	target_init(&b->targets[1], source, 2, AV_SAMPLE_FMT_S16, layout, format, rate);
+	target_init(&b->targets[2], source, 6, AV_SAMPLE_FMT_FLT, layout, format, rate);
+}
+
+static void bench_frame(MixBench *b, const uint8_t *const *src, enum AVSampleFormat format,
+						int inChannels, int samples) {
+	for(int i = 0; i < TARGETS; i++) {
+		target_run(&b->targets[i], src, format, inChannels, samples);
+	}
+	b->frames++;
+	b->samples += samples;
+}
+
+static void bench_report(MixBench *b, const char *title) {
+	double seconds = (double)b->samples / b->rate;
+
+	printf("\n%s: %d frames of %lld samples, %.1f s of audio\n", title, b->frames,
+		   b->frames ? b->samples / b->frames : 0, seconds);
+	printf("  output      mix us/frame      p99  ms/s audio   swr us/frame      p99  ms/s audio  max diff\n");
+
+	for(int i = 0; i < TARGETS; i++) {
+		MixTarget *t = &b->targets[i];
+		MetricSnapshot mix, swr;
+
+		memset(&swr, 0, sizeof(swr));
+		if(!metrics_find(t->mixName, &mix) || mix.count == 0) {
+			continue;
+		}
+		metrics_find(t->swrName, &swr);
+
+		printf("  %-10s %13.2f %8.2f %11.3f %14.2f %8.2f %11.3f %9.2g\n", t->label,
+			   mix.mean * 1000, mix.p99 * 1000, seconds > 0 ? mix.mean * mix.count / seconds : 0.0,
+			   swr.mean * 1000, swr.p99 * 1000, seconds > 0 ? swr.mean * swr.count / seconds : 0.0,
+			   t->maxDiff);
+	}
+}
+
+static void bench_free(MixBench *b) {
+	for(int i = 0; i < TARGETS; i++) {
+		target_free(&b->targets[i]);
+	}
+}
+
+// Frames shaped like a decoder's, cycled through so it isn't all one
+// buffer sitting in the cache.
+static void bench_synthetic(const char *source, enum AVSampleFormat format, int frameSamples, int frames) {
+	const int rate = 48000, channels = 8, buffers = 64;
+	uint64_t layout = AV_CH_LAYOUT_7POINT1;
+	int planar = av_sample_fmt_is_planar(format);
+	int bytes = av_get_bytes_per_sample(format);
+	uint8_t *data = (uint8_t *)av_malloc(buffers * frameSamples * channels * bytes);
+	const uint8_t *planes[AUDIO_MIX_MAX_CHANNELS];
+	MixBench b;
+
+	srand(1234);
+	for(int i = 0; i < buffers * frameSamples * channels; i++) {
+		float v = (float)rand() / RAND_MAX * 1.8f - 0.9f;
+
+		if(format == AV_SAMPLE_FMT_S32) {
+			((int32_t *)data)[i] = (int32_t)(v * 2147483647.0);
+		} else {
+			((float *)data)[i] = v;
+		}
+	}
+
+	bench_init(&b, source, layout, format, rate);
+
+	for(int f = 0; f < frames; f++) {
+		uint8_t *frame = data + (f % buffers) * frameSamples * channels * bytes;
+
+		for(int c = 0; c < channels; c++) {
+			planes[c] = planar ? frame + c * frameSamples * bytes : frame;
+		}
+		bench_frame(&b, planes, format, channels, frameSamples);
+	}
+
+	bench_report(&b, source);
+	bench_free(&b);
+	av_free(data);
+}
+
+static int bench_file(const char *path, int maxFrames) {
+	AVFormatContext *formatCtx = NULL;
+	AVCodecContext *codecCtx;
+	AVCodec *codec;
+	AVFrame *frame;
+	AVPacket packet;
+	MixBench b;
+	uint64_t layout;
+	int stream;
+
+	if(avformat_open_input(&formatCtx, path, NULL, NULL) != 0
+			|| avformat_find_stream_info(formatCtx, NULL) < 0) {
+		fprintf(stderr, "Can't open %s\n", path);
+		return 1;
+	}
+
+	stream = av_find_best_stream(formatCtx, AVMEDIA_TYPE_AUDIO, -1, -1, &codec, 0);
+	if(stream < 0) {
+		fprintf(stderr, "%s has no audio\n", path);
+		avformat_close_input(&formatCtx);
+		return 1;
+	}
+	codecCtx = formatCtx->streams[stream]->codec;
+	if(avcodec_open2(codecCtx, codec, NULL) < 0) {
+		fprintf(stderr, "Can't decode %s\n", codec->name);
+		avformat_close_input(&formatCtx);
+		return 1;
+	}
+
+	layout = codecCtx->channel_layout;
+	if(!layout || av_get_channel_layout_nb_channels(layout) != codecCtx->channels) {
+		layout = av_get_default_channel_layout(codecCtx->channels);
+	}
+	printf("%s: %s, %s, %d Hz, %d channels\n", path, codec->name,
+		   av_get_sample_fmt_name(codecCtx->sample_fmt), codecCtx->sample_rate, codecCtx->channels);
+
+	bench_init(&b, "file", layout, codecCtx->sample_fmt, codecCtx->sample_rate);
+	frame = av_frame_alloc();
+
+	while((maxFrames <= 0 || b.frames < maxFrames) && av_read_frame(formatCtx, &packet) >= 0) {
+		AVPacket rest = packet;
+
+		while(packet.stream_index == stream && rest.size > 0) {
+			int gotFrame = 0;
+			int used = avcodec_decode_audio4(codecCtx, frame, &gotFrame, &rest);
+
+			if(used < 0) {
+				break;
+			}
+			rest.data += used;
+			rest.size -= used;
+
+			if(gotFrame) {
+				bench_frame(&b, frame->extended_data, (enum AVSampleFormat)frame->format,
+							codecCtx->channels, frame->nb_samples);
+			}
+		}
+		av_free_packet(&packet);
+	}
+
+	bench_report(&b, path);
+	bench_free(&b);
+	av_frame_free(&frame);
+	avcodec_close(codecCtx);
+	avformat_close_input(&formatCtx);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	int maxFrames = (argc > 2) ? atoi(argv[2]) : 0;
+
+	SDL_Init(0);
+	av_register_all();
+	metrics_set_enabled(1);
+
+	if(argc > 1) {
+		return bench_file(argv[1], maxFrames);
+	}
+
+	bench_synthetic("truehd", AV_SAMPLE_FMT_S32, 40, maxFrames > 0 ? maxFrames : 48000 * 60 / 40);
+	bench_synthetic("dts", AV_SAMPLE_FMT_FLTP, 512, maxFrames > 0 ? maxFrames : 48000 * 60 / 512);
+
+	SDL_Quit();
+	return 0;
+}
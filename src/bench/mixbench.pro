@@ -0,0 +1,22 @@
+TEMPLATE = app
+CONFIG += console
+CONFIG -= qt
+
+TARGET = ../../mixbench
+
+INCLUDEPATH += ../../../SDL2-2.0.3/include
+INCLUDEPATH += ../../../ffmpeg-20140528-git-bbc10a1-win32-dev/include
+LIBS += ../../../SDL2-2.0.3/lib/x86/SDL2.lib
+LIBS += ../../../SDL2-2.0.3/lib/x86/SDL2main.lib
+
+# FFmpeg libs
+LIBS += -L../../../ffmpeg-20140528-git-bbc10a1-win32-dev/lib/
+LIBS += -lavformat -lavcodec -lavutil -lswresample
+
+SOURCES += mixbench.cpp \
+	../audioconvert.cpp \
+	../metrics.cpp
+
+HEADERS += \
+	../audioconvert.h \
+	../metrics.h
@@ -0,0 +1,115 @@
+// Checks PcmRing across its positions wrapping. Each run starts the ring
+// at 0, or just short of 2^31 or 2^32 bytes, with a discard from long
+// ago still in it, placed so that it comes back within 2^31 of the read
+// position a quarter of the way through. Bytes are pushed and pulled in
+// uneven chunks, with the occasional discard in the second half, and
+// every byte read is checked against the position it was written at.
+//
+// Needs nothing but SDL and runs in a second. Returns non-zero on the
+// first thing that's wrong.
+
+#include "../pcmring.h"
+#include <SDL.h>
+#include <stdio.h>
+
+/* small, so the positions go round it many times */
+#define CAPACITY 4096
+/* bytes pushed through each run, enough to pass the old discard */
+#define RUN_BYTES 0x40000
+
+static unsigned int s_rand = 1;
+
+static int next_rand(int n) {
+	s_rand = s_rand * 1103515245 + 12345;
+	return (s_rand >> 16) % n;
+}
+
+static Uint8 pattern(unsigned int pos) {
+	return (Uint8)(pos ^ (pos >> 8) ^ (pos >> 24));
+}
+
+static int fail(const char *what, unsigned int start, unsigned int pos) {
+	printf("FAIL: %s, run from 0x%08x at 0x%08x\n", what, start, pos);
+	return 1;
+}
+
+static int run(unsigned int start) {
+	PcmRing ring;
+	Uint8 buf[CAPACITY];
+	unsigned int lastRead = start, discarded = 0, pendingDiscard = 0;
+	int result = 0;
+
+	pcm_ring_init(&ring, CAPACITY);
+
+	// As if the ring had been playing for a long time and was last
+	// discarded, and that skipped, 2^31 bytes ago less a little.
+	SDL_AtomicSet(&ring.windex, (int)start);
+	SDL_AtomicSet(&ring.rindex, (int)start);
+	SDL_AtomicSet(&ring.discard, (int)(start + 0x80000000u + RUN_BYTES / 4));
+	SDL_AtomicSet(&ring.discards, 1);
+	SDL_AtomicSet(&ring.skipped, 1);
+
+	while(lastRead - start < RUN_BYTES && !result) {
+		unsigned int windex = pcm_ring_write_pos(&ring);
+		unsigned int rpos;
+		int len, got;
+
+		len = next_rand(CAPACITY / 2);
+		for(int i = 0; i < len; i++) {
+			buf[i] = pattern(windex + i);
+		}
+		pcm_ring_write(&ring, buf, len);
+
+		// None until the old one has been passed, they'd replace it.
+		if(lastRead - start > RUN_BYTES / 2 && next_rand(64) == 0) {
+			pcm_ring_discard(&ring);
+			pendingDiscard = 1;
+			discarded = pcm_ring_write_pos(&ring);
+		}
+
+		if(pcm_ring_fill(&ring) < 0 || pcm_ring_fill(&ring) > CAPACITY) {
+			result = fail("fill out of range", start, lastRead);
+		} else if(pcm_ring_space(&ring) < 0 || pcm_ring_space(&ring) > CAPACITY) {
+			result = fail("space out of range", start, lastRead);
+		}
+
+		rpos = pcm_ring_read_pos(&ring);
+		if(pendingDiscard && rpos != discarded) {
+			result = fail("discard not honoured", start, rpos);
+		} else if(!pendingDiscard && rpos != lastRead) {
+			result = fail("read position jumped", start, rpos);
+		}
+
+		len = next_rand(CAPACITY / 2);
+		got = pcm_ring_read(&ring, buf, len);
+		for(int i = 0; i < got && !result; i++) {
+			if(buf[i] != pattern(rpos + i)) {
+				result = fail("wrong byte read", start, rpos + i);
+			}
+		}
+
+		// Any read skips the discard, even one that gets nothing.
+		pendingDiscard = 0;
+		lastRead = rpos + got;
+		if(pcm_ring_read_pos(&ring) != lastRead) {
+			result = fail("read position moved after a read", start, pcm_ring_read_pos(&ring));
+		}
+	}
+
+	pcm_ring_destroy(&ring);
+	return result;
+}
+
+int main(int argc, char *argv[]) {
+	unsigned int starts[] = { 0, 0x7fff0000u, 0xfffe0000u };
+	int failed = 0;
+
+	for(int i = 0; i < (int)(sizeof(starts) / sizeof(starts[0])); i++) {
+		failed |= run(starts[i]);
+	}
+
+	if(!failed) {
+		printf("OK\n");
+	}
+	return failed;
+}
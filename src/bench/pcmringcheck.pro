@@ -0,0 +1,15 @@
+TEMPLATE = app
+CONFIG += console
+CONFIG -= qt
+
+TARGET = ../../pcmringcheck
+
+INCLUDEPATH += ../../../SDL2-2.0.3/include
+LIBS += ../../../SDL2-2.0.3/lib/x86/SDL2.lib
+LIBS += ../../../SDL2-2.0.3/lib/x86/SDL2main.lib
+
+SOURCES += pcmringcheck.cpp \
+	../pcmring.cpp
+
+HEADERS += \
+	../pcmring.h
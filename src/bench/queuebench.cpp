@@ -0,0 +1,174 @@
+// Microbenchmark for the packet queue: the old malloc-per-packet linked
+// list with a mutex and condvar against the lock-free SPSC ring in
+// packetqueue.cpp. One producer thread and one consumer thread move
+// empty packets (no payload, so only the queue itself is measured).
+//
+// Usage: queuebench [packets]
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+#include "../packetqueue.h"
+#include <SDL.h>
+#include <SDL_thread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The linked-list queue as it was in video.cpp. */
+typedef struct ListQueue {
+	AVPacketList *first_pkt, *last_pkt;
+	int nb_packets;
+	int size;
+	int abort_request;
+	SDL_mutex *mutex;
+	SDL_cond *cond;
+} ListQueue;
+
+static void list_queue_init(ListQueue *q) {
+	memset(q, 0, sizeof(ListQueue));
+	q->mutex = SDL_CreateMutex();
+	q->cond = SDL_CreateCond();
+}
+
+static int list_queue_put(ListQueue *q, AVPacket *pkt) {
+	AVPacketList *pkt1;
+
+	if(av_dup_packet(pkt) < 0) {
+		return -1;
+	}
+
+	pkt1 = (AVPacketList*)av_malloc(sizeof(AVPacketList));
+
+	if(!pkt1) {
+		return -1;
+	}
+
+	pkt1->pkt = *pkt;
+	pkt1->next = NULL;
+
+	SDL_LockMutex(q->mutex);
+
+	if(!q->last_pkt) {
+		q->first_pkt = pkt1;
+
+	} else {
+		q->last_pkt->next = pkt1;
+	}
+
+	q->last_pkt = pkt1;
+	q->nb_packets++;
+	q->size += pkt1->pkt.size;
+	SDL_CondSignal(q->cond);
+
+	SDL_UnlockMutex(q->mutex);
+	return 0;
+}
+
+static int list_queue_get(ListQueue *q, AVPacket *pkt) {
+	AVPacketList *pkt1;
+	int ret;
+
+	SDL_LockMutex(q->mutex);
+
+	for(;;) {
+		pkt1 = q->first_pkt;
+
+		if(pkt1) {
+			q->first_pkt = pkt1->next;
+
+			if(!q->first_pkt) {
+				q->last_pkt = NULL;
+			}
+
+			q->nb_packets--;
+			q->size -= pkt1->pkt.size;
+			*pkt = pkt1->pkt;
+			av_free(pkt1);
+			ret = 1;
+			break;
+
+		} else if(q->abort_request) {
+			ret = -1;
+			break;
+
+		} else {
+			SDL_CondWait(q->cond, q->mutex);
+		}
+	}
+
+	SDL_UnlockMutex(q->mutex);
+	return ret;
+}
+
+typedef struct BenchState {
+	ListQueue   listq;
+	PacketQueue ringq;
+	int         use_ring;
+	int         nb_packets;
+} BenchState;
+
+static int producer_thread(void *arg) {
+	BenchState *bs = (BenchState *)arg;
+	AVPacket pkt;
+
+	for(int i = 0; i < bs->nb_packets; i++) {
+		av_init_packet(&pkt);
+		pkt.data = NULL;
+		pkt.size = 4096;
+
+		if(bs->use_ring) {
+			packet_queue_put(&bs->ringq, &pkt);
+		} else {
+			list_queue_put(&bs->listq, &pkt);
+		}
+	}
+
+	return 0;
+}
+
+static double run(BenchState *bs, int use_ring) {
+	AVPacket pkt;
+	Uint64 start, end;
+	SDL_Thread *producer;
+
+	bs->use_ring = use_ring;
+	start = SDL_GetPerformanceCounter();
+	producer = SDL_CreateThread(producer_thread, "producer", bs);
+
+	for(int i = 0; i < bs->nb_packets; i++) {
+		if(use_ring) {
+			packet_queue_get(&bs->ringq, &pkt, 1);
+		} else {
+			list_queue_get(&bs->listq, &pkt);
+		}
+	}
+
+	SDL_WaitThread(producer, NULL);
+	end = SDL_GetPerformanceCounter();
+
+	return double(end - start) * 1e9 / double(SDL_GetPerformanceFrequency()) / bs->nb_packets;
+}
+
+int main(int argc, char *argv[]) {
+	BenchState bs;
+
+	bs.nb_packets = (argc > 1) ? atoi(argv[1]) : 2000000;
+
+	SDL_Init(SDL_INIT_TIMER);
+	list_queue_init(&bs.listq);
+	packet_queue_init(&bs.ringq, PACKET_QUEUE_DEFAULT_CAPACITY);
+
+	// Warm up both before measuring.
+	run(&bs, 0);
+	run(&bs, 1);
+
+	printf("%d packets\n", bs.nb_packets);
+	printf("linked list queue: %7.1f ns/packet\n", run(&bs, 0));
+	printf("spsc ring queue:   %7.1f ns/packet\n", run(&bs, 1));
+
+	packet_queue_destroy(&bs.ringq);
+	SDL_Quit();
+	return 0;
+}
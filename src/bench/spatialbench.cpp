@@ -0,0 +1,111 @@
+// Benchmark for spatialaudio.cpp: renders made up audio in the layouts
+// films come in, with the head turning so speakers keep crossing to new
+// filter directions, and reports how much of one core it takes. The
+// player renders in the audio callback, so the block has to be done well
+// inside the time it plays for, and a callback's worth of blocks well
+// inside the callback period.
+//
+// Usage: spatialbench [seconds of audio per layout]
+
+extern "C" {
+#include <libavutil/channel_layout.h>
+#include <libavutil/mem.h>
+}
+
+#include "../spatialaudio.h"
+#include "../metrics.h"
+#include <SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define RATE 48000
+/* SDL_AUDIO_BUFFER_SIZE in video.cpp, frames per callback */
+#define CALLBACK_FRAMES 2048
+/* degrees a second the head turns, back and forth through 180 */
+#define TURN_RATE 90.0
+
+typedef struct SpatialLayout {
+	const char *name;
+	uint64_t layout;
+} SpatialLayout;
+
+static const SpatialLayout layouts[] = {
+	{ "mono", AV_CH_LAYOUT_MONO },
+	{ "stereo", AV_CH_LAYOUT_STEREO },
+	{ "5.1", AV_CH_LAYOUT_5POINT1 },
+	{ "7.1", AV_CH_LAYOUT_7POINT1 }
+};
+
+static void bench_layout(const SpatialLayout *l, double seconds) {
+	const int buffers = 64;
+	int channels = av_get_channel_layout_nb_channels(l->layout);
+	int blocks = (int)(seconds * RATE / SPATIAL_BLOCK);
+	float *in = (float *)av_malloc(buffers * SPATIAL_BLOCK * channels * sizeof(float));
+	float out[SPATIAL_BLOCK * 2];
+	double blockMs = SPATIAL_BLOCK * 1000.0 / RATE;
+	double callbackMs = CALLBACK_FRAMES * 1000.0 / RATE;
+	double createMs, peak = 0;
+	char name[64];
+	Metric *timer;
+	MetricSnapshot m;
+	SpatialRenderer *r;
+	Uint64 start;
+
+	for(int i = 0; i < buffers * SPATIAL_BLOCK * channels; i++) {
+		in[i] = (float)rand() / RAND_MAX * 1.8f - 0.9f;
+	}
+
+	start = SDL_GetPerformanceCounter();
+	r = spatial_create(l->layout, RATE);
+	createMs = (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+
+	SDL_snprintf(name, sizeof(name), "spatial %s", l->name);
+	timer = metric_timer(name);
+
+	for(int b = 0; b < blocks; b++) {
+		double t = (double)b * SPATIAL_BLOCK / RATE;
+		double yaw = (90 - fabs(fmod(t * TURN_RATE, 360.0) - 180)) * 3.14159265358979323846 / 180;
+		float q[4] = { 0, (float)sin(yaw / 2), 0, (float)cos(yaw / 2) };
+
+		spatial_set_orientation(q);
+		start = metric_time_begin();
+		spatial_render(r, out, in + (b % buffers) * SPATIAL_BLOCK * channels);
+		metric_time_end(timer, start);
+
+		for(int i = 0; i < SPATIAL_BLOCK * 2; i++) {
+			if(fabs(out[i]) > peak) {
+				peak = fabs(out[i]);
+			}
+		}
+	}
+
+	metrics_find(name, &m);
+	printf("  %-8s %3d %9.1f %11.2f %8.2f %7.2f %9.2f %10.2f %8.2f %6.2f\n", l->name, channels, createMs,
+		   m.mean * 1000, m.p99 * 1000, m.mean / blockMs * 100, m.mean / blockMs * 100 / channels,
+		   m.mean * CALLBACK_FRAMES / SPATIAL_BLOCK, callbackMs / (m.mean * CALLBACK_FRAMES / SPATIAL_BLOCK), peak);
+
+	spatial_destroy(r);
+	av_free(in);
+}
+
+int main(int argc, char *argv[]) {
+	double seconds = (argc > 1) ? atof(argv[1]) : 60;
+
+	SDL_Init(0);
+	metrics_set_enabled(1);
+	srand(1234);
+
+	printf("%.0f s of audio per layout at %d Hz, blocks of %d frames (%.2f ms), callbacks of %d (%.1f ms)\n",
+		   seconds, RATE, SPATIAL_BLOCK, SPATIAL_BLOCK * 1000.0 / RATE, CALLBACK_FRAMES,
+		   CALLBACK_FRAMES * 1000.0 / RATE);
+	printf("  layout    ch create ms  us/block      p99    cpu%% cpu%%/ch callback ms headroom   peak\n");
+
+	for(int i = 0; i < (int)(sizeof(layouts) / sizeof(layouts[0])); i++) {
+		bench_layout(&layouts[i], seconds);
+	}
+
+	SDL_Quit();
+	return 0;
+}
@@ -0,0 +1,230 @@
+// Headless A/V sync test. Plays a generated stream with a white flash
+// and a 1 kHz beep at the start of every second, through the audio device
+// in real time, with no window or HMD: a loop standing in for the render
+// loop puts pictures up at 75 Hz. For the default hour that's long
+// enough for the sound card's clock to drift well away from the system's
+// if nothing held them together.
+//
+// The beep is found in what's actually handed to the device, through
+// video_set_audio_tap(), and timed by when that buffer will be heard.
+// The flash is timed by the display time of the refresh that put it up.
+// Neither goes through the player's audio clock, so a clock that's wrong
+// shows up here even though the sync loop has steered it to zero. The
+// offset is the beep's time less the flash's. Once the sync loop has had
+// time to settle, drift is how far that moves from where it started. It
+// fails, with exit code 2, if the drift ever reaches a video frame. The
+// player's own idea of the offset is printed alongside.
+//
+// The audio period can be given to try a low latency one, which also
+// fails the run if the audio ever runs dry. The output latency is only
+// estimated unless it's given too, so the offset is exact only then, but
+// the drift doesn't depend on it.
+//
+// A run of a couple of minutes, e.g. syncbench 120, is enough to check
+// the test itself works, through to the end of the stream.
+//
+// Usage: syncbench [seconds] [fps] [period frames] [latency ms]
+
+#include "../video.h"
+#include "../metrics.h"
+#include <SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/* how often the stand-in render loop runs */
+#define REFRESH_RATE 75.0
+/* seconds the sync loop gets to settle before drift is measured */
+#define SETTLE_SECONDS 30
+/* flashes averaged for the offset drift is measured from */
+#define REFERENCE_FLASHES 10
+/* a beep starts at the first sample this loud after BEEP_GAP_SECONDS
+   of quiet. The sine is an eighth of full scale */
+#define BEEP_THRESHOLD 0.01
+#define BEEP_GAP_SECONDS 0.5
+/* beeps and flashes are further apart than this, so one this close is
+   the beep that goes with a flash */
+#define MATCH_SECONDS 0.5
+#define HISTORY 8
+
+// Filled in on the audio callback's thread.
+typedef struct BeepDetector {
+	SDL_SpinLock lock;
+	double onsets[HISTORY]; /* heard times, the last count % HISTORY newest */
+	int count;
+	double lastLoud;        /* only touched by the tap */
+} BeepDetector;
+
+static void beep_tap(void *opaque, const void *samples, int frames, int channels, int isFloat,
+					 int sampleRate, double heardTime) {
+	BeepDetector *d = (BeepDetector *)opaque;
+
+	for(int i = 0; i < frames; i++) {
+		double v = isFloat ? ((const float *)samples)[i * channels]
+				   : ((const Sint16 *)samples)[i * channels] / 32768.0;
+		double t;
+
+		if(fabs(v) < BEEP_THRESHOLD) {
+			continue;
+		}
+
+		t = heardTime + i / (double)sampleRate;
+		if(t - d->lastLoud > BEEP_GAP_SECONDS) {
+			SDL_AtomicLock(&d->lock);
+			d->onsets[d->count++ % HISTORY] = t;
+			SDL_AtomicUnlock(&d->lock);
+		}
+		d->lastLoud = t;
+	}
+}
+
+// The beep heard nearest to flashTime, 0 if there isn't one close enough.
+static int beep_find(BeepDetector *d, double flashTime, double *beepTime) {
+	int found = 0;
+
+	SDL_AtomicLock(&d->lock);
+	for(int i = 0; i < HISTORY && i < d->count; i++) {
+		double t = d->onsets[i];
+
+		if(fabs(t - flashTime) < MATCH_SECONDS && (!found || fabs(t - flashTime) < fabs(*beepTime - flashTime))) {
+			*beepTime = t;
+			found = 1;
+		}
+	}
+	SDL_AtomicUnlock(&d->lock);
+	return found;
+}
+
+int main(int argc, char *argv[]) {
+	int seconds = (argc > 1) ? atoi(argv[1]) : 3600;
+	int fps = (argc > 2) ? atoi(argv[2]) : 24;
+	int period = (argc > 3) ? atoi(argv[3]) : 0;
+	char source[1024];
+	VideoState *video;
+	VideoStats stats;
+	BeepDetector beeps;
+	unsigned int serial = 0;
+	int lastBright = 0, flashes = 0, unmatched = 0, referenceCount = 0, nextReport = 60;
+	double reference = 0, offset = 0, drift = 0, maxDrift = 0, frameMs = 1000.0 / fps;
+	double pendingFlash = 0, start, next;
+
+	// The flash is the first frame of each second and the beep the first
+	// 50 ms, the rest is black and silent.
+	SDL_snprintf(source, sizeof(source),
+				 "lavfi:color=c=black:s=320x180:r=%d:d=%d[bg];color=c=white:s=320x180:r=%d:d=%d[fl];"
+				 "[bg][fl]overlay=enable='lt(mod(t,1),%f)'[out0];"
+				 "sine=f=1000:r=48000:d=%d,volume=volume=0:enable='gte(mod(t,1),0.05)'[out1]",
+				 fps, seconds, fps, seconds, 0.5 / fps, seconds);
+
+	SDL_Init(SDL_INIT_AUDIO);
+	metrics_set_enabled(1);
+	if(period > 0) {
+		video_set_audio_period(period);
+	}
+	if(argc > 4) {
+		video_set_audio_latency(atof(argv[4]) / 1000);
+	}
+
+	memset(&beeps, 0, sizeof(beeps));
+
+	video = video_open(source, VIDEO_OUTPUT_YUV, VIDEO_OPEN_PAUSED);
+	if(!video) {
+		fprintf(stderr, "Can't play the test stream\n");
+		return 1;
+	}
+	video_set_audio_tap(video, beep_tap, &beeps);
+	video_start(video);
+
+	printf("%d s at %d fps, failing at %.1f ms of drift\n", seconds, fps, frameMs);
+
+	start = next = video_get_time();
+	while(!video_is_finished(video, video_get_time())) {
+		VideoFrame frame;
+		double now, beepTime;
+
+		// Paced like the render loop, each refresh for the frame after.
+		next += 1.0 / REFRESH_RATE;
+		now = video_get_time();
+		if(next > now) {
+			SDL_Delay((Uint32)((next - now) * 1000));
+		}
+		video_refresh(video, next);
+
+		// A beep that's late may not have gone to the device yet when its
+		// flash goes up, so each flash is matched once it can't come any
+		// later.
+		if(pendingFlash && next - pendingFlash > MATCH_SECONDS) {
+			if(beep_find(&beeps, pendingFlash, &beepTime)) {
+				offset = (beepTime - pendingFlash) * 1000;
+				flashes++;
+
+				if(referenceCount < REFERENCE_FLASHES) {
+					reference += (offset - reference) / ++referenceCount;
+				} else {
+					drift = offset - reference;
+					maxDrift = (fabs(drift) > fabs(maxDrift)) ? drift : maxDrift;
+				}
+			} else {
+				unmatched++;
+			}
+			pendingFlash = 0;
+		}
+
+		if(video_get_frame_serial(video) == serial || !video_acquire_frame(video, &frame)) {
+			continue;
+		}
+		serial = frame.serial;
+
+		// Any picture bright in the middle is a flash, and the first of a
+		// run is the one at the start of the second.
+		int bright = frame.planes[0][(frame.height / 2) * frame.pitches[0] + frame.width / 2] > 128;
+		video_release_frame(video, &frame);
+
+		if(bright && !lastBright && next - start >= SETTLE_SECONDS) {
+			pendingFlash = next;
+		}
+		lastBright = bright;
+
+		if(next - start >= nextReport) {
+			video_get_stats(video, &stats);
+			printf("  %4d s: offset %6.1f ms, drift %6.1f ms, player's offset %6.1f ms, audio %6.1f ms off, "
+				   "correction %6.0f ppm, %d underruns\n",
+				   nextReport, offset, drift, stats.av_offset, stats.audio_sync_offset, stats.audio_correction,
+				   stats.audio_underruns);
+			fflush(stdout);
+			nextReport += 60;
+		}
+	}
+
+	video_set_audio_tap(video, NULL, NULL);
+	video_get_stats(video, &stats);
+	printf("\n%d flashes measured, %d with no beep near them, offset %.1f ms at the start, drift %.1f ms at worst\n",
+		   flashes, unmatched, reference, maxDrift);
+	printf("%d pictures shown, %d late, %d dropped, %d audio underruns\n",
+		   stats.frames_shown, stats.frames_late, stats.frames_dropped, stats.audio_underruns);
+	printf("Audio latency %.1f ms, %.1f ms buffered and %.1f ms output %s, callbacks every %.2f ms\n",
+		   stats.audio_buffered + stats.audio_latency, stats.audio_buffered, stats.audio_latency,
+		   stats.audio_latency_measured ? "measured" : "estimated", stats.audio_callback_interval);
+
+	video_close(video);
+	SDL_Quit();
+
+	if(flashes <= REFERENCE_FLASHES) {
+		printf("FAIL: too few flashes to measure\n");
+		return 2;
+	}
+	if(unmatched > 0) {
+		printf("FAIL: %d flashes had no beep within %.0f ms\n", unmatched, MATCH_SECONDS * 1000);
+		return 2;
+	}
+	if(period > 0 && stats.audio_underruns > 0) {
+		printf("FAIL: %d underruns with a %d frame period\n", stats.audio_underruns, period);
+		return 2;
+	}
+	if(fabs(maxDrift) >= frameMs) {
+		printf("FAIL: drifted %.1f ms, a frame is %.1f ms\n", maxDrift, frameMs);
+		return 2;
+	}
+	return 0;
+}
@@ -0,0 +1,48 @@
+TEMPLATE = app
+CONFIG += console
+CONFIG -= qt
+
+TARGET = ../../syncbench
+
+INCLUDEPATH += ../../../SDL2-2.0.3/include
+INCLUDEPATH += ../../../ffmpeg-20140528-git-bbc10a1-win32-dev/include
+LIBS += ../../../SDL2-2.0.3/lib/x86/SDL2.lib
+LIBS += ../../../SDL2-2.0.3/lib/x86/SDL2main.lib
+
+# FFmpeg libs
+LIBS += -L../../../ffmpeg-20140528-git-bbc10a1-win32-dev/lib/
+LIBS += -lavdevice -lavformat -lavcodec -lavutil -lswscale -lswresample
+
+SOURCES += syncbench.cpp \
+	../video.cpp \
+	../packetqueue.cpp \
+	../keyframeindex.cpp \
+	../yuvconvert.cpp \
+	../workerpool.cpp \
+	../frameconvert.cpp \
+	../framepool.cpp \
+	../mappedio.cpp \
+	../readahead.cpp \
+	../pcmring.cpp \
+	../audioconvert.cpp \
+	../spatialaudio.cpp \
+	../streamcache.cpp \
+	../metrics.cpp \
+	../trace.cpp
+
+HEADERS += \
+	../video.h \
+	../packetqueue.h \
+	../keyframeindex.h \
+	../yuvconvert.h \
+	../workerpool.h \
+	../frameconvert.h \
+	../framepool.h \
+	../mappedio.h \
+	../readahead.h \
+	../pcmring.h \
+	../audioconvert.h \
+	../spatialaudio.h \
+	../streamcache.h \
+	../metrics.h \
+	../trace.h
@@ -0,0 +1,194 @@
+// Benchmark for the YUV->RGBA conversion: the sws_scale call the player
+// used to make for every picture against the scalar, SSE2 and AVX2
+// kernels in yuvconvert.cpp, at 1080p and 2160p. Also checks the SIMD
+// kernels give the same output as the scalar reference. Then times the
+// best kernel split into bands across 1..N worker threads at 2160p.
+//
+// Usage: yuvbench [frames] [max threads]
+
+extern "C" {
+#include <libavutil/avutil.h>
+#include <libavutil/time.h>
+#include <libswscale/swscale.h>
+}
+
+#include "../yuvconvert.h"
+#include "../workerpool.h"
+#include "../frameconvert.h"
+#include <SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct TestImage {
+	int width, height;
+	YuvFormat format;
+	uint8_t *planes[3];
+	int pitches[3];
+} TestImage;
+
+static void test_image_alloc(TestImage *img, int width, int height, YuvFormat format) {
+	int cw = (width + 1) / 2;
+	int ch = (height + 1) / 2;
+
+	memset(img, 0, sizeof(TestImage));
+	img->width = width;
+	img->height = height;
+	img->format = format;
+
+	img->pitches[0] = width;
+	img->planes[0] = (uint8_t*)av_malloc(width * height);
+
+	if(format == YUV_FORMAT_NV12) {
+		img->pitches[1] = cw * 2;
+		img->planes[1] = (uint8_t*)av_malloc(cw * 2 * ch);
+	} else {
+		img->pitches[1] = img->pitches[2] = cw;
+		img->planes[1] = (uint8_t*)av_malloc(cw * ch);
+		img->planes[2] = (uint8_t*)av_malloc(cw * ch);
+	}
+
+	// Noise, so nothing gets lucky with branch prediction or caching.
+	srand(1234);
+	for(int i = 0; i < width * height; i++)
+		img->planes[0][i] = (uint8_t)rand();
+	for(int p = 1; p < 3; p++) {
+		if(img->planes[p]) {
+			for(int i = 0; i < img->pitches[p] * ch; i++)
+				img->planes[p][i] = (uint8_t)rand();
+		}
+	}
+}
+
+static void test_image_free(TestImage *img) {
+	for(int p = 0; p < 3; p++)
+		av_free(img->planes[p]);
+}
+
+static double bench_sws(TestImage *img, uint8_t *dst, int frames) {
+	AVPixelFormat srcFmt = (img->format == YUV_FORMAT_NV12) ? AV_PIX_FMT_NV12 : AV_PIX_FMT_YUV420P;
+	struct SwsContext *ctx = sws_getContext(img->width, img->height, srcFmt,
+											img->width, img->height, AV_PIX_FMT_RGBA,
+											SWS_BILINEAR, NULL, NULL, NULL);
+	uint8_t *dstPlanes[4] = { dst, NULL, NULL, NULL };
+	int dstPitches[4] = { img->width * 4, 0, 0, 0 };
+	int64_t start;
+
+	start = av_gettime();
+	for(int i = 0; i < frames; i++) {
+		sws_scale(ctx, (const uint8_t * const *)img->planes, img->pitches, 0, img->height,
+				  dstPlanes, dstPitches);
+	}
+
+	sws_freeContext(ctx);
+	return (av_gettime() - start) / 1000.0 / frames;
+}
+
+static double bench_kernel(TestImage *img, uint8_t *dst, int frames) {
+	YuvCoeffs coeffs;
+	int64_t start;
+
+	yuv_get_coeffs(YUV_MATRIX_BT709, 0, &coeffs);
+
+	start = av_gettime();
+	for(int i = 0; i < frames; i++) {
+		yuv_convert(img->planes, img->pitches, img->format, &coeffs,
+					dst, img->width * 4, RGB_FORMAT_RGBA, img->width, 0, img->height);
+	}
+
+	return (av_gettime() - start) / 1000.0 / frames;
+}
+
+static double bench_threads(TestImage *img, uint8_t *dst, int frames, int threads) {
+	AVPixelFormat srcFmt = (img->format == YUV_FORMAT_NV12) ? AV_PIX_FMT_NV12 : AV_PIX_FMT_YUV420P;
+	WorkerPool *pool = worker_pool_create(threads);
+	YuvCoeffs coeffs;
+	FrameConverter *fc;
+	uint8_t *dstPlanes[4] = { dst, NULL, NULL, NULL };
+	int dstPitches[4] = { img->width * 4, 0, 0, 0 };
+	int64_t start;
+
+	yuv_get_coeffs(YUV_MATRIX_BT709, 0, &coeffs);
+	fc = frame_converter_create(pool, img->width, img->height, srcFmt, AV_PIX_FMT_RGBA, &coeffs);
+
+	start = av_gettime();
+	for(int i = 0; i < frames; i++) {
+		frame_convert(fc, (const uint8_t * const *)img->planes, img->pitches, dstPlanes, dstPitches);
+	}
+	double ms = (av_gettime() - start) / 1000.0 / frames;
+
+	frame_converter_destroy(fc);
+	worker_pool_destroy(pool);
+	return ms;
+}
+
+int main(int argc, char *argv[]) {
+	const int sizes[2][2] = { { 1920, 1080 }, { 3840, 2160 } };
+	const YuvImpl impls[3] = { YUV_IMPL_SCALAR, YUV_IMPL_SSE2, YUV_IMPL_AVX2 };
+	int frames = (argc > 1) ? atoi(argv[1]) : 50;
+	int maxThreads = (argc > 2) ? atoi(argv[2]) : SDL_GetCPUCount();
+
+	for(int s = 0; s < 2; s++) {
+		for(int f = 0; f < 2; f++) {
+			TestImage img;
+			YuvFormat format = f ? YUV_FORMAT_NV12 : YUV_FORMAT_YUV420P;
+			size_t dstSize = sizes[s][0] * sizes[s][1] * 4;
+			uint8_t *reference = (uint8_t*)av_malloc(dstSize);
+			uint8_t *dst = (uint8_t*)av_malloc(dstSize);
+
+			test_image_alloc(&img, sizes[s][0], sizes[s][1], format);
+			printf("%dx%d %s\n", img.width, img.height, f ? "nv12" : "yuv420p");
+			printf("  %-8s %7.2f ms/frame\n", "sws_scale", bench_sws(&img, dst, frames));
+
+			yuv_set_impl(YUV_IMPL_SCALAR);
+			bench_kernel(&img, reference, 1);
+
+			for(int i = 0; i < 3; i++) {
+				YuvImpl impl = yuv_set_impl(impls[i]);
+				if(impl != impls[i]) {
+					printf("  %-8s not supported by this CPU\n", yuv_impl_name(impls[i]));
+					continue;
+				}
+
+				double ms = bench_kernel(&img, dst, frames);
+				printf("  %-8s %7.2f ms/frame%s\n", yuv_impl_name(impl), ms,
+					   memcmp(dst, reference, dstSize) ? "  MISMATCH vs scalar" : "");
+			}
+
+			test_image_free(&img);
+			av_free(reference);
+			av_free(dst);
+		}
+	}
+
+	// Thread scaling with whichever kernel the CPU supports best.
+	for(int f = 0; f < 2; f++) {
+		TestImage img;
+		YuvFormat format = f ? YUV_FORMAT_NV12 : YUV_FORMAT_YUV420P;
+		size_t dstSize = 3840 * 2160 * 4;
+		uint8_t *reference = (uint8_t*)av_malloc(dstSize);
+		uint8_t *dst = (uint8_t*)av_malloc(dstSize);
+		double single = 0.0;
+
+		test_image_alloc(&img, 3840, 2160, format);
+		yuv_set_impl(YUV_IMPL_AUTO);
+		printf("3840x2160 %s, %s, threaded\n", f ? "nv12" : "yuv420p", yuv_impl_name(YUV_IMPL_AUTO));
+
+		bench_threads(&img, reference, 1, 1);
+
+		for(int t = 1; t <= maxThreads; t++) {
+			double ms = bench_threads(&img, dst, frames, t);
+			if(t == 1) {
+				single = ms;
+			}
+			printf("  %2d threads %7.2f ms/frame  %5.2fx%s\n", t, ms, single / ms,
+				   memcmp(dst, reference, dstSize) ? "  MISMATCH vs 1 thread" : "");
+		}
+
+		test_image_free(&img);
+		av_free(reference);
+		av_free(dst);
+	}
+
+	return 0;
+}
@@ -0,0 +1,24 @@
+TEMPLATE = app
+CONFIG += console
+CONFIG -= qt
+
+TARGET = ../../yuvbench
+
+INCLUDEPATH += ../../../SDL2-2.0.3/include
+INCLUDEPATH += ../../../ffmpeg-20140528-git-bbc10a1-win32-dev/include
+LIBS += ../../../SDL2-2.0.3/lib/x86/SDL2.lib
+LIBS += ../../../SDL2-2.0.3/lib/x86/SDL2main.lib
+
+# FFmpeg libs
+LIBS += -L../../../ffmpeg-20140528-git-bbc10a1-win32-dev/lib/
+LIBS += -lavutil -lswscale
+
+SOURCES += yuvbench.cpp \
+	../yuvconvert.cpp \
+	../workerpool.cpp \
+	../frameconvert.cpp
+
+HEADERS += \
+	../yuvconvert.h \
+	../workerpool.h \
+	../frameconvert.h
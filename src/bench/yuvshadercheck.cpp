@@ -0,0 +1,182 @@
+// Checks the shader-side YUV->RGB conversion against the CPU reference in
+// yuvconvert.cpp. Renders noise test images through the screen shader
+// into an offscreen framebuffer at 1:1 and compares the pixels with
+// yuv_convert(). Chroma is sampled with GL_NEAREST so both sides
+// replicate it the same way, what's compared is the colour maths.
+//
+// Runs on any GL 3.3 driver, e.g. Mesa's software rasteriser with
+// LIBGL_ALWAYS_SOFTWARE=1. Returns non-zero if any channel is off by
+// more than MAX_DIFF.
+
+#include <GL/glew.h>
+#include <SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "../utilities.h"
+#include "../yuvconvert.h"
+
+using namespace std;
+
+#define MAX_DIFF 1
+
+// Externs utilities.cpp expects main.cpp to provide.
+bool g_running = true;
+GLuint program = 0;
+GLint p_matrix_ufm = 0;
+GLint mv_matrix_ufm = 0;
+GLuint texture_ufm = 0;
+GLint u_texture_ufm = 0;
+GLint v_texture_ufm = 0;
+GLint screen_planes_ufm = 0;
+GLint yuv_matrix_ufm = 0;
+GLint yuv_offset_ufm = 0;
+objRenderData room, screen;
+
+static int check(GLuint prog, int width, int height, int planes, YuvMatrix matrix, int fullRange)
+{
+	int cw = (width + 1) / 2;
+	int ch = (height + 1) / 2;
+	vector<unsigned char> y(width * height), u(cw * ch), v(cw * ch), uv(cw * ch * 2);
+	vector<unsigned char> reference(width * height * 4), rendered(width * height * 4);
+
+	srand(width * 31 + planes);
+	for(size_t i = 0; i < y.size(); i++)
+		y[i] = (unsigned char)rand();
+	for(size_t i = 0; i < u.size(); i++) {
+		u[i] = uv[i*2] = (unsigned char)rand();
+		v[i] = uv[i*2 + 1] = (unsigned char)rand();
+	}
+
+	const unsigned char *yuvPlanes[3] = { &y[0], &u[0], &v[0] };
+	int yuvPitches[3] = { width, cw, cw };
+	if(planes == 2) {
+		yuvPlanes[1] = &uv[0];
+		yuvPitches[1] = cw * 2;
+	}
+
+	// CPU reference.
+	YuvCoeffs coeffs;
+	yuv_get_coeffs(matrix, fullRange, &coeffs);
+	yuv_convert(yuvPlanes, yuvPitches, (planes == 2) ? YUV_FORMAT_NV12 : YUV_FORMAT_YUV420P,
+				&coeffs, &reference[0], width * 4, RGB_FORMAT_RGBA, width, 0, height);
+
+	// Shader.
+	initializeScreenTextures(width, height, planes);
+	updateScreenTextures(yuvPlanes, yuvPitches, width, height, planes);
+
+	GLuint chroma[2] = { screen.uTexture, screen.vTexture };
+	for(int i = 0; i < planes - 1; i++) {
+		glBindTexture(GL_TEXTURE_2D, chroma[i]);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	}
+
+	GLuint fbo, colour;
+	glGenFramebuffers(1, &fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glGenTextures(1, &colour);
+	glBindTexture(GL_TEXTURE_2D, colour);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+	glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, colour, 0);
+
+	float matrix3[9], offset[3];
+	float identity[16] = { 1,0,0,0, 0,1,0,0, 0,0,1,0, 0,0,0,1 };
+	yuv_get_matrix(&coeffs, matrix3, offset);
+
+	glViewport(0, 0, width, height);
+	glUseProgram(prog);
+	glUniformMatrix4fv(p_matrix_ufm, 1, GL_TRUE, identity);
+	glUniformMatrix4fv(mv_matrix_ufm, 1, GL_TRUE, identity);
+	glUniformMatrix3fv(yuv_matrix_ufm, 1, GL_TRUE, matrix3);
+	glUniform3fv(yuv_offset_ufm, 1, offset);
+	glUniform1i(screen_planes_ufm, planes);
+	glUniform1i(texture_ufm, 0);
+	glUniform1i(u_texture_ufm, 1);
+	glUniform1i(v_texture_ufm, 2);
+
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, screen.texture);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, screen.uTexture);
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_2D, screen.vTexture);
+	glActiveTexture(GL_TEXTURE0);
+
+	glBindVertexArray(screen.vao);
+	glDrawArrays(GL_TRIANGLES, 0, screen.numTriangles*3);
+	glBindVertexArray(0);
+
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, &rendered[0]);
+
+	// Row 0 of the framebuffer is the bottom of the image.
+	int worst = 0;
+	for(int row = 0; row < height; row++) {
+		const unsigned char *ref = &reference[row * width * 4];
+		const unsigned char *out = &rendered[(height - 1 - row) * width * 4];
+		for(int i = 0; i < width * 4; i++) {
+			int diff = abs(int(ref[i]) - int(out[i]));
+			worst = (diff > worst) ? diff : worst;
+		}
+	}
+
+	printf("%dx%d %-7s %s %-7s max diff %d %s\n", width, height, (planes == 2) ? "nv12" : "yuv420p",
+		   (matrix == YUV_MATRIX_BT709) ? "BT.709" : "BT.601", fullRange ? "full" : "limited",
+		   worst, (worst > MAX_DIFF) ? "FAIL" : "ok");
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glDeleteFramebuffers(1, &fbo);
+	glDeleteTextures(1, &colour);
+	glDeleteTextures(1, &screen.texture);
+	glDeleteTextures(1, &screen.uTexture);
+	if(screen.vTexture)
+		glDeleteTextures(1, &screen.vTexture);
+	screen.uTexture = screen.vTexture = 0;
+
+	return worst <= MAX_DIFF;
+}
+
+int main(int /*argc*/, char * /*argv*/[])
+{
+	SDL_Init(SDL_INIT_VIDEO);
+	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
+	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
+	SDL_Window *window = SDL_CreateWindow("yuvshadercheck", 0, 0, 64, 64, SDL_WINDOW_OPENGL | SDL_WINDOW_HIDDEN);
+	SDL_GLContext context = SDL_GL_CreateContext(window);
+
+	glewExperimental = GL_TRUE;
+	if(glewInit() != GLEW_OK) {
+		printf("glewInit() error.\n");
+		return EXIT_FAILURE;
+	}
+	printf("GL_RENDERER: %s\n", glGetString(GL_RENDERER));
+
+	GLuint prog = initializeProgram();
+
+	// Full viewport quad, top of the image at the top like the real screen.
+	GLfloat verts[] = { -1, 1, 0,  -1, -1, 0,  1, -1, 0,   -1, 1, 0,  1, -1, 0,  1, 1, 0 };
+	GLfloat normals[] = { 0, 0, 1,  0, 0, 1,  0, 0, 1,   0, 0, 1,  0, 0, 1,  0, 0, 1 };
+	GLfloat uvs[] = { 0, 0,  0, 1,  1, 1,   0, 0,  1, 1,  1, 0 };
+	screen.numTriangles = 2;
+	createVAO(screen, verts, normals, uvs);
+
+	bool ok = true;
+	for(int planes = 2; planes <= 3; planes++) {
+		for(int matrix = 0; matrix < 2; matrix++) {
+			for(int fullRange = 0; fullRange < 2; fullRange++) {
+				ok &= check(prog, 256, 128, planes, (YuvMatrix)matrix, fullRange) != 0;
+				ok &= check(prog, 1920, 1080, planes, (YuvMatrix)matrix, fullRange) != 0;
+			}
+		}
+	}
+
+	SDL_GL_DeleteContext(context);
+	SDL_DestroyWindow(window);
+	SDL_Quit();
+
+	printf("%s\n", ok ? "All conversions match." : "Shader conversion doesn't match the CPU reference.");
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,25 @@
+TEMPLATE = app
+CONFIG += console
+CONFIG -= qt
+
+TARGET = ../../yuvshadercheck
+
+INCLUDEPATH += ../../../SDL2-2.0.3/include
+INCLUDEPATH += ../../../glew-1.10.0/include
+INCLUDEPATH += ../../../ovr_sdk_win_0.3.2/OculusSDK/LibOVR/Include
+INCLUDEPATH += ../../../ovr_sdk_win_0.3.2/OculusSDK/LibOVR/Src
+LIBS += ../../../glew-1.10.0/lib/Release/Win32/glew32.lib
+LIBS += ../../../SDL2-2.0.3/lib/x86/SDL2.lib
+LIBS += ../../../SDL2-2.0.3/lib/x86/SDL2main.lib
+LIBS += ../../../ovr_sdk_win_0.3.2/oculusSDK/LibOVR/Lib/Win32/VS2013/libovr.lib
+LIBS += -lwinspool -lgdi32 -luser32 -lkernel32 -lwinmm -lcomdlg32 -ladvapi32 -lshell32 -lole32 -loleaut32 -luuid -lOpenGL32
+
+SOURCES += yuvshadercheck.cpp \
+	../utilities.cpp \
+	../objloader.cpp \
+	../loadtexture.cpp \
+	../yuvconvert.cpp
+
+HEADERS += \
+	../utilities.h \
+	../yuvconvert.h
@@ -17,7 +17,9 @@ LIBS += -lwinspool -lgdi32 -luser32 -lkernel32 -lwinmm -lcomdlg32 -ladvapi32 -ls
 
 # FFmpeg libs
 LIBS += -L../../ffmpeg-20140528-git-bbc10a1-win32-dev/lib/
-LIBS += -lavformat -lavcodec -lavutil -lswscale -lswresample
+LIBS += -lavdevice -lavformat -lavcodec -lavutil -lswscale -lswresample
+
+#DEFINES += CINEMA_TRACE  # Record a Chrome trace of the threads to trace.json next to the exe.
 
 #QMAKE_CXXFLAGS += /FS # Prevents a compiler error.
 #QMAKE_LFLAGS += /ENTRY:"mainCRTStartup"  # Entry point is main not WinMain
@@ -26,12 +28,42 @@ SOURCES += main.cpp \
 	objloader.cpp \
     utilities.cpp \
     loadtexture.cpp \
-    video.cpp
+    video.cpp \
+    packetqueue.cpp \
+    keyframeindex.cpp \
+    yuvconvert.cpp \
+    workerpool.cpp \
+    frameconvert.cpp \
+    framepool.cpp \
+    mappedio.cpp \
+    readahead.cpp \
+    playlist.cpp \
+    streamcache.cpp \
+    metrics.cpp \
+    pcmring.cpp \
+    audioconvert.cpp \
+    spatialaudio.cpp \
+    trace.cpp
 
 HEADERS += \
 	objloader.h \
     utilities.h \
     loadtexture.h \
     todo.h \
-    video.h
+    video.h \
+    packetqueue.h \
+    keyframeindex.h \
+    yuvconvert.h \
+    workerpool.h \
+    frameconvert.h \
+    framepool.h \
+    mappedio.h \
+    readahead.h \
+    playlist.h \
+    streamcache.h \
+    metrics.h \
+    pcmring.h \
+    audioconvert.h \
+    spatialaudio.h \
+    trace.h
 
@@ -0,0 +1,167 @@
+#include "frameconvert.h"
+
+extern "C" {
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+}
+
+#include <string.h>
+
+#define MAX_BANDS 64
+
+// Band boundaries are kept to a multiple of this many rows so they line
+// up with chroma rows for any vertical subsampling swscale handles.
+#define BAND_ALIGN 16
+
+struct FrameConverter {
+	WorkerPool        *pool;
+	int               width, height;
+	int               nb_bands;
+	int               band_start[MAX_BANDS + 1];
+
+	int               use_yuv_convert;
+	YuvFormat         yuv_format;
+	RgbFormat         rgb_format;
+	YuvCoeffs         coeffs;
+
+	struct SwsContext *sws_ctx[MAX_BANDS];
+	int               src_planes, dst_planes;
+	int               src_vshift, dst_vshift;
+
+	/* The picture being converted */
+	const uint8_t *const *src;
+	const int         *src_pitches;
+	uint8_t *const    *dst;
+	const int         *dst_pitches;
+};
+
+// Rows of plane p that band b starts at. Chroma planes (1 and 2) are
+// subsampled, luma and alpha aren't.
+static int plane_row(int row, int plane, int vshift) {
+	return (plane == 1 || plane == 2) ? (row >> vshift) : row;
+}
+
+static void convert_band(void *arg, int band) {
+	FrameConverter *fc = (FrameConverter *)arg;
+	int start = fc->band_start[band];
+	int end = fc->band_start[band + 1];
+
+	if(fc->use_yuv_convert) {
+		yuv_convert(fc->src, fc->src_pitches, fc->yuv_format, &fc->coeffs,
+					fc->dst[0], fc->dst_pitches[0], fc->rgb_format, fc->width, start, end);
+		return;
+	}
+
+	// Each band is a picture of its own as far as its SwsContext is concerned.
+	const uint8_t *src[4] = { NULL, NULL, NULL, NULL };
+	uint8_t *dst[4] = { NULL, NULL, NULL, NULL };
+
+	for(int p = 0; p < fc->src_planes; p++)
+		src[p] = fc->src[p] + plane_row(start, p, fc->src_vshift) * fc->src_pitches[p];
+	for(int p = 0; p < fc->dst_planes; p++)
+		dst[p] = fc->dst[p] + plane_row(start, p, fc->dst_vshift) * fc->dst_pitches[p];
+
+	sws_scale(fc->sws_ctx[band], src, fc->src_pitches, 0, end - start, dst, fc->dst_pitches);
+}
+
+FrameConverter *frame_converter_create(WorkerPool *pool, int width, int height,
+									   enum AVPixelFormat srcFormat, enum AVPixelFormat dstFormat,
+									   const YuvCoeffs *coeffs) {
+	FrameConverter *fc = new FrameConverter();
+	int hshift;
+
+	memset(fc, 0, sizeof(FrameConverter));
+	fc->pool = pool;
+	fc->width = width;
+	fc->height = height;
+
+	// One band per thread, as long as each gets a useful number of rows.
+	fc->nb_bands = worker_pool_size(pool);
+	if(fc->nb_bands > MAX_BANDS) {
+		fc->nb_bands = MAX_BANDS;
+	}
+	while(fc->nb_bands > 1 && height / fc->nb_bands < BAND_ALIGN * 2) {
+		fc->nb_bands--;
+	}
+
+	for(int b = 0; b < fc->nb_bands; b++) {
+		fc->band_start[b] = (height * b / fc->nb_bands) & ~(BAND_ALIGN - 1);
+	}
+	fc->band_start[fc->nb_bands] = height;
+
+	fc->use_yuv_convert = (dstFormat == AV_PIX_FMT_RGBA || dstFormat == AV_PIX_FMT_BGRA);
+	switch(srcFormat) {
+		case AV_PIX_FMT_YUV420P:
+		case AV_PIX_FMT_YUVJ420P:
+			fc->yuv_format = YUV_FORMAT_YUV420P;
+			break;
+
+		case AV_PIX_FMT_NV12:
+			fc->yuv_format = YUV_FORMAT_NV12;
+			break;
+
+		default:
+			fc->use_yuv_convert = 0;
+			break;
+	}
+
+	if(fc->use_yuv_convert) {
+		fc->rgb_format = (dstFormat == AV_PIX_FMT_BGRA) ? RGB_FORMAT_BGRA : RGB_FORMAT_RGBA;
+		fc->coeffs = *coeffs;
+		return fc;
+	}
+
+	fc->src_planes = av_pix_fmt_count_planes(srcFormat);
+	fc->dst_planes = av_pix_fmt_count_planes(dstFormat);
+	av_pix_fmt_get_chroma_sub_sample(srcFormat, &hshift, &fc->src_vshift);
+	av_pix_fmt_get_chroma_sub_sample(dstFormat, &hshift, &fc->dst_vshift);
+
+	for(int b = 0; b < fc->nb_bands; b++) {
+		fc->sws_ctx[b] =
+			sws_getContext
+			(
+				width,
+				fc->band_start[b + 1] - fc->band_start[b],
+				srcFormat,
+				width,
+				fc->band_start[b + 1] - fc->band_start[b],
+				dstFormat,
+				SWS_BILINEAR,
+				NULL,
+				NULL,
+				NULL
+			);
+	}
+
+	return fc;
+}
+
+void frame_converter_destroy(FrameConverter *fc) {
+	if(!fc) {
+		return;
+	}
+
+	for(int b = 0; b < fc->nb_bands; b++) {
+		sws_freeContext(fc->sws_ctx[b]);
+	}
+
+	delete fc;
+}
+
+const char *frame_converter_name(FrameConverter *fc) {
+	return fc->use_yuv_convert ? yuv_impl_name(YUV_IMPL_AUTO) : "swscale";
+}
+
+int frame_converter_bands(FrameConverter *fc) {
+	return fc->nb_bands;
+}
+
+void frame_convert(FrameConverter *fc, const uint8_t *const src[], const int srcPitches[],
+				   uint8_t *const dst[], const int dstPitches[]) {
+	fc->src = src;
+	fc->src_pitches = srcPitches;
+	fc->dst = dst;
+	fc->dst_pitches = dstPitches;
+
+	worker_pool_run(fc->pool, convert_band, fc, fc->nb_bands);
+}
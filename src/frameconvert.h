@@ -0,0 +1,32 @@
+#ifndef FRAMECONVERT_H
+#define FRAMECONVERT_H
+
+extern "C" {
+#include <libavutil/pixfmt.h>
+}
+
+#include "yuvconvert.h"
+#include "workerpool.h"
+
+// Same-size colour conversion of whole pictures, split into horizontal
+// bands that are converted in parallel on a WorkerPool. 4:2:0 to RGBA or
+// BGRA uses the kernels in yuvconvert.cpp; every other combination uses
+// swscale with one SwsContext per band, since a context can't be shared
+// between threads.
+
+struct FrameConverter;
+
+// coeffs is only used by the yuvconvert kernels.
+FrameConverter *frame_converter_create(WorkerPool *pool, int width, int height,
+									   enum AVPixelFormat srcFormat, enum AVPixelFormat dstFormat,
+									   const YuvCoeffs *coeffs);
+void frame_converter_destroy(FrameConverter *fc);
+
+// "AVX2", "SSE2", "scalar" or "swscale".
+const char *frame_converter_name(FrameConverter *fc);
+int frame_converter_bands(FrameConverter *fc);
+
+void frame_convert(FrameConverter *fc, const uint8_t *const src[], const int srcPitches[],
+				   uint8_t *const dst[], const int dstPitches[]);
+
+#endif // FRAMECONVERT_H
@@ -0,0 +1,161 @@
+#include "framepool.h"
+
+extern "C" {
+#include <libavutil/buffer.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+}
+
+#include <errno.h>
+#include <string.h>
+
+// Decoders may read a little past the end of a plane.
+#define FRAME_PADDING 64
+
+struct FramePool {
+	AVBufferPool       *pools[4];
+	int                linesizes[4];
+	enum AVPixelFormat format;
+	int                width, height;
+};
+
+// av_malloc only promises whatever alignment FFmpeg was built with, so
+// over-allocate and keep the real pointer to free.
+uint8_t *frame_buffer_alloc(size_t size) {
+	uint8_t *mem = (uint8_t*)av_malloc(size + FRAME_ALIGN + sizeof(void*));
+	uint8_t *buf;
+
+	if(!mem) {
+		return NULL;
+	}
+
+	buf = (uint8_t*)(((uintptr_t)mem + sizeof(void*) + FRAME_ALIGN - 1) & ~(uintptr_t)(FRAME_ALIGN - 1));
+	((void**)buf)[-1] = mem;
+	return buf;
+}
+
+void frame_buffer_free(uint8_t *buf) {
+	if(buf) {
+		av_free(((void**)buf)[-1]);
+	}
+}
+
+static void frame_buffer_release(void * /*opaque*/, uint8_t *data) {
+	frame_buffer_free(data);
+}
+
+static AVBufferRef *frame_buffer_ref_alloc(int size) {
+	uint8_t *buf = frame_buffer_alloc(size);
+	AVBufferRef *ref;
+
+	if(!buf) {
+		return NULL;
+	}
+
+	ref = av_buffer_create(buf, size, frame_buffer_release, NULL, 0);
+	if(!ref) {
+		frame_buffer_free(buf);
+	}
+	return ref;
+}
+
+FramePool *frame_pool_create() {
+	FramePool *pool = new FramePool();
+
+	memset(pool, 0, sizeof(FramePool));
+	pool->format = AV_PIX_FMT_NONE;
+	return pool;
+}
+
+static void frame_pool_uninit(FramePool *pool) {
+	for(int p = 0; p < 4; p++) {
+		av_buffer_pool_uninit(&pool->pools[p]);
+	}
+}
+
+void frame_pool_destroy(FramePool *pool) {
+	if(!pool) {
+		return;
+	}
+
+	frame_pool_uninit(pool);
+	delete pool;
+}
+
+void frame_pool_attach(FramePool *pool, AVCodecContext *codecCtx, const AVCodec *codec) {
+	// Decoders that can't use our buffers keep the default allocator, the
+	// rest are told not to draw edges around the picture.
+	if(!(codec->capabilities & CODEC_CAP_DR1)) {
+		return;
+	}
+
+	codecCtx->flags |= CODEC_FLAG_EMU_EDGE;
+	codecCtx->opaque = pool;
+	codecCtx->get_buffer2 = frame_pool_get_buffer2;
+}
+
+// (Re)creates the per-plane pools for a new picture format or size.
+static int frame_pool_update(FramePool *pool, AVCodecContext *c, AVFrame *frame) {
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((enum AVPixelFormat)frame->format);
+	int linesize_align[AV_NUM_DATA_POINTERS];
+	int w = frame->width;
+	int h = frame->height;
+
+	if(pool->pools[0] && pool->format == frame->format
+			&& pool->width == frame->width && pool->height == frame->height) {
+		return 0;
+	}
+
+	frame_pool_uninit(pool);
+
+	avcodec_align_dimensions2(c, &w, &h, linesize_align);
+	if(av_image_fill_linesizes(pool->linesizes, (enum AVPixelFormat)frame->format, w) < 0) {
+		return -1;
+	}
+
+	for(int p = 0; p < 4 && pool->linesizes[p]; p++) {
+		int planeHeight = (p == 1 || p == 2) ? -((-h) >> desc->log2_chroma_h) : h;
+
+		pool->linesizes[p] = FFALIGN(pool->linesizes[p], FRAME_ALIGN);
+		pool->pools[p] = av_buffer_pool_init(pool->linesizes[p] * planeHeight + FRAME_PADDING,
+											 frame_buffer_ref_alloc);
+		if(!pool->pools[p]) {
+			frame_pool_uninit(pool);
+			return -1;
+		}
+	}
+
+	pool->format = (enum AVPixelFormat)frame->format;
+	pool->width = frame->width;
+	pool->height = frame->height;
+	return 0;
+}
+
+int frame_pool_get_buffer2(AVCodecContext *c, AVFrame *frame, int flags) {
+	FramePool *pool = (FramePool*)c->opaque;
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((enum AVPixelFormat)frame->format);
+
+	// Palettes and hardware surfaces are left to libavcodec.
+	if(!desc || (desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_PSEUDOPAL | AV_PIX_FMT_FLAG_HWACCEL))) {
+		return avcodec_default_get_buffer2(c, frame, flags);
+	}
+
+	if(frame_pool_update(pool, c, frame) < 0) {
+		return avcodec_default_get_buffer2(c, frame, flags);
+	}
+
+	memset(frame->data, 0, sizeof(frame->data));
+	for(int p = 0; p < 4 && pool->pools[p]; p++) {
+		frame->buf[p] = av_buffer_pool_get(pool->pools[p]);
+		if(!frame->buf[p]) {
+			av_frame_unref(frame);
+			return AVERROR(ENOMEM);
+		}
+
+		frame->data[p] = frame->buf[p]->data;
+		frame->linesize[p] = pool->linesizes[p];
+	}
+	frame->extended_data = frame->data;
+
+	return 0;
+}
@@ -0,0 +1,31 @@
+#ifndef FRAMEPOOL_H
+#define FRAMEPOOL_H
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+// Picture buffers are aligned to this many bytes, and so are their
+// rows, which suits the SIMD conversion kernels and texture uploads.
+#define FRAME_ALIGN 64
+
+// Recycles the decoder's frame buffers instead of allocating new ones
+// for every frame. Set it up with frame_pool_attach() before the codec
+// is opened; the decoder then gets its buffers from
+// frame_pool_get_buffer2() and they go back in the pool when the last
+// reference to the frame is dropped.
+struct FramePool;
+
+FramePool *frame_pool_create();
+// Frames still referenced keep their buffers until they're unreffed.
+void frame_pool_destroy(FramePool *pool);
+
+void frame_pool_attach(FramePool *pool, AVCodecContext *codecCtx, const AVCodec *codec);
+int frame_pool_get_buffer2(AVCodecContext *c, AVFrame *frame, int flags);
+
+// A FRAME_ALIGN aligned block, for buffers that live as long as the
+// player does such as the picture queue's.
+uint8_t *frame_buffer_alloc(size_t size);
+void frame_buffer_free(uint8_t *buf);
+
+#endif // FRAMEPOOL_H
@@ -0,0 +1,128 @@
+#include "keyframeindex.h"
+
+#include <string.h>
+
+void keyframe_index_init(KeyframeIndex *idx) {
+	memset(idx, 0, sizeof(KeyframeIndex));
+	idx->last_added = -1;
+	idx->last_ts = AV_NOPTS_VALUE;
+}
+
+void keyframe_index_destroy(KeyframeIndex *idx) {
+	av_freep(&idx->entries);
+	idx->nb_entries = idx->capacity = 0;
+}
+
+// Index of the last entry with a timestamp <= ts, -1 if there isn't one.
+static int keyframe_index_search(KeyframeIndex *idx, int64_t ts) {
+	int lo = 0, hi = idx->nb_entries;
+
+	while(lo < hi) {
+		int mid = (lo + hi) / 2;
+		if(idx->entries[mid].ts <= ts) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo - 1;
+}
+
+// Adds an entry keeping the array sorted, returns its position.
+static int keyframe_index_insert(KeyframeIndex *idx, int64_t ts) {
+	int pos = keyframe_index_search(idx, ts);
+
+	if(pos >= 0 && idx->entries[pos].ts == ts) {
+		return pos;
+	}
+	pos++;
+
+	if(idx->nb_entries == idx->capacity) {
+		int capacity = idx->capacity ? idx->capacity * 2 : 256;
+		KeyframeEntry *entries = (KeyframeEntry*)av_realloc(idx->entries, capacity * sizeof(KeyframeEntry));
+		if(!entries) {
+			return -1;
+		}
+		idx->entries = entries;
+		idx->capacity = capacity;
+	}
+
+	memmove(&idx->entries[pos + 1], &idx->entries[pos], (idx->nb_entries - pos) * sizeof(KeyframeEntry));
+	idx->entries[pos].ts = ts;
+	idx->entries[pos].contiguous = 0;
+	idx->nb_entries++;
+
+	if(idx->last_added >= pos) {
+		idx->last_added++;
+	}
+
+	return pos;
+}
+
+void keyframe_index_load(KeyframeIndex *idx, AVFormatContext *fmt, AVStream *st) {
+	// Generic indexes are only built up as the file is read, so they
+	// aren't complete yet.
+	if(fmt->iformat->flags & AVFMT_GENERIC_INDEX) {
+		return;
+	}
+
+	for(int i = 0; i < st->nb_index_entries; i++) {
+		if(st->index_entries[i].flags & AVINDEX_KEYFRAME) {
+			int pos = keyframe_index_insert(idx, st->index_entries[i].timestamp);
+			if(pos >= 0) {
+				idx->entries[pos].contiguous = 1;
+			}
+		}
+	}
+
+	// Nothing is known past the last one.
+	if(idx->nb_entries > 0) {
+		idx->entries[idx->nb_entries - 1].contiguous = 0;
+	}
+}
+
+void keyframe_index_add_packet(KeyframeIndex *idx, const AVPacket *pkt) {
+	int64_t ts = (pkt->dts != AV_NOPTS_VALUE) ? pkt->dts : pkt->pts;
+
+	if(ts == AV_NOPTS_VALUE) {
+		return;
+	}
+
+	if(pkt->flags & AV_PKT_FLAG_KEY) {
+		int pos = keyframe_index_insert(idx, ts);
+
+		// Demuxing carried straight on from the previous keyframe.
+		if(pos > 0 && idx->last_added == pos - 1) {
+			idx->entries[pos - 1].contiguous = 1;
+		}
+		idx->last_added = pos;
+	}
+
+	if(idx->last_ts == AV_NOPTS_VALUE || ts > idx->last_ts) {
+		idx->last_ts = ts;
+	}
+}
+
+void keyframe_index_discontinuity(KeyframeIndex *idx) {
+	idx->last_added = -1;
+	idx->last_ts = AV_NOPTS_VALUE;
+}
+
+int keyframe_index_lookup(KeyframeIndex *idx, int64_t ts, int64_t *keyframe_ts) {
+	int pos = keyframe_index_search(idx, ts);
+
+	if(pos < 0) {
+		return 0;
+	}
+
+	// Either the gap to the next keyframe is known to be empty, or ts is
+	// inside what's been demuxed since this keyframe.
+	if(!idx->entries[pos].contiguous
+			&& !(pos == idx->last_added && idx->last_ts != AV_NOPTS_VALUE && ts <= idx->last_ts)) {
+		return 0;
+	}
+
+	*keyframe_ts = idx->entries[pos].ts;
+	return 1;
+}
@@ -0,0 +1,43 @@
+#ifndef KEYFRAMEINDEX_H
+#define KEYFRAMEINDEX_H
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+// Sorted timestamps (dts, in the stream's time base) of the video
+// keyframes seen so far, so a seek can go straight to the keyframe before
+// the target. It's filled up front from the container's index when it has
+// a complete one, otherwise as packets are demuxed. Only decode_thread
+// uses it so there's no locking.
+typedef struct KeyframeEntry {
+	int64_t ts;
+	int     contiguous; /* everything up to the next entry has been demuxed */
+} KeyframeEntry;
+
+typedef struct KeyframeIndex {
+	KeyframeEntry *entries;
+	int           nb_entries;
+	int           capacity;
+	int           last_added;    /* entry of the last keyframe demuxed, -1 after a seek */
+	int64_t       last_ts;       /* latest timestamp demuxed since then */
+} KeyframeIndex;
+
+void keyframe_index_init(KeyframeIndex *idx);
+void keyframe_index_destroy(KeyframeIndex *idx);
+
+// Takes the stream's own index if the demuxer read one from the file
+// rather than building it while reading.
+void keyframe_index_load(KeyframeIndex *idx, AVFormatContext *fmt, AVStream *st);
+
+// Called for every demuxed packet of the stream.
+void keyframe_index_add_packet(KeyframeIndex *idx, const AVPacket *pkt);
+
+// The next packet demuxed won't follow on from the last one.
+void keyframe_index_discontinuity(KeyframeIndex *idx);
+
+// Finds the keyframe at or before ts. Returns 0 if the index can't tell,
+// i.e. there might be a closer keyframe that hasn't been demuxed yet.
+int keyframe_index_lookup(KeyframeIndex *idx, int64_t ts, int64_t *keyframe_ts);
+
+#endif // KEYFRAMEINDEX_H
@@ -9,12 +9,26 @@
 #include "utilities.h"
 #include "objloader.h"
 #include "video.h"
+#include "spatialaudio.h"
+#include "playlist.h"
+#include "metrics.h"
+#include "trace.h"
 
 using namespace std;
 
 const bool VSYNC = true;
 const bool FULLSCREEN = false;
 const float MULTISAMPLE = 2.0f;  // Texture pixels per display pixel.
+const bool YUV_TEXTURES = true;  // Upload YUV planes and convert in the shader rather than on the CPU.
+const int CONVERSION_THREADS = 0;  // Threads for CPU colour conversion, 0 for one per core.
+const int READ_AHEAD_MB = 64;  // Window the I/O thread reads ahead of the demuxer, 0 to memory map the file instead.
+const bool FAST_OPEN = true;  // Bounded stream probing, and a cache of it next to the exe so known files skip it.
+const bool LOOP_PLAYLIST = true;  // Go back to the first file after the last, otherwise the last picture stays up.
+const bool SPATIAL_AUDIO = true;  // Headphone audio from speakers around the screen that stay put as the head turns.
+const int AUDIO_PERIOD = 512;  // Frames per audio callback, about 11 ms at 48 kHz. Lower is closer lip sync but risks underruns.
+const double AUDIO_LATENCY = -1.0;  // Seconds from the audio callback to the headphones if measured, negative to estimate it.
+const bool METRICS = true;  // Per stage timings and queue depths, written to metrics.txt next to the exe on exit.
+const double DISPLAY_LATENCY = -1.0;  // Seconds from BeginFrame until the frame is on screen, negative to use the Rift's prediction.
 
 // Externs
 bool g_running = true;
@@ -22,9 +36,14 @@ GLuint program = 0;
 GLint p_matrix_ufm = 0;
 GLint mv_matrix_ufm = 0;
 GLuint texture_ufm = 0;
+GLint u_texture_ufm = 0;
+GLint v_texture_ufm = 0;
+GLint screen_planes_ufm = 0;
+GLint yuv_matrix_ufm = 0;
+GLint yuv_offset_ufm = 0;
 objRenderData room, screen;
 
-bool pollEvent()
+bool pollEvent(VideoState *video)
 {
 	SDL_Event event;
 	while (SDL_PollEvent(&event))
@@ -36,26 +55,48 @@ bool pollEvent()
 			switch (event.key.keysym.sym) {
 			case SDLK_ESCAPE:
 				return false;
+			case SDLK_LEFT:
+				video_seek(video, -10.0, 1);
+				break;
+			case SDLK_RIGHT:
+				video_seek(video, 10.0, 1);
+				break;
+			case SDLK_DOWN:
+				video_seek(video, -60.0, 1);
+				break;
+			case SDLK_UP:
+				video_seek(video, 60.0, 1);
+				break;
 			}
 			break;
-		case FF_REFRESH_EVENT:
-			video_refresh_timer(event.user.data1);
-			break;;
 		}
 	}
 
 	return true;
 }
 
+// Tells the spatial audio where the screen is from the seat.
+void setSpatialScreen(const float seat[3])
+{
+	float centre[3], halfWidth;
+
+	getScreenGeometry(centre, &halfWidth);
+	for(int i = 0; i < 3; i++)
+		centre[i] -= seat[i];
+	spatial_set_screen(centre, halfWidth);
+}
+
 int main(int argc, char *argv[])
 {
-	// Get path of video file.
-	string videoFilePath;
+	// Get paths of video files, played in order.
+	vector<string> videoFilePaths;
 	if( argc <= 1 ) {
-		videoFilePath = pickVideo();
+		string videoFilePath = pickVideo();
 		if(videoFilePath == "") return 0;
+		videoFilePaths.push_back(videoFilePath);
 	} else {
-		videoFilePath = string(argv[1]);
+		for(int i = 1; i < argc; i++)
+			videoFilePaths.push_back(string(argv[i]));
 	}
 
 	// Get path of assets dir.
@@ -63,7 +104,11 @@ int main(int argc, char *argv[])
 	assetsDir.erase(assetsDir.find_last_of('\\')+1);
 
 	_putenv("SDL_AUDIODRIVER=DirectSound");  // Use DirectSound
-	SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER);
+	SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO);
+
+	// Only does anything when built with CINEMA_TRACE.
+	TRACE_START((assetsDir + "trace.json").c_str());
+	TRACE_THREAD_NAME("render");
 
 	// Rift init.
 	ovrHmd l_Hmd;
@@ -91,9 +136,28 @@ int main(int argc, char *argv[])
 	}
 
 
+	metrics_set_enabled(METRICS);
+	Metric *uploadMetric = metric_timer("texture_upload");
+	Metric *renderMetric[2] = { metric_timer("render_left_eye"), metric_timer("render_right_eye") };
+	Metric *frameMetric = metric_timer("frame_interval");
+	Metric *missedMetric = metric_counter("frames_missed");
+
 	// Open and validate video file.
-	if( video_initialize(videoFilePath.c_str()) < 0 )
+	video_set_conversion_threads(CONVERSION_THREADS);
+	video_set_read_ahead(READ_AHEAD_MB);
+	video_set_fast_open(FAST_OPEN);
+	video_set_spatial_audio(SPATIAL_AUDIO);
+	video_set_audio_period(AUDIO_PERIOD);
+	video_set_audio_latency(AUDIO_LATENCY);
+	video_set_stream_cache(FAST_OPEN ? (assetsDir + "streaminfo.cache").c_str() : NULL);
+	vector<const char*> playlistFiles;
+	for(size_t i = 0; i < videoFilePaths.size(); i++)
+		playlistFiles.push_back(videoFilePaths[i].c_str());
+	Playlist *playlist = playlist_create(&playlistFiles[0], (int)playlistFiles.size(), LOOP_PLAYLIST,
+										 YUV_TEXTURES ? VIDEO_OUTPUT_YUV : VIDEO_OUTPUT_RGBA);
+	if(!playlist)
 		return -1;
+	VideoState *video = playlist_current(playlist);
 
 	ovrSizei l_ClientSize;
 	l_ClientSize.w = l_HmdDesc.Resolution.w; // 1280 for DK1...
@@ -193,41 +257,108 @@ int main(int argc, char *argv[])
 	l_EyeTexture[1].OGL.Header.RenderViewport.Pos.x = (l_TextureSize.w+1)/2;
 
 
-	initializeGeo(assetsDir, video_get_width(), video_get_height());
-	initializeTextures(assetsDir, video_get_width(), video_get_height());
+	// Where the viewer sits in the room, in metres.
+	const float seat[3] = { 0.0f, 1.313f, 1.6f };
+
+	int screenWidth = video_get_width(video);
+	int screenHeight = video_get_height(video);
+	int screenPlanes = video_get_plane_count(video);
+	initializeGeo(assetsDir, screenWidth, screenHeight);
+	setSpatialScreen(seat);
+	initializeTextures(assetsDir, screenWidth, screenHeight, screenPlanes);
 
 	GLuint program = initializeProgram();
 
-	OVR::Matrix4f camPosition = OVR::Matrix4f::Translation(0.0f, -1.313f, -1.6f);
+	// Colour conversion for YUV video and the texture units the chroma planes go on.
+	float yuvMatrix[9], yuvOffset[3];
+	video_get_yuv_matrix(video, yuvMatrix, yuvOffset);
+	glUseProgram(program);
+	glUniformMatrix3fv(yuv_matrix_ufm, 1, GL_TRUE, yuvMatrix);
+	glUniform3fv(yuv_offset_ufm, 1, yuvOffset);
+	glUniform1i(u_texture_ufm, 1);
+	glUniform1i(v_texture_ufm, 2);
+	glUseProgram(0);
+
+	OVR::Matrix4f camPosition = OVR::Matrix4f::Translation(-seat[0], -seat[1], -seat[2]);
+
+	// Serial of the video frame that's in screen.texture.
+	unsigned int uploadedFrameSerial = 0;
+	// Set when the playlist moves on, until the new file's first picture is up.
+	bool newVideo = false;
 
 	// Render loop
 	glDepthFunc(GL_LEQUAL);
 	glEnable(GL_DEPTH_TEST);
 	while (g_running)
 	{
-		g_running = pollEvent();
+		g_running = pollEvent(video);
+
+		ovrFrameTiming m_HmdFrameTiming = ovrHmd_BeginFrame(l_Hmd, 0);
+
+		// Put up the video picture that matches when this frame will be seen.
+		double displayLatency = DISPLAY_LATENCY;
+		if(displayLatency < 0)
+			displayLatency = std::max(0.0, m_HmdFrameTiming.ScanoutMidpointSeconds - ovr_GetTimeInSeconds());
+		double displayTime = video_get_time() + displayLatency;
+
+		// Next file in the playlist, already open and decoded up to its first
+		// pictures. The last picture of the old one stays on screen until
+		// the new one has a picture up.
+		if(playlist_update(playlist, displayTime)) {
+			video = playlist_current(playlist);
+			uploadedFrameSerial = 0;
+			newVideo = true;
+		}
 
-		ovrFrameTiming m_HmdFrameTiming = ovrHmd_BeginFrame(l_Hmd, 0); UNREFERENCED_PARAMETER(m_HmdFrameTiming);
+		video_refresh(video, displayTime);
 
 		// Bind the FBO
 		glBindFramebuffer(GL_FRAMEBUFFER, l_FBOId);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-		// Get new frame of video
-		glBindTexture(GL_TEXTURE_2D, screen.texture);
-		unsigned char *videoPixels = video_get_frame_pixels();
-		if(videoPixels) {
-			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, video_get_width(), video_get_height(),
-							GL_RGBA, GL_UNSIGNED_BYTE, videoPixels);
-
+		// Get new frame of video, only if it's changed since the last upload.
+		VideoFrame videoFrame;
+		if(video_get_frame_serial(video) != uploadedFrameSerial && video_acquire_frame(video, &videoFrame)) {
+			if(newVideo) {
+				if(videoFrame.width != screenWidth || videoFrame.height != screenHeight
+						|| videoFrame.plane_count != screenPlanes) {
+					screenWidth = videoFrame.width;
+					screenHeight = videoFrame.height;
+					screenPlanes = videoFrame.plane_count;
+					resizeScreen(screenWidth, screenHeight, screenPlanes);
+					setSpatialScreen(seat);
+				}
+
+				video_get_yuv_matrix(video, yuvMatrix, yuvOffset);
+				glUseProgram(program);
+				glUniformMatrix3fv(yuv_matrix_ufm, 1, GL_TRUE, yuvMatrix);
+				glUniform3fv(yuv_offset_ufm, 1, yuvOffset);
+				glUseProgram(0);
+				newVideo = false;
+			}
+			Uint64 uploadStart = metric_time_begin();
+			updateScreenTextures(videoFrame.planes, videoFrame.pitches,
+								 videoFrame.width, videoFrame.height, videoFrame.plane_count);
+			metric_time_end(uploadMetric, uploadStart);
+			uploadedFrameSerial = videoFrame.serial;
+			video_release_frame(video, &videoFrame);
 		}
 
 		// Render each eye to texture
 		for (int l_EyeIndex=0; l_EyeIndex<ovrEye_Count; l_EyeIndex++)
 		{
 			ovrEyeType l_Eye = l_HmdDesc.EyeRenderOrder[l_EyeIndex];
+			TRACE_SCOPE(l_Eye == ovrEye_Left ? "render_left_eye" : "render_right_eye");
+			Uint64 renderStart = metric_time_begin();
 			ovrPosef l_EyePose = ovrHmd_BeginEyeRender(l_Hmd, l_Eye);
 
+			// The audio follows the head at the first eye's pose.
+			if(l_EyeIndex == 0) {
+				float orientation[4] = { l_EyePose.Orientation.x, l_EyePose.Orientation.y,
+										 l_EyePose.Orientation.z, l_EyePose.Orientation.w };
+				spatial_set_orientation(orientation);
+			}
+
 			glViewport(l_EyeTexture[l_Eye].OGL.Header.RenderViewport.Pos.x,      // StartX
 					   l_EyeTexture[l_Eye].OGL.Header.RenderViewport.Pos.y,      // StartY
 					   l_EyeTexture[l_Eye].OGL.Header.RenderViewport.Size.w,     // Width
@@ -253,41 +384,95 @@ int main(int argc, char *argv[])
 			glUniformMatrix4fv(mv_matrix_ufm, 1, GL_TRUE, &l_ModelViewMatrix.M[0][0]);
 
 			// Render room
+			glUniform1i(screen_planes_ufm, 1);
 			glBindVertexArray(room.vao);
 			glBindTexture(GL_TEXTURE_2D, room.texture);
 			glDrawArrays(GL_TRIANGLES, 0, room.numTriangles*3);
 
 			// Render screen
+			glUniform1i(screen_planes_ufm, screenPlanes);
 			glBindVertexArray(screen.vao);
 			glBindTexture(GL_TEXTURE_2D, screen.texture);
+			if(screenPlanes > 1) {
+				glActiveTexture(GL_TEXTURE1);
+				glBindTexture(GL_TEXTURE_2D, screen.uTexture);
+				glActiveTexture(GL_TEXTURE2);
+				glBindTexture(GL_TEXTURE_2D, screen.vTexture);
+			}
 			glDrawArrays(GL_TRIANGLES, 0, screen.numTriangles*3);
 
 			// Cleanup
 			glBindVertexArray(0);
+			if(screenPlanes > 1) {
+				glBindTexture(GL_TEXTURE_2D, 0);
+				glActiveTexture(GL_TEXTURE1);
+				glBindTexture(GL_TEXTURE_2D, 0);
+				glActiveTexture(GL_TEXTURE0);
+			}
 			glBindTexture(GL_TEXTURE_2D, 0);
 			glUseProgram(0);
 
 			ovrHmd_EndEyeRender(l_Hmd, l_Eye, l_EyePose, &l_EyeTexture[l_Eye].Texture);
+			// CPU time to submit the eye, the GPU catches up on its own.
+			metric_time_end(renderMetric[l_Eye], renderStart);
 		}
 
 		// Unbind the FBO, back to normal drawing...
 		glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
-		ovrHmd_EndFrame(l_Hmd);
+		{
+			TRACE_SCOPE("ovrHmd_EndFrame");
+			ovrHmd_EndFrame(l_Hmd);
+		}
 
 		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0); // Unbind GL_ELEMENT_ARRAY_BUFFER for our own vertex arrays to work...
 		glBindBuffer(GL_ARRAY_BUFFER, 0); // Unbind GL_ARRAY_BUFFER for our own vertex arrays to work...
 		glUseProgram(0); // Oculus shader is still active, turn it off...
 
-		// Check for missed frames
+		// Time from the end of the last frame to the end of this one, more
+		// than a refresh at 60 Hz probably means one was missed.
 		static double lastFrameTime = 0;
-		if(ovr_GetTimeInSeconds() - lastFrameTime > 0.018)
-			printf("Missed a frame? %.2f ms from end of last frame to end of this frame.\n",
-				   (ovr_GetTimeInSeconds() - lastFrameTime)*1000);
-		lastFrameTime = ovr_GetTimeInSeconds();
+		double frameEndTime = ovr_GetTimeInSeconds();
+		if(lastFrameTime > 0) {
+			metric_record(frameMetric, (frameEndTime - lastFrameTime) * 1000);
+			if(frameEndTime - lastFrameTime > 0.018) {
+				metric_add(missedMetric, 1);
+				TRACE_INSTANT("missed frame");
+			}
+		}
+		lastFrameTime = frameEndTime;
+	}
+
+	video_print_jitter_histogram(video);
+
+	VideoStats stats;
+	video_get_stats(video, &stats);
+	printf("Video: %d frames shown, %d late, %d dropped, %d dropped before conversion\n",
+		   stats.frames_shown, stats.frames_late, stats.frames_dropped, stats.frames_dropped_early);
+	printf("Time to first frame: %.1f ms, stream info %s in %.1f ms\n", stats.time_to_first_frame,
+		   stats.stream_info_cached ? "from the cache" : "probed", stats.stream_info_time);
+	if(stats.audio_underruns > 0)
+		printf("Audio: %d underruns\n", stats.audio_underruns);
+	printf("A/V offset %.1f ms, audio %.1f ms off its clock, rate corrected by %.0f ppm\n",
+		   stats.av_offset, stats.audio_sync_offset, stats.audio_correction);
+	printf("Audio latency %.1f ms, %.1f ms buffered and %.1f ms output %s, callbacks every %.1f ms\n",
+		   stats.audio_buffered + stats.audio_latency, stats.audio_buffered, stats.audio_latency,
+		   stats.audio_latency_measured ? "measured" : "estimated", stats.audio_callback_interval);
+	if(stats.seeks > 0)
+		printf("Seeks: %d, latency to first picture %.1f ms last, %.1f ms max\n",
+			   stats.seeks, stats.seek_latency_last, stats.seek_latency_max);
+	if(stats.io_hits + stats.io_misses > 0)
+		printf("Read ahead: %lld hits, %lld misses, %.1f ms stalled\n",
+			   stats.io_hits, stats.io_misses, stats.io_stall * 1000);
+
+	if(METRICS) {
+		printf("Metrics:\n");
+		metrics_print(stdout);
+		metrics_write((assetsDir + "metrics.txt").c_str());
 	}
 
-	video_shutdown();
+	playlist_destroy(playlist);
+	TRACE_STOP();
 	SDL_GL_DeleteContext(context);
 	SDL_DestroyWindow(window);
 
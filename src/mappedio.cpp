@@ -0,0 +1,229 @@
+#include "mappedio.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+// Size of the part of the file mapped at once. A multiple of the page
+// size and of the Windows allocation granularity (64 KB).
+#define MAPPED_WINDOW_SIZE (64 * 1024 * 1024)
+
+// Buffer avio reads into; bigger reads bypass it and go straight to
+// mapped_io_read().
+#define MAPPED_IO_BUFFER_SIZE (256 * 1024)
+
+typedef struct MappedFile {
+#ifdef _WIN32
+	HANDLE        file;
+	HANDLE        mapping;
+#else
+	int           fd;
+#endif
+	int64_t       size;
+	int64_t       pos;
+
+	const uint8_t *window;        /* currently mapped part of the file */
+	int64_t       window_offset;
+	int64_t       window_size;
+} MappedFile;
+
+static void mapped_file_unmap(MappedFile *mf) {
+	if(!mf->window) {
+		return;
+	}
+
+#ifdef _WIN32
+	UnmapViewOfFile(mf->window);
+#else
+	munmap((void*)mf->window, (size_t)mf->window_size);
+#endif
+	mf->window = NULL;
+}
+
+// Makes sure the window covers pos. Returns 0 on success.
+static int mapped_file_map(MappedFile *mf, int64_t pos) {
+	int64_t offset, size;
+
+	if(mf->window && pos >= mf->window_offset && pos < mf->window_offset + mf->window_size) {
+		return 0;
+	}
+
+	mapped_file_unmap(mf);
+
+	offset = pos - pos % MAPPED_WINDOW_SIZE;
+	size = mf->size - offset;
+	if(size > MAPPED_WINDOW_SIZE) {
+		size = MAPPED_WINDOW_SIZE;
+	}
+
+#ifdef _WIN32
+	mf->window = (const uint8_t*)MapViewOfFile(mf->mapping, FILE_MAP_READ,
+											   (DWORD)(offset >> 32), (DWORD)offset, (SIZE_T)size);
+	if(!mf->window) {
+		return -1;
+	}
+#else
+	void *p = mmap(NULL, (size_t)size, PROT_READ, MAP_SHARED, mf->fd, (off_t)offset);
+	if(p == MAP_FAILED) {
+		return -1;
+	}
+	madvise(p, (size_t)size, MADV_SEQUENTIAL);
+	mf->window = (const uint8_t*)p;
+#endif
+
+	mf->window_offset = offset;
+	mf->window_size = size;
+	return 0;
+}
+
+static int mapped_io_read(void *opaque, uint8_t *buf, int buf_size) {
+	MappedFile *mf = (MappedFile*)opaque;
+	int64_t avail;
+
+	if(mf->pos >= mf->size) {
+		return AVERROR_EOF;
+	}
+
+	if(mapped_file_map(mf, mf->pos) < 0) {
+		return AVERROR(EIO);
+	}
+
+	// Reads stop at the end of the window, avio just asks again.
+	avail = mf->window_offset + mf->window_size - mf->pos;
+	if(buf_size > avail) {
+		buf_size = (int)avail;
+	}
+
+	memcpy(buf, mf->window + (mf->pos - mf->window_offset), buf_size);
+	mf->pos += buf_size;
+	return buf_size;
+}
+
+static int64_t mapped_io_seek(void *opaque, int64_t offset, int whence) {
+	MappedFile *mf = (MappedFile*)opaque;
+	int64_t pos;
+
+	switch(whence & ~AVSEEK_FORCE) {
+		case AVSEEK_SIZE:
+			return mf->size;
+
+		case SEEK_SET:
+			pos = offset;
+			break;
+
+		case SEEK_CUR:
+			pos = mf->pos + offset;
+			break;
+
+		case SEEK_END:
+			pos = mf->size + offset;
+			break;
+
+		default:
+			return AVERROR(EINVAL);
+	}
+
+	if(pos < 0) {
+		return AVERROR(EINVAL);
+	}
+
+	// Past the end is allowed, reads there just hit EOF.
+	mf->pos = pos;
+	return pos;
+}
+
+static void mapped_file_close(MappedFile *mf) {
+	mapped_file_unmap(mf);
+
+#ifdef _WIN32
+	if(mf->mapping) {
+		CloseHandle(mf->mapping);
+	}
+	if(mf->file != INVALID_HANDLE_VALUE) {
+		CloseHandle(mf->file);
+	}
+#else
+	if(mf->fd >= 0) {
+		close(mf->fd);
+	}
+#endif
+
+	av_free(mf);
+}
+
+AVIOContext *mapped_io_open(const char *filename) {
+	MappedFile *mf = (MappedFile*)av_mallocz(sizeof(MappedFile));
+	uint8_t *buffer;
+	AVIOContext *pb;
+
+	if(!mf) {
+		return NULL;
+	}
+
+#ifdef _WIN32
+	LARGE_INTEGER size;
+
+	mf->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+						   FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if(mf->file == INVALID_HANDLE_VALUE || !GetFileSizeEx(mf->file, &size) || size.QuadPart <= 0) {
+		mapped_file_close(mf);
+		return NULL;
+	}
+	mf->size = size.QuadPart;
+
+	mf->mapping = CreateFileMappingA(mf->file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if(!mf->mapping) {
+		mapped_file_close(mf);
+		return NULL;
+	}
+#else
+	struct stat st;
+
+	mf->fd = open(filename, O_RDONLY);
+	if(mf->fd < 0 || fstat(mf->fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+		mapped_file_close(mf);
+		return NULL;
+	}
+	mf->size = st.st_size;
+#endif
+
+	// Check the first window maps before committing to it.
+	if(mapped_file_map(mf, 0) < 0) {
+		mapped_file_close(mf);
+		return NULL;
+	}
+
+	buffer = (uint8_t*)av_malloc(MAPPED_IO_BUFFER_SIZE);
+	if(!buffer) {
+		mapped_file_close(mf);
+		return NULL;
+	}
+
+	pb = avio_alloc_context(buffer, MAPPED_IO_BUFFER_SIZE, 0, mf, mapped_io_read, NULL, mapped_io_seek);
+	if(!pb) {
+		av_free(buffer);
+		mapped_file_close(mf);
+		return NULL;
+	}
+
+	return pb;
+}
+
+void mapped_io_close(AVIOContext **pb) {
+	if(!*pb) {
+		return;
+	}
+
+	mapped_file_close((MappedFile*)(*pb)->opaque);
+	av_freep(&(*pb)->buffer);
+	av_freep(pb);
+}
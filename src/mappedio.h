@@ -0,0 +1,21 @@
+#ifndef MAPPEDIO_H
+#define MAPPEDIO_H
+
+extern "C" {
+#include <libavformat/avio.h>
+}
+
+// An AVIOContext that reads a local file through a memory map instead of
+// read() calls, so the demuxer's reads come straight out of the page
+// cache. The file is mapped a window at a time, which keeps the address
+// space use down for multi-GB files in a 32 bit process.
+//
+// Returns NULL if the file can't be mapped (not a local file, empty,
+// ...), in which case the caller should let libavformat open it the
+// normal way. Pass it to avformat_open_input() through
+// AVFormatContext.pb and close it with mapped_io_close() after
+// avformat_close_input().
+AVIOContext *mapped_io_open(const char *filename);
+void mapped_io_close(AVIOContext **pb);
+
+#endif // MAPPEDIO_H
@@ -0,0 +1,320 @@
+#include "metrics.h"
+
+#include <SDL_atomic.h>
+#include <limits.h>
+#include <string.h>
+
+#define METRICS_MAX 64
+#define METRIC_NAME_SIZE 32
+
+// Timer buckets are in microseconds: one each below 8 us, then four per
+// doubling, which covers up to about 30 s.
+#define METRIC_BUCKETS 100
+
+// Gauges keep thousandths so they can be updated with integer atomics.
+#define GAUGE_SCALE 1000.0
+
+struct Metric {
+	char         name[METRIC_NAME_SIZE];
+	MetricType   type;
+	SDL_atomic_t count;
+	// 64 bit sum from two 32 bit atomics, see metric_sum_add(). Counters
+	// add to it directly, gauges in thousandths and timers in us.
+	SDL_atomic_t sum_lo, sum_hi;
+	SDL_atomic_t last;
+	SDL_atomic_t min, max;
+	SDL_atomic_t buckets[METRIC_BUCKETS];
+};
+
+static Metric metrics[METRICS_MAX];
+// Registered metrics are published by bumping this after they're set up,
+// so readers never see a half filled in one.
+static SDL_atomic_t nb_metrics;
+static SDL_SpinLock register_lock;
+static SDL_atomic_t enabled;
+
+void metrics_set_enabled(int enable) {
+	SDL_AtomicSet(&enabled, enable ? 1 : 0);
+}
+
+int metrics_enabled() {
+	return SDL_AtomicGet(&enabled);
+}
+
+static Metric *metric_register(const char *name, MetricType type) {
+	Metric *m = NULL;
+	int n;
+
+	SDL_AtomicLock(&register_lock);
+
+	n = SDL_AtomicGet(&nb_metrics);
+	for(int i = 0; i < n; i++) {
+		if(strcmp(metrics[i].name, name) == 0) {
+			m = &metrics[i];
+			break;
+		}
+	}
+
+	if(!m && n < METRICS_MAX) {
+		m = &metrics[n];
+		memset(m, 0, sizeof(Metric));
+		strncpy(m->name, name, METRIC_NAME_SIZE - 1);
+		m->type = type;
+		SDL_AtomicSet(&m->min, INT_MAX);
+		SDL_AtomicSet(&m->max, INT_MIN);
+		SDL_AtomicSet(&nb_metrics, n + 1);
+	}
+
+	SDL_AtomicUnlock(&register_lock);
+
+	if(!m) {
+		fprintf(stderr, "Metrics: no room for %s\n", name);
+	}
+	return m;
+}
+
+Metric *metric_counter(const char *name) {
+	return metric_register(name, METRIC_COUNTER);
+}
+
+Metric *metric_gauge(const char *name) {
+	return metric_register(name, METRIC_GAUGE);
+}
+
+Metric *metric_timer(const char *name) {
+	return metric_register(name, METRIC_TIMER);
+}
+
+// Adds v, sign extended, to the 64 bit sum. Each add knows from the old
+// low half whether it carried, so concurrent adds can't lose a carry. A
+// reader can catch the halves between the two adds, which is fine for
+// statistics.
+static void metric_sum_add(Metric *m, int v) {
+	unsigned int old = (unsigned int)SDL_AtomicAdd(&m->sum_lo, v);
+	int carry = (old + (unsigned int)v < old) ? 1 : 0;
+
+	if(v < 0) {
+		carry--;
+	}
+	if(carry) {
+		SDL_AtomicAdd(&m->sum_hi, carry);
+	}
+}
+
+static long long metric_sum(Metric *m) {
+	unsigned int lo = (unsigned int)SDL_AtomicGet(&m->sum_lo);
+	return (long long)SDL_AtomicGet(&m->sum_hi) * 4294967296LL + lo;
+}
+
+static void metric_update_range(Metric *m, int v) {
+	int old;
+
+	do {
+		old = SDL_AtomicGet(&m->min);
+	} while(v < old && !SDL_AtomicCAS(&m->min, old, v));
+
+	do {
+		old = SDL_AtomicGet(&m->max);
+	} while(v > old && !SDL_AtomicCAS(&m->max, old, v));
+}
+
+static int metric_bucket(int us) {
+	int msb = 0, bucket;
+
+	if(us < 8) {
+		return us < 0 ? 0 : us;
+	}
+
+	while(us >> (msb + 1)) {
+		msb++;
+	}
+	bucket = (msb - 1) * 4 + ((us >> (msb - 2)) & 3);
+
+	return bucket < METRIC_BUCKETS ? bucket : METRIC_BUCKETS - 1;
+}
+
+// Smallest duration in us that lands in bucket b.
+static double metric_bucket_start(int b) {
+	if(b < 8) {
+		return b;
+	}
+	return (double)((4 + (b & 3)) << (b / 4 - 1));
+}
+
+static int metric_clamp(double v) {
+	if(v >= INT_MAX) {
+		return INT_MAX;
+	}
+	if(v <= INT_MIN) {
+		return INT_MIN;
+	}
+	return (int)v;
+}
+
+void metric_add(Metric *m, int n) {
+	if(!m || !SDL_AtomicGet(&enabled)) {
+		return;
+	}
+
+	SDL_AtomicAdd(&m->count, 1);
+	metric_sum_add(m, n);
+}
+
+void metric_set(Metric *m, double value) {
+	int v;
+
+	if(!m || !SDL_AtomicGet(&enabled)) {
+		return;
+	}
+
+	v = metric_clamp(value * GAUGE_SCALE);
+	SDL_AtomicSet(&m->last, v);
+	SDL_AtomicAdd(&m->count, 1);
+	metric_sum_add(m, v);
+	metric_update_range(m, v);
+}
+
+void metric_record(Metric *m, double ms) {
+	int us;
+
+	if(!m || !SDL_AtomicGet(&enabled)) {
+		return;
+	}
+
+	us = metric_clamp(ms * 1000);
+	if(us < 0) {
+		us = 0;
+	}
+
+	SDL_AtomicAdd(&m->count, 1);
+	metric_sum_add(m, us);
+	metric_update_range(m, us);
+	SDL_AtomicAdd(&m->buckets[metric_bucket(us)], 1);
+}
+
+Uint64 metric_time_begin() {
+	return SDL_AtomicGet(&enabled) ? SDL_GetPerformanceCounter() : 0;
+}
+
+void metric_time_end(Metric *m, Uint64 start) {
+	if(!start) {
+		return;
+	}
+	metric_record(m, (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency());
+}
+
+int metrics_count() {
+	return SDL_AtomicGet(&nb_metrics);
+}
+
+// The duration in ms that fraction of the timer's samples are at or
+// under, from the middle of the bucket it falls in.
+static double metric_percentile(Metric *m, int count, double fraction, double max) {
+	int want = (int)(count * fraction + 0.5), seen = 0;
+
+	if(want < 1) {
+		want = 1;
+	}
+
+	for(int b = 0; b < METRIC_BUCKETS; b++) {
+		seen += SDL_AtomicGet(&m->buckets[b]);
+		if(seen >= want) {
+			double mid = (metric_bucket_start(b) + metric_bucket_start(b + 1)) / 2 / 1000;
+			return mid < max ? mid : max;
+		}
+	}
+	return max;
+}
+
+int metrics_get(int i, MetricSnapshot *snapshot) {
+	Metric *m;
+	double scale;
+	int count;
+
+	if(i < 0 || i >= SDL_AtomicGet(&nb_metrics)) {
+		return 0;
+	}
+	SDL_MemoryBarrierAcquire();
+	m = &metrics[i];
+
+	memset(snapshot, 0, sizeof(MetricSnapshot));
+	snapshot->name = m->name;
+	snapshot->type = m->type;
+	count = SDL_AtomicGet(&m->count);
+	snapshot->count = (unsigned int)count;
+
+	if(m->type == METRIC_COUNTER) {
+		snapshot->value = (double)metric_sum(m);
+		snapshot->mean = count ? snapshot->value / count : 0;
+		return 1;
+	}
+
+	if(count == 0) {
+		return 1;
+	}
+
+	scale = (m->type == METRIC_GAUGE) ? 1 / GAUGE_SCALE : 1 / 1000.0;
+	snapshot->min = SDL_AtomicGet(&m->min) * scale;
+	snapshot->max = SDL_AtomicGet(&m->max) * scale;
+	snapshot->mean = metric_sum(m) * scale / count;
+
+	if(m->type == METRIC_GAUGE) {
+		snapshot->value = SDL_AtomicGet(&m->last) * scale;
+	} else {
+		snapshot->value = snapshot->mean;
+		snapshot->p50 = metric_percentile(m, count, 0.50, snapshot->max);
+		snapshot->p90 = metric_percentile(m, count, 0.90, snapshot->max);
+		snapshot->p99 = metric_percentile(m, count, 0.99, snapshot->max);
+	}
+	return 1;
+}
+
+int metrics_find(const char *name, MetricSnapshot *snapshot) {
+	int n = SDL_AtomicGet(&nb_metrics);
+
+	for(int i = 0; i < n; i++) {
+		if(strcmp(metrics[i].name, name) == 0) {
+			return metrics_get(i, snapshot);
+		}
+	}
+	return 0;
+}
+
+void metrics_print(FILE *f) {
+	MetricSnapshot s;
+
+	for(int i = 0; metrics_get(i, &s); i++) {
+		if(s.count == 0) {
+			continue;
+		}
+
+		switch(s.type) {
+			case METRIC_COUNTER:
+				fprintf(f, "%-20s counter %12.0f\n", s.name, s.value);
+				break;
+
+			case METRIC_GAUGE:
+				fprintf(f, "%-20s gauge   %12lld samples, last %.2f, mean %.2f, min %.2f, max %.2f\n",
+						s.name, s.count, s.value, s.mean, s.min, s.max);
+				break;
+
+			case METRIC_TIMER:
+				fprintf(f, "%-20s timer   %12lld samples, mean %.3f ms, p50 %.3f, p90 %.3f, p99 %.3f, max %.3f\n",
+						s.name, s.count, s.mean, s.p50, s.p90, s.p99, s.max);
+				break;
+		}
+	}
+}
+
+int metrics_write(const char *path) {
+	FILE *f = fopen(path, "w");
+
+	if(!f) {
+		fprintf(stderr, "Metrics: can't write %s\n", path);
+		return 0;
+	}
+
+	metrics_print(f);
+	fclose(f);
+	return 1;
+}
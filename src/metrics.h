@@ -0,0 +1,65 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <SDL.h>
+#include <stdio.h>
+
+// Named counters, gauges and timers for watching the pipeline while it
+// runs. Any thread can update any metric without taking a lock, and with
+// metrics turned off an update is a call and a branch. Metrics are
+// registered by name and live until the program exits, so a pointer can
+// be looked up once and kept.
+
+enum MetricType {
+	METRIC_COUNTER, /* a running total */
+	METRIC_GAUGE,   /* a level that goes up and down, e.g. a queue depth */
+	METRIC_TIMER    /* a distribution of durations in ms */
+};
+
+struct Metric;
+
+// Off by default. Updates while off are thrown away.
+void metrics_set_enabled(int enable);
+int metrics_enabled();
+
+// Finds the metric called name, registering it the first time. Returns
+// NULL if there's no room left, which every update accepts.
+Metric *metric_counter(const char *name);
+Metric *metric_gauge(const char *name);
+Metric *metric_timer(const char *name);
+
+void metric_add(Metric *m, int n);
+void metric_set(Metric *m, double value);
+void metric_record(Metric *m, double ms);
+
+// Times a section: metric_time_end(m, metric_time_begin()). begin returns
+// 0 when metrics are off so end doesn't read the clock either.
+Uint64 metric_time_begin();
+void metric_time_end(Metric *m, Uint64 start);
+
+// What a metric has seen so far. For a counter value is the total, for a
+// gauge the last value set and for a timer the mean. The percentiles are
+// only filled in for timers and come from buckets a quarter of a
+// doubling wide, so they're within about 12%.
+typedef struct MetricSnapshot {
+	const char *name;
+	MetricType type;
+	long long  count;  /* updates */
+	double     value;
+	double     min, max;
+	double     mean;
+	double     p50, p90, p99;
+} MetricSnapshot;
+
+int metrics_count();
+// Returns 0 if i is out of range.
+int metrics_get(int i, MetricSnapshot *snapshot);
+// Returns 0 if nothing called name has been registered.
+int metrics_find(const char *name, MetricSnapshot *snapshot);
+
+// One line per metric that's been updated.
+void metrics_print(FILE *f);
+// Returns 0 if the file can't be written.
+int metrics_write(const char *path);
+
+#endif // METRICS_H
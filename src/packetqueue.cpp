@@ -0,0 +1,212 @@
+#include "packetqueue.h"
+
+#include <string.h>
+
+// Marks the flush packets, only its address matters.
+static uint8_t flush_data[1];
+
+void packet_queue_init(PacketQueue *q, int capacity) {
+	int c = 1;
+
+	// Round up to a power of two so the indices can just be masked.
+	while(c < capacity) {
+		c <<= 1;
+	}
+
+	memset(q, 0, sizeof(PacketQueue));
+	q->pkts = (AVPacket*)av_mallocz(c * sizeof(AVPacket));
+	q->capacity = c;
+	q->mutex = SDL_CreateMutex();
+	q->cond = SDL_CreateCond();
+}
+
+void packet_queue_destroy(PacketQueue *q) {
+	AVPacket pkt;
+
+	if(!q->pkts) {
+		return;
+	}
+
+	// Drain whatever the consumer didn't get to.
+	SDL_AtomicSet(&q->abort_request, 0);
+	while(packet_queue_get(q, &pkt, 0) > 0) {
+		av_free_packet(&pkt);
+	}
+
+	av_free(q->pkts);
+	q->pkts = NULL;
+	SDL_DestroyCond(q->cond);
+	SDL_DestroyMutex(q->mutex);
+}
+
+static int packet_duration_ms(PacketQueue *q, const AVPacket *pkt) {
+	if(pkt->duration <= 0 || q->time_base.den == 0) {
+		return 0;
+	}
+
+	return (int)(pkt->duration * av_q2d(q->time_base) * 1000);
+}
+
+// Wakes the other side if it's asleep. The waiters count is bumped
+// before the sleeper re-checks the indices, and SDL_AtomicSet is a full
+// barrier, so either the sleeper sees our index update or we see it
+// waiting. Taking the mutex makes sure it's actually in SDL_CondWait.
+static void packet_queue_wake(PacketQueue *q) {
+	if(SDL_AtomicGet(&q->waiters) > 0) {
+		SDL_LockMutex(q->mutex);
+		SDL_CondSignal(q->cond);
+		SDL_UnlockMutex(q->mutex);
+	}
+}
+
+int packet_queue_put(PacketQueue *q, AVPacket *pkt) {
+	unsigned int windex;
+
+	if(!packet_is_flush(pkt) && av_dup_packet(pkt) < 0) {
+		return -1;
+	}
+
+	windex = SDL_AtomicGet(&q->windex);
+
+	// Only sleep when the ring is full.
+	if(windex - (unsigned int)SDL_AtomicGet(&q->rindex) >= (unsigned int)q->capacity) {
+		SDL_LockMutex(q->mutex);
+		SDL_AtomicAdd(&q->waiters, 1);
+		while(windex - (unsigned int)SDL_AtomicGet(&q->rindex) >= (unsigned int)q->capacity
+				&& !SDL_AtomicGet(&q->abort_request)) {
+			SDL_CondWait(q->cond, q->mutex);
+		}
+		SDL_AtomicAdd(&q->waiters, -1);
+		SDL_UnlockMutex(q->mutex);
+	}
+
+	if(SDL_AtomicGet(&q->abort_request)) {
+		av_free_packet(pkt);
+		return -1;
+	}
+
+	q->pkts[windex & (q->capacity - 1)] = *pkt;
+	SDL_AtomicAdd(&q->nb_packets, 1);
+	SDL_AtomicAdd(&q->size, pkt->size);
+	SDL_AtomicAdd(&q->duration, packet_duration_ms(q, pkt));
+
+	// Publish the slot to the consumer.
+	SDL_AtomicSet(&q->windex, int(windex + 1));
+	packet_queue_wake(q);
+
+	return 0;
+}
+
+int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block) {
+	unsigned int rindex = SDL_AtomicGet(&q->rindex);
+
+	for(;;) {
+		if(SDL_AtomicGet(&q->abort_request)) {
+			return -1;
+		}
+
+		if((unsigned int)SDL_AtomicGet(&q->windex) != rindex) {
+			SDL_MemoryBarrierAcquire();
+			*pkt = q->pkts[rindex & (q->capacity - 1)];
+			SDL_AtomicAdd(&q->nb_packets, -1);
+			SDL_AtomicAdd(&q->size, -pkt->size);
+			SDL_AtomicAdd(&q->duration, -packet_duration_ms(q, pkt));
+
+			// Hand the slot back to the producer.
+			SDL_AtomicSet(&q->rindex, int(++rindex));
+			packet_queue_wake(q);
+
+			// Same handshake as packet_queue_wake() but on the space cond.
+			if(q->space && SDL_AtomicGet(&q->space->waiters) > 0 && !packet_queue_is_full(q)) {
+				packet_queue_space_signal(q->space);
+			}
+
+			// While a flush is on its way everything before it is stale.
+			if(SDL_AtomicGet(&q->flush_pending) > 0) {
+				if(!packet_is_flush(pkt)) {
+					av_free_packet(pkt);
+					continue;
+				}
+
+				// Only the last of several flushes is handed out.
+				if(SDL_AtomicAdd(&q->flush_pending, -1) > 1) {
+					continue;
+				}
+			}
+
+			return 1;
+		}
+
+		if(!block) {
+			return 0;
+		}
+
+		// Only sleep when the ring is empty.
+		SDL_LockMutex(q->mutex);
+		SDL_AtomicAdd(&q->waiters, 1);
+		while((unsigned int)SDL_AtomicGet(&q->windex) == rindex
+				&& !SDL_AtomicGet(&q->abort_request)) {
+			SDL_CondWait(q->cond, q->mutex);
+		}
+		SDL_AtomicAdd(&q->waiters, -1);
+		SDL_UnlockMutex(q->mutex);
+	}
+}
+
+// Makes any blocked or future put/get return -1 straight away.
+void packet_queue_abort(PacketQueue *q) {
+	SDL_LockMutex(q->mutex);
+	SDL_AtomicSet(&q->abort_request, 1);
+	SDL_CondBroadcast(q->cond);
+	SDL_UnlockMutex(q->mutex);
+
+	if(q->space) {
+		packet_queue_space_signal(q->space);
+	}
+}
+
+int packet_queue_flush(PacketQueue *q) {
+	AVPacket pkt;
+
+	av_init_packet(&pkt);
+	pkt.data = flush_data;
+	pkt.size = 0;
+
+	// Counted before it's put so the consumer starts discarding straight away.
+	SDL_AtomicAdd(&q->flush_pending, 1);
+	return packet_queue_put(q, &pkt);
+}
+
+int packet_is_flush(const AVPacket *pkt) {
+	return pkt->data == flush_data;
+}
+
+void packet_queue_set_limits(PacketQueue *q, int maxBytes, double maxSeconds,
+							 AVRational time_base, PacketQueueSpace *space) {
+	q->max_size = maxBytes;
+	q->max_duration = (int)(maxSeconds * 1000);
+	q->time_base = time_base;
+	q->space = space;
+}
+
+int packet_queue_is_full(PacketQueue *q) {
+	return (q->max_size > 0 && SDL_AtomicGet(&q->size) >= q->max_size)
+		   || (q->max_duration > 0 && SDL_AtomicGet(&q->duration) >= q->max_duration);
+}
+
+void packet_queue_space_init(PacketQueueSpace *space) {
+	space->mutex = SDL_CreateMutex();
+	space->cond = SDL_CreateCond();
+	SDL_AtomicSet(&space->waiters, 0);
+}
+
+void packet_queue_space_destroy(PacketQueueSpace *space) {
+	SDL_DestroyCond(space->cond);
+	SDL_DestroyMutex(space->mutex);
+}
+
+void packet_queue_space_signal(PacketQueueSpace *space) {
+	SDL_LockMutex(space->mutex);
+	SDL_CondSignal(space->cond);
+	SDL_UnlockMutex(space->mutex);
+}
@@ -0,0 +1,72 @@
+#ifndef PACKETQUEUE_H
+#define PACKETQUEUE_H
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+#include <SDL.h>
+#include <SDL_atomic.h>
+
+// Lets the producer sleep until one of several queues wants more
+// packets. Each queue signals it when a get takes it back under its
+// limits, anything else the producer waits for (e.g. a seek request)
+// can signal it too.
+typedef struct PacketQueueSpace {
+	SDL_mutex    *mutex;
+	SDL_cond     *cond;
+	SDL_atomic_t waiters;
+} PacketQueueSpace;
+
+// Bounded single-producer/single-consumer ring of packets.
+// decode_thread is the only producer and video_thread or audio_thread
+// the only consumer, so put/get never take a lock on the fast
+// path. The mutex and cond are only used to sleep when the ring is
+// empty (consumer) or full (producer).
+typedef struct PacketQueue {
+	AVPacket     *pkts;       /* ring storage, capacity is a power of two */
+	int          capacity;
+	SDL_atomic_t windex;      /* only written by the producer */
+	SDL_atomic_t rindex;      /* only written by the consumer */
+	SDL_atomic_t nb_packets;
+	SDL_atomic_t size;        /* bytes of packet data in the queue */
+	SDL_atomic_t duration;    /* ms of media in the queue, from the packet durations */
+	SDL_atomic_t waiters;     /* threads sleeping on cond */
+	SDL_atomic_t abort_request;
+	SDL_atomic_t flush_pending; /* flush packets put but not yet got */
+	SDL_mutex    *mutex;
+	SDL_cond     *cond;
+
+	/* Soft limits the producer keeps the queue to, see packet_queue_is_full() */
+	int          max_size;
+	int          max_duration;
+	AVRational   time_base;
+	PacketQueueSpace *space;
+} PacketQueue;
+
+#define PACKET_QUEUE_DEFAULT_CAPACITY 1024
+
+void packet_queue_init(PacketQueue *q, int capacity);
+void packet_queue_destroy(PacketQueue *q);
+int packet_queue_put(PacketQueue *q, AVPacket *pkt);
+int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block);
+void packet_queue_abort(PacketQueue *q);
+
+// The queue counts as full once it holds either this many bytes or this
+// many seconds of media, durations being in time_base. space gets
+// signalled when it stops being full. 0 means no limit.
+void packet_queue_set_limits(PacketQueue *q, int maxBytes, double maxSeconds,
+							 AVRational time_base, PacketQueueSpace *space);
+int packet_queue_is_full(PacketQueue *q);
+
+void packet_queue_space_init(PacketQueueSpace *space);
+void packet_queue_space_destroy(PacketQueueSpace *space);
+void packet_queue_space_signal(PacketQueueSpace *space);
+
+// Called by the producer, e.g. after a seek. Everything put before it is
+// thrown away by the consumer, whose next get returns a flush packet so
+// it knows to reset its decoder.
+int packet_queue_flush(PacketQueue *q);
+int packet_is_flush(const AVPacket *pkt);
+
+#endif // PACKETQUEUE_H
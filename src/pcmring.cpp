@@ -0,0 +1,114 @@
+#include "pcmring.h"
+
+#include <string.h>
+
+void pcm_ring_init(PcmRing *ring, int capacity) {
+	unsigned int c = 1;
+
+	while(c < (unsigned int)capacity) {
+		c <<= 1;
+	}
+
+	memset(ring, 0, sizeof(PcmRing));
+	ring->data = (Uint8 *)SDL_malloc(c);
+	ring->capacity = c;
+}
+
+void pcm_ring_destroy(PcmRing *ring) {
+	SDL_free(ring->data);
+	ring->data = NULL;
+}
+
+// Copies len bytes between the ring at pos and buf, wrapping around the
+// end of the ring.
+static void pcm_ring_copy(PcmRing *ring, unsigned int pos, Uint8 *buf, int len, int toRing) {
+	unsigned int offset = pos & (ring->capacity - 1);
+	unsigned int first = ring->capacity - offset;
+
+	if(first > (unsigned int)len) {
+		first = len;
+	}
+
+	if(toRing) {
+		memcpy(ring->data + offset, buf, first);
+		memcpy(ring->data, buf + first, len - first);
+	} else {
+		memcpy(buf, ring->data + offset, first);
+		memcpy(buf + first, ring->data, len - first);
+	}
+}
+
+int pcm_ring_write(PcmRing *ring, const Uint8 *src, int len) {
+	unsigned int windex = SDL_AtomicGet(&ring->windex);
+	unsigned int space = ring->capacity - (windex - (unsigned int)SDL_AtomicGet(&ring->rindex));
+
+	if((unsigned int)len > space) {
+		len = space;
+	}
+	if(len <= 0) {
+		return 0;
+	}
+
+	pcm_ring_copy(ring, windex, (Uint8 *)src, len, 1);
+
+	// Publish the bytes to the consumer.
+	SDL_AtomicSet(&ring->windex, int(windex + len));
+	return len;
+}
+
+// The positions wrap, so discard is only taken as ahead of rindex while
+// it's one the consumer hasn't skipped yet and it's within what's been
+// written. Once it's been skipped it can be 2^31 or more behind.
+unsigned int pcm_ring_read_pos(PcmRing *ring) {
+	unsigned int rindex = SDL_AtomicGet(&ring->rindex);
+	unsigned int discard, windex;
+
+	if(SDL_AtomicGet(&ring->discards) == SDL_AtomicGet(&ring->skipped)) {
+		return rindex;
+	}
+
+	discard = SDL_AtomicGet(&ring->discard);
+	windex = SDL_AtomicGet(&ring->windex);
+	return (discard - rindex <= windex - rindex) ? discard : rindex;
+}
+
+int pcm_ring_read(PcmRing *ring, Uint8 *dst, int len) {
+	int discards = SDL_AtomicGet(&ring->discards);
+	unsigned int rindex = pcm_ring_read_pos(ring);
+	unsigned int avail = (unsigned int)SDL_AtomicGet(&ring->windex) - rindex;
+
+	SDL_MemoryBarrierAcquire();
+
+	if((unsigned int)len > avail) {
+		len = avail;
+	}
+	if(len > 0) {
+		pcm_ring_copy(ring, rindex, dst, len, 0);
+	}
+
+	// Hand the space back to the producer, along with anything skipped.
+	SDL_AtomicSet(&ring->rindex, int(rindex + len));
+	SDL_AtomicSet(&ring->skipped, discards);
+	return len;
+}
+
+int pcm_ring_fill(PcmRing *ring) {
+	// The read side first, it can only have moved closer by the time the
+	// write side is read.
+	unsigned int rindex = pcm_ring_read_pos(ring);
+	return (int)(pcm_ring_write_pos(ring) - rindex);
+}
+
+int pcm_ring_space(PcmRing *ring) {
+	return (int)(ring->capacity - ((unsigned int)SDL_AtomicGet(&ring->windex)
+								   - (unsigned int)SDL_AtomicGet(&ring->rindex)));
+}
+
+unsigned int pcm_ring_write_pos(PcmRing *ring) {
+	return SDL_AtomicGet(&ring->windex);
+}
+
+void pcm_ring_discard(PcmRing *ring) {
+	SDL_AtomicSet(&ring->discard, SDL_AtomicGet(&ring->windex));
+	SDL_AtomicAdd(&ring->discards, 1);
+}
@@ -0,0 +1,45 @@
+#ifndef PCMRING_H
+#define PCMRING_H
+
+#include <SDL.h>
+#include <SDL_atomic.h>
+
+// Single-producer/single-consumer ring of PCM bytes between the audio
+// decode thread and the audio callback. Neither side ever takes a lock
+// or sleeps in here, so the callback can't be held up by the decoder.
+// A producer that finds it full has to be woken by the consumer, see
+// pcm_ring_space().
+typedef struct PcmRing {
+	Uint8        *data;
+	unsigned int capacity; /* bytes, a power of two */
+	SDL_atomic_t windex;   /* bytes ever written, only moved by the producer */
+	SDL_atomic_t rindex;   /* bytes ever read, only moved by the consumer */
+	SDL_atomic_t discard;  /* the consumer skips everything before this, */
+	SDL_atomic_t discards; /* as of this many pcm_ring_discard() calls, */
+	SDL_atomic_t skipped;  /* and it's done so for this many */
+} PcmRing;
+
+// capacity is rounded up to a power of two.
+void pcm_ring_init(PcmRing *ring, int capacity);
+void pcm_ring_destroy(PcmRing *ring);
+
+// Both copy as much as fits or is there and return how many bytes that
+// was.
+int pcm_ring_write(PcmRing *ring, const Uint8 *src, int len);
+int pcm_ring_read(PcmRing *ring, Uint8 *dst, int len);
+
+// Bytes waiting to be read.
+int pcm_ring_fill(PcmRing *ring);
+// Bytes pcm_ring_write() would take right now. Discarded bytes only
+// count once the consumer has skipped them.
+int pcm_ring_space(PcmRing *ring);
+// Position of the producer's next byte, in bytes ever written.
+unsigned int pcm_ring_write_pos(PcmRing *ring);
+// Position of the consumer's next byte, past anything discarded.
+unsigned int pcm_ring_read_pos(PcmRing *ring);
+
+// Producer only. Drops everything written so far, e.g. after a seek.
+// The space only comes back once the consumer has skipped over it.
+void pcm_ring_discard(PcmRing *ring);
+
+#endif // PCMRING_H
@@ -0,0 +1,212 @@
+#include "playlist.h"
+
+#include <SDL.h>
+#include <SDL_thread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct Playlist {
+	char            **files;
+	int             count;
+	int             loop;
+	VideoOutputFormat output_format;
+
+	VideoState      *current;       /* only touched by the render thread */
+	int             current_index;
+
+	// Guarded by mutex.
+	SDL_mutex       *mutex;
+	SDL_cond        *cond;
+	VideoState      *next;          /* opened and paused, ready to start */
+	int             next_index;
+	int             load_index;     /* file for the loader to open next, -1 when there's nothing to do */
+	int             loading;        /* the loader is busy opening */
+	VideoState      *retired;       /* for the loader to close, */
+	Uint32          retired_until;  /* at this SDL_GetTicks(), once its audio has played out */
+	int             quit;
+
+	SDL_Thread      *loader;
+};
+
+// Opens the first playable file from index on, wrapping round if the
+// playlist loops. Returns NULL if it runs out of files.
+static VideoState *playlist_open_from(Playlist *pl, int index, int *opened) {
+	for(int tries = 0; tries < pl->count; tries++, index++) {
+		if(index >= pl->count) {
+			if(!pl->loop) {
+				break;
+			}
+			index = 0;
+		}
+
+		VideoState *is = video_open(pl->files[index], pl->output_format, VIDEO_OPEN_PAUSED);
+		if(is) {
+			*opened = index;
+			return is;
+		}
+
+		fprintf(stderr, "Playlist: skipping %s\n", pl->files[index]);
+	}
+
+	return NULL;
+}
+
+static int playlist_loader(void *arg) {
+	Playlist *pl = (Playlist*)arg;
+
+	SDL_LockMutex(pl->mutex);
+
+	while(!pl->quit) {
+		Uint32 now = SDL_GetTicks();
+
+		if(pl->retired && (Sint32)(pl->retired_until - now) <= 0) {
+			VideoState *is = pl->retired;
+			pl->retired = NULL;
+
+			SDL_UnlockMutex(pl->mutex);
+			video_close(is);
+			SDL_LockMutex(pl->mutex);
+			continue;
+		}
+
+		if(pl->load_index >= 0 && !pl->next) {
+			int index = pl->load_index, opened = -1;
+			pl->load_index = -1;
+			pl->loading = 1;
+
+			SDL_UnlockMutex(pl->mutex);
+			Uint32 start = SDL_GetTicks();
+			VideoState *is = playlist_open_from(pl, index, &opened);
+			if(is) {
+				printf("Playlist: %s ready in %d ms\n", pl->files[opened], (int)(SDL_GetTicks() - start));
+			}
+			SDL_LockMutex(pl->mutex);
+
+			pl->next = is;
+			pl->next_index = opened;
+			pl->loading = 0;
+			SDL_CondBroadcast(pl->cond);
+			continue;
+		}
+
+		if(pl->retired) {
+			SDL_CondWaitTimeout(pl->cond, pl->mutex, pl->retired_until - now);
+		} else {
+			SDL_CondWait(pl->cond, pl->mutex);
+		}
+	}
+
+	SDL_UnlockMutex(pl->mutex);
+	return 0;
+}
+
+// Swaps in the loaded player, if there is one, and sets the loader going
+// on the file after it. The old one keeps playing the audio it has
+// decoded until the loader closes it. A file shorter than that tail
+// waits for the one before it to go first.
+static int playlist_advance(Playlist *pl) {
+	VideoState *is;
+
+	SDL_LockMutex(pl->mutex);
+
+	is = pl->next;
+	if(!is || (pl->current && pl->retired)) {
+		SDL_UnlockMutex(pl->mutex);
+		return 0;
+	}
+
+	pl->retired = pl->current;
+	if(pl->retired) {
+		pl->retired_until = SDL_GetTicks() + (Uint32)(video_get_audio_remaining(pl->retired) * 1000) + 1;
+	}
+	pl->current = is;
+	pl->current_index = pl->next_index;
+	pl->next = NULL;
+	pl->load_index = pl->current_index + 1;
+	SDL_CondBroadcast(pl->cond);
+
+	SDL_UnlockMutex(pl->mutex);
+
+	video_start(is);
+	return 1;
+}
+
+Playlist *playlist_create(const char *const *files, int count, int loop, VideoOutputFormat outputFormat) {
+	Playlist *pl;
+
+	if(count <= 0) {
+		return NULL;
+	}
+
+	pl = (Playlist*)calloc(1, sizeof(Playlist));
+	pl->files = (char**)calloc(count, sizeof(char*));
+	for(int i = 0; i < count; i++) {
+		pl->files[i] = strdup(files[i]);
+	}
+	pl->count = count;
+	pl->loop = loop;
+	pl->output_format = outputFormat;
+	pl->current_index = -1;
+	pl->next_index = -1;
+	pl->load_index = 0;
+
+	pl->mutex = SDL_CreateMutex();
+	pl->cond = SDL_CreateCond();
+	pl->loader = SDL_CreateThread(playlist_loader, "playlist_loader", pl);
+
+	// Nothing to show until the first one is open.
+	SDL_LockMutex(pl->mutex);
+	while(pl->load_index >= 0 || pl->loading) {
+		SDL_CondWait(pl->cond, pl->mutex);
+	}
+	SDL_UnlockMutex(pl->mutex);
+
+	if(!playlist_advance(pl)) {
+		playlist_destroy(pl);
+		return NULL;
+	}
+
+	return pl;
+}
+
+void playlist_destroy(Playlist *pl) {
+	if(!pl) {
+		return;
+	}
+
+	SDL_LockMutex(pl->mutex);
+	pl->quit = 1;
+	SDL_CondBroadcast(pl->cond);
+	SDL_UnlockMutex(pl->mutex);
+	SDL_WaitThread(pl->loader, NULL);
+
+	video_close(pl->retired);
+	video_close(pl->next);
+	video_close(pl->current);
+
+	SDL_DestroyCond(pl->cond);
+	SDL_DestroyMutex(pl->mutex);
+
+	for(int i = 0; i < pl->count; i++) {
+		free(pl->files[i]);
+	}
+	free(pl->files);
+	free(pl);
+}
+
+VideoState *playlist_current(Playlist *pl) {
+	return pl->current;
+}
+
+int playlist_current_index(Playlist *pl) {
+	return pl->current_index;
+}
+
+int playlist_update(Playlist *pl, double displayTime) {
+	if(!video_is_finished(pl->current, displayTime)) {
+		return 0;
+	}
+
+	return playlist_advance(pl);
+}
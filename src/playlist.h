@@ -0,0 +1,31 @@
+#ifndef PLAYLIST_H
+#define PLAYLIST_H
+
+#include "video.h"
+
+// Plays files one after another. While one plays, a loader thread opens
+// the next one paused, so it's probed and has its first pictures decoded
+// by the time it's needed. Moving on is then just a matter of rendering
+// from the other player. The next one's audio starts while the finished
+// one's is still playing out, and the finished one is only closed once
+// that's been heard, on the loader thread so nothing slow happens on the
+// render thread.
+typedef struct Playlist Playlist;
+
+// Opens the first file that can be played before returning, NULL if
+// none of them can. With loop set it goes back to the start after the
+// last file, otherwise the last picture stays up.
+Playlist *playlist_create(const char *const *files, int count, int loop, VideoOutputFormat outputFormat);
+void playlist_destroy(Playlist *pl);
+
+// The player to render from.
+VideoState *playlist_current(Playlist *pl);
+// Index in files of the current player.
+int playlist_current_index(Playlist *pl);
+
+// Call from the render loop before video_refresh(). Moves on to the next
+// file once the current one has finished, as long as the next one is
+// ready. Returns 1 if playlist_current() changed.
+int playlist_update(Playlist *pl, double displayTime);
+
+#endif // PLAYLIST_H
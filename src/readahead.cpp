@@ -0,0 +1,415 @@
+#include "readahead.h"
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <SDL.h>
+#include <SDL_thread.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+// The window is made of blocks this big, each read with one call.
+#define READ_AHEAD_BLOCK_SIZE (1024 * 1024)
+// Page aligned, which is what unbuffered file I/O wants.
+#define READ_AHEAD_BLOCK_ALIGN 4096
+
+// Buffer avio copies small reads into.
+#define READ_AHEAD_IO_BUFFER_SIZE (64 * 1024)
+
+enum {
+	BLOCK_EMPTY,
+	BLOCK_LOADING,
+	BLOCK_READY,
+	BLOCK_ERROR
+};
+
+typedef struct ReadAheadBlock {
+	uint8_t *data;
+	int64_t index;  /* which block of the file it holds */
+	int     size;   /* bytes in it, less than a whole block at the end of the file */
+	int     state;
+} ReadAheadBlock;
+
+// Block i of the file lives in blocks[i % nb_blocks]. The window is the
+// nb_blocks blocks from cur_block on, and the I/O thread fills it nearest
+// block first. Only the I/O thread loads blocks and only the reader moves
+// cur_block, so the reader can copy out of the block at cur_block
+// without holding the mutex.
+typedef struct ReadAhead {
+#ifdef _WIN32
+	HANDLE            file;
+#else
+	int               fd;
+#endif
+	int64_t           size;
+	int64_t           pos;
+
+	ReadAheadBlock    *blocks;
+	int               nb_blocks;
+	int64_t           cur_block;
+
+	SDL_mutex         *mutex;
+	SDL_cond          *cond;   /* the window moved, or a block finished loading */
+	SDL_Thread        *thread;
+	int               quit;
+
+	ReadAheadThrottle throttle;
+	int64_t           throttle_bytes;
+	AVIOInterruptCB   interrupt;
+
+	ReadAheadStats    stats;
+} ReadAhead;
+
+static uint8_t *block_alloc(int size) {
+	uint8_t *mem = (uint8_t*)av_malloc(size + READ_AHEAD_BLOCK_ALIGN + sizeof(void*));
+	uint8_t *buf;
+
+	if(!mem) {
+		return NULL;
+	}
+
+	buf = (uint8_t*)(((uintptr_t)mem + sizeof(void*) + READ_AHEAD_BLOCK_ALIGN - 1)
+					 & ~(uintptr_t)(READ_AHEAD_BLOCK_ALIGN - 1));
+	((void**)buf)[-1] = mem;
+	return buf;
+}
+
+static void block_free(uint8_t *buf) {
+	if(buf) {
+		av_free(((void**)buf)[-1]);
+	}
+}
+
+// Reads size bytes at offset from the file, returns how many it got.
+static int source_read(ReadAhead *ra, uint8_t *buf, int64_t offset, int size) {
+	int got = 0;
+
+#ifdef _WIN32
+	OVERLAPPED ov;
+	DWORD n;
+
+	memset(&ov, 0, sizeof(ov));
+	ov.Offset = (DWORD)offset;
+	ov.OffsetHigh = (DWORD)(offset >> 32);
+	if(ReadFile(ra->file, buf, size, &n, &ov)) {
+		got = (int)n;
+	}
+#else
+	while(got < size) {
+		ssize_t n = pread(ra->fd, buf + got, size - got, offset + got);
+		if(n <= 0) {
+			break;
+		}
+		got += (int)n;
+	}
+#endif
+
+	// Pretend to be slow storage.
+	if(ra->throttle.bandwidth > 0) {
+		SDL_Delay((Uint32)(got / (ra->throttle.bandwidth * 1024 * 1024) * 1000));
+	}
+	if(ra->throttle.hiccup_ms > 0 && ra->throttle.hiccup_every > 0) {
+		ra->throttle_bytes += got;
+		if(ra->throttle_bytes >= (int64_t)ra->throttle.hiccup_every * 1024 * 1024) {
+			ra->throttle_bytes = 0;
+			SDL_Delay(ra->throttle.hiccup_ms);
+		}
+	}
+
+	return got;
+}
+
+static int read_ahead_thread(void *arg) {
+	ReadAhead *ra = (ReadAhead*)arg;
+	int64_t lastBlock = (ra->size - 1) / READ_AHEAD_BLOCK_SIZE;
+
+	SDL_LockMutex(ra->mutex);
+
+	while(!ra->quit) {
+		ReadAheadBlock *b = NULL;
+		int64_t index;
+
+		// Nearest block in the window that isn't loaded yet.
+		for(index = ra->cur_block; index < ra->cur_block + ra->nb_blocks && index <= lastBlock; index++) {
+			ReadAheadBlock *slot = &ra->blocks[index % ra->nb_blocks];
+			if(slot->index != index || slot->state == BLOCK_EMPTY) {
+				b = slot;
+				break;
+			}
+		}
+
+		if(!b) {
+			SDL_CondWait(ra->cond, ra->mutex);
+			continue;
+		}
+
+		int64_t offset = index * READ_AHEAD_BLOCK_SIZE;
+		int size = (int)FFMIN((int64_t)READ_AHEAD_BLOCK_SIZE, ra->size - offset);
+
+		b->index = index;
+		b->state = BLOCK_LOADING;
+		SDL_UnlockMutex(ra->mutex);
+
+		int got = source_read(ra, b->data, offset, size);
+
+		SDL_LockMutex(ra->mutex);
+		b->size = got;
+		b->state = (got == size) ? BLOCK_READY : BLOCK_ERROR;
+		ra->stats.bytes_read += got;
+		SDL_CondBroadcast(ra->cond);
+	}
+
+	SDL_UnlockMutex(ra->mutex);
+	return 0;
+}
+
+static int read_ahead_read(void *opaque, uint8_t *buf, int buf_size) {
+	ReadAhead *ra = (ReadAhead*)opaque;
+	int64_t index;
+	ReadAheadBlock *b;
+	int offset;
+
+	if(ra->pos >= ra->size) {
+		return AVERROR_EOF;
+	}
+
+	index = ra->pos / READ_AHEAD_BLOCK_SIZE;
+	b = &ra->blocks[index % ra->nb_blocks];
+
+	SDL_LockMutex(ra->mutex);
+
+	if(ra->cur_block != index) {
+		ra->cur_block = index;
+		SDL_CondBroadcast(ra->cond);
+	}
+
+	if(b->index == index && b->state == BLOCK_READY) {
+		ra->stats.hits++;
+
+	} else {
+		int64_t start = av_gettime();
+
+		ra->stats.misses++;
+		while(b->index != index || (b->state != BLOCK_READY && b->state != BLOCK_ERROR)) {
+			if(ra->interrupt.callback && ra->interrupt.callback(ra->interrupt.opaque)) {
+				SDL_UnlockMutex(ra->mutex);
+				return AVERROR_EXIT;
+			}
+			SDL_CondWaitTimeout(ra->cond, ra->mutex, 10);
+		}
+		ra->stats.stall_seconds += (av_gettime() - start) / 1000000.0;
+	}
+
+	if(b->state == BLOCK_ERROR) {
+		// Let the I/O thread try it again next time.
+		b->state = BLOCK_EMPTY;
+		SDL_CondBroadcast(ra->cond);
+		SDL_UnlockMutex(ra->mutex);
+		return AVERROR(EIO);
+	}
+
+	SDL_UnlockMutex(ra->mutex);
+
+	// Reads stop at the end of the block, avio just asks again.
+	offset = (int)(ra->pos - index * READ_AHEAD_BLOCK_SIZE);
+	if(buf_size > b->size - offset) {
+		buf_size = b->size - offset;
+	}
+
+	memcpy(buf, b->data + offset, buf_size);
+	ra->pos += buf_size;
+	return buf_size;
+}
+
+static int64_t read_ahead_seek(void *opaque, int64_t offset, int whence) {
+	ReadAhead *ra = (ReadAhead*)opaque;
+	int64_t pos;
+
+	switch(whence & ~AVSEEK_FORCE) {
+		case AVSEEK_SIZE:
+			return ra->size;
+
+		case SEEK_SET:
+			pos = offset;
+			break;
+
+		case SEEK_CUR:
+			pos = ra->pos + offset;
+			break;
+
+		case SEEK_END:
+			pos = ra->size + offset;
+			break;
+
+		default:
+			return AVERROR(EINVAL);
+	}
+
+	if(pos < 0) {
+		return AVERROR(EINVAL);
+	}
+
+	// The window follows on the next read.
+	ra->pos = pos;
+	return pos;
+}
+
+static void read_ahead_free(ReadAhead *ra) {
+	if(ra->thread) {
+		SDL_LockMutex(ra->mutex);
+		ra->quit = 1;
+		SDL_CondBroadcast(ra->cond);
+		SDL_UnlockMutex(ra->mutex);
+		SDL_WaitThread(ra->thread, NULL);
+	}
+
+	if(ra->blocks) {
+		for(int i = 0; i < ra->nb_blocks; i++) {
+			block_free(ra->blocks[i].data);
+		}
+		av_free(ra->blocks);
+	}
+
+	if(ra->cond) {
+		SDL_DestroyCond(ra->cond);
+	}
+	if(ra->mutex) {
+		SDL_DestroyMutex(ra->mutex);
+	}
+
+#ifdef _WIN32
+	if(ra->file != INVALID_HANDLE_VALUE) {
+		CloseHandle(ra->file);
+	}
+#else
+	if(ra->fd >= 0) {
+		close(ra->fd);
+	}
+#endif
+
+	av_free(ra);
+}
+
+AVIOContext *read_ahead_open(const char *filename, int window, const ReadAheadThrottle *throttle,
+							 const AVIOInterruptCB *interrupt) {
+	ReadAhead *ra = (ReadAhead*)av_mallocz(sizeof(ReadAhead));
+	uint8_t *buffer;
+	AVIOContext *pb;
+
+	if(!ra) {
+		return NULL;
+	}
+
+#ifdef _WIN32
+	LARGE_INTEGER size;
+
+	ra->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+						   FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if(ra->file == INVALID_HANDLE_VALUE || !GetFileSizeEx(ra->file, &size) || size.QuadPart <= 0) {
+		read_ahead_free(ra);
+		return NULL;
+	}
+	ra->size = size.QuadPart;
+#else
+	struct stat st;
+
+	ra->fd = open(filename, O_RDONLY);
+	if(ra->fd < 0 || fstat(ra->fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+		read_ahead_free(ra);
+		return NULL;
+	}
+	ra->size = st.st_size;
+#endif
+
+	if(throttle) {
+		ra->throttle = *throttle;
+	}
+	if(interrupt) {
+		ra->interrupt = *interrupt;
+	}
+
+	// No point in a window bigger than the file.
+	ra->nb_blocks = (int)FFMIN((int64_t)window / READ_AHEAD_BLOCK_SIZE,
+							   (ra->size + READ_AHEAD_BLOCK_SIZE - 1) / READ_AHEAD_BLOCK_SIZE);
+	if(ra->nb_blocks < 2) {
+		ra->nb_blocks = 2;
+	}
+
+	ra->blocks = (ReadAheadBlock*)av_mallocz(ra->nb_blocks * sizeof(ReadAheadBlock));
+	if(!ra->blocks) {
+		read_ahead_free(ra);
+		return NULL;
+	}
+
+	for(int i = 0; i < ra->nb_blocks; i++) {
+		ra->blocks[i].index = -1;
+		ra->blocks[i].data = block_alloc(READ_AHEAD_BLOCK_SIZE);
+		if(!ra->blocks[i].data) {
+			read_ahead_free(ra);
+			return NULL;
+		}
+	}
+
+	ra->mutex = SDL_CreateMutex();
+	ra->cond = SDL_CreateCond();
+	ra->thread = SDL_CreateThread(read_ahead_thread, "read_ahead_thread", ra);
+	if(!ra->thread) {
+		read_ahead_free(ra);
+		return NULL;
+	}
+
+	buffer = (uint8_t*)av_malloc(READ_AHEAD_IO_BUFFER_SIZE);
+	if(!buffer) {
+		read_ahead_free(ra);
+		return NULL;
+	}
+
+	pb = avio_alloc_context(buffer, READ_AHEAD_IO_BUFFER_SIZE, 0, ra, read_ahead_read, NULL, read_ahead_seek);
+	if(!pb) {
+		av_free(buffer);
+		read_ahead_free(ra);
+		return NULL;
+	}
+
+	return pb;
+}
+
+void read_ahead_close(AVIOContext **pb) {
+	if(!*pb) {
+		return;
+	}
+
+	read_ahead_free((ReadAhead*)(*pb)->opaque);
+	av_freep(&(*pb)->buffer);
+	av_freep(pb);
+}
+
+void read_ahead_get_stats(AVIOContext *pb, ReadAheadStats *stats) {
+	ReadAhead *ra = (ReadAhead*)pb->opaque;
+
+	SDL_LockMutex(ra->mutex);
+	*stats = ra->stats;
+	SDL_UnlockMutex(ra->mutex);
+}
+
+int read_ahead_parse_throttle(const char *str, ReadAheadThrottle *throttle) {
+	if(!str) {
+		return 0;
+	}
+
+	throttle->bandwidth = 0;
+	throttle->hiccup_ms = 0;
+	throttle->hiccup_every = 64;
+
+	return sscanf(str, "%lf,%d,%d", &throttle->bandwidth, &throttle->hiccup_ms, &throttle->hiccup_every) >= 1;
+}
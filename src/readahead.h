@@ -0,0 +1,42 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+extern "C" {
+#include <libavformat/avio.h>
+}
+
+// An AVIOContext for local files with an I/O thread that keeps reading
+// ahead of the demuxer, so a slow disk or a network share hiccup is
+// soaked up by the prefetch window instead of stalling decode_thread.
+// The window is a ring of large page aligned blocks that follows the
+// read position, seeking inside it costs nothing.
+
+typedef struct ReadAheadStats {
+	int64_t hits;          /* reads served straight from the window */
+	int64_t misses;        /* reads that had to wait for the I/O thread */
+	double  stall_seconds; /* total time spent waiting */
+	int64_t bytes_read;    /* read from the file by the I/O thread */
+} ReadAheadStats;
+
+// Simulated slow storage for testing. bandwidth is in MB/s, 0 for no
+// limit, and every hiccup_every MB the source also stops for hiccup_ms.
+typedef struct ReadAheadThrottle {
+	double bandwidth;
+	int    hiccup_ms;
+	int    hiccup_every;
+} ReadAheadThrottle;
+
+// window is in bytes. throttle can be NULL. interrupt, if set, is polled
+// while a read is waiting so it can be abandoned at shutdown. Returns
+// NULL if the file can't be opened, in which case the caller should fall
+// back to another way of reading it.
+AVIOContext *read_ahead_open(const char *filename, int window, const ReadAheadThrottle *throttle,
+							 const AVIOInterruptCB *interrupt);
+void read_ahead_close(AVIOContext **pb);
+void read_ahead_get_stats(AVIOContext *pb, ReadAheadStats *stats);
+
+// Reads "MB/s[,hiccup ms[,every MB]]", e.g. from an environment variable.
+// Returns 0 if str is NULL or doesn't parse.
+int read_ahead_parse_throttle(const char *str, ReadAheadThrottle *throttle);
+
+#endif // READAHEAD_H
@@ -0,0 +1,554 @@
+extern "C" {
+#include <libavcodec/avfft.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/mem.h>
+}
+
+#include "spatialaudio.h"
+
+#include <SDL.h>
+#include <SDL_atomic.h>
+#include <xmmintrin.h>
+#include <complex>
+#include <math.h>
+#include <string.h>
+
+#define PI 3.14159265358979323846
+
+// Each response is cut to HRIR_LENGTH and convolved in PARTITIONS
+// pieces of SPATIAL_BLOCK, overlap-save with FFTs twice that long.
+#define HRIR_LENGTH 256
+#define HRIR_FADE 32
+#define PARTITIONS (HRIR_LENGTH / SPATIAL_BLOCK)
+#define FFT_BITS 8
+#define FFT_SIZE (1 << FFT_BITS)
+// The responses are worked out in the frequency domain at this size,
+// long enough that nothing wraps round into the part that's kept.
+#define SYNTH_BITS 10
+#define SYNTH_SIZE (1 << SYNTH_BITS)
+
+// Directions the responses are worked out for. Only the left ear's are
+// kept, the right ear's is the left's for the mirror image direction.
+#define GRID_AZ_STEP 5
+#define GRID_AZ (360 / GRID_AZ_STEP)
+#define GRID_EL_MIN -40
+#define GRID_EL_STEP 10
+#define GRID_EL ((90 - GRID_EL_MIN) / GRID_EL_STEP + 1)
+// Each partition's spectrum as two FFT_SIZE rows for spectrum_mac().
+#define FILTER_FLOATS (PARTITIONS * 2 * FFT_SIZE)
+
+#define MAX_SPEAKERS 8
+
+// Brown and Duda, "A structural model for binaural sound synthesis",
+// 1998: a rigid sphere with the ears a little behind centre, a one pole
+// one zero head shadow filter and five pinna echoes.
+#define HEAD_RADIUS 0.0875
+#define SPEED_OF_SOUND 343.0
+#define EAR_AZIMUTH 100.0
+#define SHADOW_ALPHA_MIN 0.1
+#define SHADOW_THETA_MIN 150.0
+// Samples of delay on every response so the ringing of a fractional
+// delay isn't cut off at the start.
+#define PRE_DELAY 16
+
+static const double pinna_rho[5] = { 0.5, -1.0, 0.5, -0.25, 0.25 };
+static const double pinna_a[5] = { 1, 5, 5, 5, 5 };
+static const double pinna_b[5] = { 2, 4, 7, 11, 13 };  /* samples at 44.1 kHz */
+static const double pinna_d[5] = { 1, 0.5, 0.5, 0.5, 0.5 };
+
+typedef struct FilterSet {
+	int rate;
+	int refs;
+	float *filters;  /* GRID_EL rows of GRID_AZ, FILTER_FLOATS each */
+} FilterSet;
+
+typedef struct Speaker {
+	uint64_t channel;
+	int lfe;                       /* not placed, goes to both ears as it is */
+	int cell[2];                   /* grid direction each ear's filter is for, -1 to start */
+	float history[SPATIAL_BLOCK];  /* the last block in */
+	float *spectra;                /* the last PARTITIONS blocks' spectra, each with a swapped copy */
+} Speaker;
+
+struct SpatialRenderer {
+	int channels;
+	Speaker speakers[MAX_SPEAKERS];
+	FilterSet *filters;
+	RDFTContext *fft, *ifft;
+	float *work;
+	float *acc;     /* per ear: steady, fading out and fading in */
+	int slot;       /* newest in each speaker's spectra */
+	float gain;
+};
+
+// The listener, shared by every renderer.
+static SDL_SpinLock listener_lock;
+// Where main.cpp sits the viewer in front of a 16:9 screen.
+static float screen_centre[3] = { 0.0f, 0.345f, -4.012f };
+static float screen_half_width = 1.778f;
+static float head_orientation[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+
+// The last FilterSet made, kept for the next file at the same rate.
+static SDL_SpinLock filter_lock;
+static FilterSet *filter_cache;
+
+static int use_sse()
+{
+	static int sse = -1;
+
+	if(sse < 0)
+		sse = SDL_HasSSE() ? 1 : 0;
+	return sse;
+}
+
+void spatial_set_screen(const float centre[3], float halfWidth)
+{
+	SDL_AtomicLock(&listener_lock);
+	memcpy(screen_centre, centre, sizeof(screen_centre));
+	screen_half_width = halfWidth;
+	SDL_AtomicUnlock(&listener_lock);
+}
+
+void spatial_set_orientation(const float orientation[4])
+{
+	SDL_AtomicLock(&listener_lock);
+	memcpy(head_orientation, orientation, sizeof(head_orientation));
+	SDL_AtomicUnlock(&listener_lock);
+}
+
+/**************************/
+// Responses
+
+// FFmpeg's RDFT packs the real DC and Nyquist bins into the first two
+// floats and leaves the inverse unnormalised, and which sign its
+// exponent has isn't documented. So both are measured on an impulse one
+// sample in, whose first bin is e^-i2pi/n with the usual sign.
+static void rdft_conventions(int bits, float *inverseScale, int *conjugate)
+{
+	float *x = (float *)av_mallocz((1 << bits) * sizeof(float));
+	RDFTContext *fwd = av_rdft_init(bits, DFT_R2C);
+	RDFTContext *inv = av_rdft_init(bits, IDFT_C2R);
+
+	x[1] = 1;
+	av_rdft_calc(fwd, x);
+	*conjugate = x[3] > 0;
+	av_rdft_calc(inv, x);
+	*inverseScale = 1.0f / x[1];
+
+	av_rdft_end(fwd);
+	av_rdft_end(inv);
+	av_free(x);
+}
+
+// The left ear's response to a source az degrees right of straight ahead
+// and el degrees up, HRIR_LENGTH samples with the end faded out.
+static void hrir_left(float *ir, float *spectrum, RDFTContext *synth, float synthScale, int conjugate,
+					  int rate, double az, double el)
+{
+	double azr = az * PI / 180, elr = el * PI / 180;
+	double a = HEAD_RADIUS / SPEED_OF_SOUND;
+	// Angle between the source and the ear's axis.
+	double theta = acos(cos(elr) * cos(azr + EAR_AZIMUTH * PI / 180));
+	double alpha = (1 + SHADOW_ALPHA_MIN / 2)
+				   + (1 - SHADOW_ALPHA_MIN / 2) * cos(theta / SHADOW_THETA_MIN * 180);
+	double delay = (theta < PI / 2 ? -a * cos(theta) : a * (theta - PI / 2)) + a + PRE_DELAY / (double)rate;
+	double pinna[5];
+
+	for(int n = 0; n < 5; n++)
+		pinna[n] = (pinna_a[n] * cos(azr / 2) * sin(pinna_d[n] * (PI / 2 - elr)) + pinna_b[n]) / 44100.0;
+
+	for(int k = 0; k <= SYNTH_SIZE / 2; k++) {
+		double w = 2 * PI * k * rate / SYNTH_SIZE;
+		std::complex<double> h = std::complex<double>(1, alpha * w * a / 2) / std::complex<double>(1, w * a / 2);
+		std::complex<double> p = 1;
+
+		for(int n = 0; n < 5; n++)
+			p += pinna_rho[n] * std::polar(1.0, -w * pinna[n]);
+		h *= p * std::polar(1.0, -w * delay);
+
+		if(k == 0) {
+			spectrum[0] = (float)h.real();
+		} else if(k == SYNTH_SIZE / 2) {
+			spectrum[1] = (float)h.real();
+		} else {
+			spectrum[k*2] = (float)h.real();
+			spectrum[k*2 + 1] = (float)(conjugate ? -h.imag() : h.imag());
+		}
+	}
+
+	av_rdft_calc(synth, spectrum);
+
+	for(int i = 0; i < HRIR_LENGTH; i++) {
+		float fade = 1;
+
+		if(i >= HRIR_LENGTH - HRIR_FADE)
+			fade = 0.5f + 0.5f * (float)cos(PI * (i - (HRIR_LENGTH - HRIR_FADE)) / HRIR_FADE);
+		ir[i] = spectrum[i] * synthScale * fade;
+	}
+}
+
+// Splits ir into partitions and lays out each one's spectrum for
+// spectrum_mac(): real parts twice over in one row and imaginary parts
+// with alternating signs in the other. DC and Nyquist are real, so their
+// pair gets no imaginary part. The inverse FFT's scale goes in here too.
+static void filter_from_hrir(float *filter, const float *ir, float *work, RDFTContext *fft, float scale)
+{
+	for(int p = 0; p < PARTITIONS; p++) {
+		float *re = filter + p * 2 * FFT_SIZE;
+		float *im = re + FFT_SIZE;
+
+		memset(work, 0, FFT_SIZE * sizeof(float));
+		memcpy(work, ir + p * SPATIAL_BLOCK, SPATIAL_BLOCK * sizeof(float));
+		av_rdft_calc(fft, work);
+
+		re[0] = work[0] * scale;
+		re[1] = work[1] * scale;
+		im[0] = im[1] = 0;
+		for(int k = 2; k < FFT_SIZE; k += 2) {
+			re[k] = re[k + 1] = work[k] * scale;
+			im[k] = -work[k + 1] * scale;
+			im[k + 1] = work[k + 1] * scale;
+		}
+	}
+}
+
+static FilterSet *filter_set_create(int rate)
+{
+	FilterSet *set = (FilterSet *)av_mallocz(sizeof(FilterSet));
+	RDFTContext *synth = av_rdft_init(SYNTH_BITS, IDFT_C2R);
+	RDFTContext *fft = av_rdft_init(FFT_BITS, DFT_R2C);
+	float *spectrum = (float *)av_malloc(SYNTH_SIZE * sizeof(float));
+	float *work = (float *)av_malloc(FFT_SIZE * sizeof(float));
+	float ir[HRIR_LENGTH];
+	float synthScale, fftScale;
+	int conjugate;
+
+	rdft_conventions(SYNTH_BITS, &synthScale, &conjugate);
+	rdft_conventions(FFT_BITS, &fftScale, &conjugate);
+
+	set->rate = rate;
+	set->refs = 1;
+	set->filters = (float *)av_malloc(GRID_EL * GRID_AZ * FILTER_FLOATS * sizeof(float));
+
+	for(int e = 0; e < GRID_EL; e++) {
+		for(int az = 0; az < GRID_AZ; az++) {
+			hrir_left(ir, spectrum, synth, synthScale, conjugate, rate,
+					  az * GRID_AZ_STEP, GRID_EL_MIN + e * GRID_EL_STEP);
+			filter_from_hrir(set->filters + (e * GRID_AZ + az) * FILTER_FLOATS, ir, work, fft, fftScale);
+		}
+	}
+
+	av_rdft_end(synth);
+	av_rdft_end(fft);
+	av_free(spectrum);
+	av_free(work);
+	return set;
+}
+
+static void filter_set_release_locked(FilterSet *set)
+{
+	if(--set->refs == 0) {
+		av_free(set->filters);
+		av_free(set);
+	}
+}
+
+// Working the grid out takes tens of ms, so a set is shared by renderers
+// at the same rate and the last one made is kept.
+static FilterSet *filter_set_acquire(int rate)
+{
+	FilterSet *set = NULL;
+
+	SDL_AtomicLock(&filter_lock);
+	if(filter_cache && filter_cache->rate == rate) {
+		set = filter_cache;
+		set->refs++;
+	}
+	SDL_AtomicUnlock(&filter_lock);
+
+	if(set)
+		return set;
+
+	set = filter_set_create(rate);
+
+	SDL_AtomicLock(&filter_lock);
+	if(filter_cache)
+		filter_set_release_locked(filter_cache);
+	filter_cache = set;
+	set->refs++;
+	SDL_AtomicUnlock(&filter_lock);
+
+	return set;
+}
+
+static void filter_set_release(FilterSet *set)
+{
+	SDL_AtomicLock(&filter_lock);
+	filter_set_release_locked(set);
+	SDL_AtomicUnlock(&filter_lock);
+}
+
+/**************************/
+// Speakers
+
+static void azimuth_position(double az, double el, float pos[3])
+{
+	pos[0] = (float)(sin(az * PI / 180) * cos(el * PI / 180));
+	pos[1] = (float)sin(el * PI / 180);
+	pos[2] = (float)(-cos(az * PI / 180) * cos(el * PI / 180));
+}
+
+// Where channel ch's speaker is. The front ones are on the screen, the
+// rest around the listener at the usual angles, and the top ones 45
+// degrees up from the one below them.
+static void speaker_position(uint64_t ch, const float centre[3], float halfWidth, float pos[3])
+{
+	float up = 0;
+
+	switch(ch) {
+		case AV_CH_TOP_FRONT_LEFT:    up = 1; // Fall through.
+		case AV_CH_FRONT_LEFT:
+		case AV_CH_STEREO_LEFT:       pos[0] = centre[0] - halfWidth; pos[1] = centre[1]; pos[2] = centre[2]; break;
+		case AV_CH_TOP_FRONT_RIGHT:   up = 1; // Fall through.
+		case AV_CH_FRONT_RIGHT:
+		case AV_CH_STEREO_RIGHT:      pos[0] = centre[0] + halfWidth; pos[1] = centre[1]; pos[2] = centre[2]; break;
+		case AV_CH_FRONT_LEFT_OF_CENTER:  pos[0] = centre[0] - halfWidth / 2; pos[1] = centre[1]; pos[2] = centre[2]; break;
+		case AV_CH_FRONT_RIGHT_OF_CENTER: pos[0] = centre[0] + halfWidth / 2; pos[1] = centre[1]; pos[2] = centre[2]; break;
+		case AV_CH_WIDE_LEFT:         azimuth_position(-60, 0, pos); break;
+		case AV_CH_WIDE_RIGHT:        azimuth_position(60, 0, pos); break;
+		case AV_CH_SIDE_LEFT:
+		case AV_CH_SURROUND_DIRECT_LEFT:  azimuth_position(-100, 0, pos); break;
+		case AV_CH_SIDE_RIGHT:
+		case AV_CH_SURROUND_DIRECT_RIGHT: azimuth_position(100, 0, pos); break;
+		case AV_CH_BACK_LEFT:         azimuth_position(-145, 0, pos); break;
+		case AV_CH_BACK_RIGHT:        azimuth_position(145, 0, pos); break;
+		case AV_CH_BACK_CENTER:       azimuth_position(180, 0, pos); break;
+		case AV_CH_TOP_BACK_LEFT:     azimuth_position(-145, 45, pos); break;
+		case AV_CH_TOP_BACK_RIGHT:    azimuth_position(145, 45, pos); break;
+		case AV_CH_TOP_BACK_CENTER:   azimuth_position(180, 45, pos); break;
+		case AV_CH_TOP_CENTER:        azimuth_position(0, 90, pos); break;
+		case AV_CH_TOP_FRONT_CENTER:  up = 1; // Fall through.
+		default:                      memcpy(pos, centre, 3 * sizeof(float)); break;
+	}
+
+	if(up)
+		pos[1] += sqrtf(pos[0] * pos[0] + pos[2] * pos[2]);
+}
+
+// v turned into the head's frame, by the inverse of its orientation q:
+// v + w t + u x t with t = 2 u x v, where u is q's vector part negated.
+static void rotate_inverse(const float q[4], const float v[3], float out[3])
+{
+	float ux = -q[0], uy = -q[1], uz = -q[2], w = q[3];
+	float tx = 2 * (uy * v[2] - uz * v[1]);
+	float ty = 2 * (uz * v[0] - ux * v[2]);
+	float tz = 2 * (ux * v[1] - uy * v[0]);
+
+	out[0] = v[0] + w * tx + (uy * tz - uz * ty);
+	out[1] = v[1] + w * ty + (uz * tx - ux * tz);
+	out[2] = v[2] + w * tz + (ux * ty - uy * tx);
+}
+
+static int grid_cell(double az, double el)
+{
+	int e, a;
+
+	el = (el < GRID_EL_MIN) ? GRID_EL_MIN : (el > 90) ? 90 : el;
+	e = (int)floor((el - GRID_EL_MIN) / GRID_EL_STEP + 0.5);
+	a = (int)floor(az / GRID_AZ_STEP + 0.5) % GRID_AZ;
+	if(a < 0)
+		a += GRID_AZ;
+	return e * GRID_AZ + a;
+}
+
+/**************************/
+// Rendering
+
+SpatialRenderer *spatial_create(uint64_t layout, int sampleRate)
+{
+	SpatialRenderer *r;
+	int placed = 0;
+
+	if(!layout || av_get_channel_layout_nb_channels(layout) > MAX_SPEAKERS)
+		return NULL;
+
+	r = (SpatialRenderer *)av_mallocz(sizeof(SpatialRenderer));
+	r->filters = filter_set_acquire(sampleRate);
+	r->fft = av_rdft_init(FFT_BITS, DFT_R2C);
+	r->ifft = av_rdft_init(FFT_BITS, IDFT_C2R);
+	r->work = (float *)av_malloc(FFT_SIZE * sizeof(float));
+	r->acc = (float *)av_malloc(6 * FFT_SIZE * sizeof(float));
+
+	for(uint64_t ch = 1; ch && ch <= layout; ch <<= 1) {
+		Speaker *s;
+
+		if(!(layout & ch))
+			continue;
+
+		s = &r->speakers[r->channels++];
+		s->channel = ch;
+		s->lfe = (ch == AV_CH_LOW_FREQUENCY || ch == AV_CH_LOW_FREQUENCY_2);
+		s->cell[0] = s->cell[1] = -1;
+		s->spectra = (float *)av_mallocz(PARTITIONS * 2 * FFT_SIZE * sizeof(float));
+		placed += !s->lfe;
+	}
+
+	// Keeps a downmix of many speakers about as loud as the stereo one
+	// audio_mix_matrix() makes.
+	r->gain = (placed > 2) ? 2.0f / placed : 1.0f;
+
+	return r;
+}
+
+void spatial_destroy(SpatialRenderer *r)
+{
+	if(!r)
+		return;
+
+	for(int c = 0; c < r->channels; c++)
+		av_free(r->speakers[c].spectra);
+	filter_set_release(r->filters);
+	av_rdft_end(r->fft);
+	av_rdft_end(r->ifft);
+	av_free(r->work);
+	av_free(r->acc);
+	av_free(r);
+}
+
+// The swapped copy of a spectrum, im re for each re im.
+static void spectrum_swap(float *dst, const float *src)
+{
+	int i = 0;
+
+	if(use_sse()) {
+		for(; i < FFT_SIZE; i += 4) {
+			__m128 x = _mm_loadu_ps(src + i);
+			_mm_storeu_ps(dst + i, _mm_shuffle_ps(x, x, _MM_SHUFFLE(2, 3, 0, 1)));
+		}
+	}
+
+	for(; i < FFT_SIZE; i += 2) {
+		dst[i] = src[i + 1];
+		dst[i + 1] = src[i];
+	}
+}
+
+// acc += x * h for spectra, with h laid out by filter_from_hrir(). The
+// swapped copy of x makes the complex multiply two real ones and an add.
+static void spectrum_mac(float *acc, const float *x, const float *xswap, const float *re, const float *im)
+{
+	int i = 0;
+
+	if(use_sse()) {
+		for(; i < FFT_SIZE; i += 4) {
+			__m128 a = _mm_loadu_ps(acc + i);
+			a = _mm_add_ps(a, _mm_mul_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(re + i)));
+			a = _mm_add_ps(a, _mm_mul_ps(_mm_loadu_ps(xswap + i), _mm_loadu_ps(im + i)));
+			_mm_storeu_ps(acc + i, a);
+		}
+	}
+
+	for(; i < FFT_SIZE; i++)
+		acc[i] += x[i] * re[i] + xswap[i] * im[i];
+}
+
+// The speaker's last PARTITIONS spectra through every partition of the
+// filter for grid cell.
+static void speaker_convolve(SpatialRenderer *r, Speaker *s, float *acc, int cell)
+{
+	const float *filter = r->filters->filters + cell * FILTER_FLOATS;
+
+	for(int p = 0; p < PARTITIONS; p++) {
+		const float *x = s->spectra + ((r->slot - p + PARTITIONS) % PARTITIONS) * 2 * FFT_SIZE;
+		const float *h = filter + p * 2 * FFT_SIZE;
+
+		spectrum_mac(acc, x, x + FFT_SIZE, h, h + FFT_SIZE);
+	}
+}
+
+void spatial_render(SpatialRenderer *r, float *out, const float *in)
+{
+	float centre[3], halfWidth, q[4];
+	float lfe[SPATIAL_BLOCK];
+	int used[3] = { 0, 0, 0 };
+	int haveLfe = 0;
+
+	SDL_AtomicLock(&listener_lock);
+	memcpy(centre, screen_centre, sizeof(centre));
+	halfWidth = screen_half_width;
+	memcpy(q, head_orientation, sizeof(q));
+	SDL_AtomicUnlock(&listener_lock);
+
+	memset(r->acc, 0, 6 * FFT_SIZE * sizeof(float));
+	r->slot = (r->slot + 1) % PARTITIONS;
+
+	for(int c = 0; c < r->channels; c++) {
+		Speaker *s = &r->speakers[c];
+		float *x = s->spectra + r->slot * 2 * FFT_SIZE;
+		float pos[3], head[3];
+		int cell[2];
+
+		if(s->lfe) {
+			for(int i = 0; i < SPATIAL_BLOCK; i++)
+				lfe[i] = (haveLfe ? lfe[i] : 0) + in[i * r->channels + c];
+			haveLfe = 1;
+			continue;
+		}
+
+		// Overlap-save: the spectrum of the last block and this one.
+		memcpy(r->work, s->history, SPATIAL_BLOCK * sizeof(float));
+		for(int i = 0; i < SPATIAL_BLOCK; i++)
+			s->history[i] = r->work[SPATIAL_BLOCK + i] = in[i * r->channels + c];
+		av_rdft_calc(r->fft, r->work);
+		memcpy(x, r->work, FFT_SIZE * sizeof(float));
+		spectrum_swap(x + FFT_SIZE, x);
+
+		// Which way the speaker is from the head now.
+		speaker_position(s->channel, centre, halfWidth, pos);
+		rotate_inverse(q, pos, head);
+		double az = atan2(head[0], -head[2]) * 180 / PI;
+		double el = atan2(head[1], sqrt(head[0] * head[0] + head[2] * head[2])) * 180 / PI;
+		cell[0] = grid_cell(az, el);
+		cell[1] = grid_cell(-az, el);
+
+		for(int ear = 0; ear < 2; ear++) {
+			float *acc = r->acc + ear * 3 * FFT_SIZE;
+
+			if(s->cell[ear] < 0 || s->cell[ear] == cell[ear]) {
+				speaker_convolve(r, s, acc, cell[ear]);
+				used[0] = 1;
+			} else {
+				speaker_convolve(r, s, acc + FFT_SIZE, s->cell[ear]);
+				speaker_convolve(r, s, acc + 2 * FFT_SIZE, cell[ear]);
+				used[1] = used[2] = 1;
+			}
+			s->cell[ear] = cell[ear];
+		}
+	}
+
+	for(int ear = 0; ear < 2; ear++) {
+		float *acc = r->acc + ear * 3 * FFT_SIZE;
+
+		for(int i = 0; i < SPATIAL_BLOCK; i++)
+			out[i * 2 + ear] = haveLfe ? lfe[i] : 0;
+
+		for(int k = 0; k < 3; k++) {
+			float *y = acc + k * FFT_SIZE;
+
+			if(!used[k])
+				continue;
+
+			// Only the second half comes out clean.
+			av_rdft_calc(r->ifft, y);
+			for(int i = 0; i < SPATIAL_BLOCK; i++) {
+				float fadeIn = (i + 0.5f) / SPATIAL_BLOCK;
+				float ramp = (k == 0) ? 1 : (k == 1) ? 1 - fadeIn : fadeIn;
+
+				out[i * 2 + ear] += y[SPATIAL_BLOCK + i] * ramp;
+			}
+		}
+
+		for(int i = 0; i < SPATIAL_BLOCK; i++)
+			out[i * 2 + ear] *= r->gain;
+	}
+}
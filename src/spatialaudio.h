@@ -0,0 +1,37 @@
+#ifndef SPATIALAUDIO_H
+#define SPATIALAUDIO_H
+
+#include <stdint.h>
+
+// Binaural rendering for headphones. Each channel of the stream plays
+// from a virtual speaker placed around the cinema screen, and the
+// speakers stay put as the head turns. The head related impulse
+// responses come from Brown and Duda's structural model, a spherical
+// head with pinna echoes, worked out for a grid of directions when the
+// renderer is created. They're applied by uniformly partitioned FFT
+// convolution. A speaker moving to a new grid direction is cross faded
+// over one block.
+
+// Frames spatial_render() takes at a time, about 2.7 ms at 48 kHz.
+#define SPATIAL_BLOCK 128
+
+struct SpatialRenderer;
+
+// layout is an FFmpeg channel layout. Returns NULL if it has more than
+// eight channels.
+SpatialRenderer *spatial_create(uint64_t layout, int sampleRate);
+void spatial_destroy(SpatialRenderer *r);
+
+// One block: SPATIAL_BLOCK frames of interleaved float in the layout's
+// channels to interleaved stereo float.
+void spatial_render(SpatialRenderer *r, float *out, const float *in);
+
+// These apply to every renderer, and can be called from any thread at
+// any time. Positions are in metres relative to the listener's head,
+// with +x right, +y up and -z ahead when facing the screen.
+void spatial_set_screen(const float centre[3], float halfWidth);
+// The head's orientation in that frame, as a quaternion x y z w. The
+// Rift's pose orientation can be passed straight in.
+void spatial_set_orientation(const float orientation[4]);
+
+#endif // SPATIALAUDIO_H
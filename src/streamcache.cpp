@@ -0,0 +1,462 @@
+#include "streamcache.h"
+
+#include <SDL.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <Windows.h>
+#endif
+
+// Oldest entries fall off the end past this.
+#define STREAM_CACHE_MAX_ENTRIES 256
+
+// Long enough for a line with a few KB of extradata in hex. Streams with
+// more leave the file out of the cache.
+#define STREAM_CACHE_LINE_SIZE (64 * 1024)
+
+// Players open files on their own threads, this keeps them out of each
+// other's way when reading and rewriting the cache file. It's held
+// across the file I/O, so it's a mutex rather than a spin lock. Created
+// the first time it's needed, under create_lock.
+static SDL_mutex *cache_mutex;
+static SDL_SpinLock create_lock;
+
+typedef struct CachedStream {
+	int type, codec_id, codec_tag;
+	AVRational time_base, codec_time_base;
+	int ticks_per_frame;
+	AVRational avg_frame_rate, r_frame_rate;
+	int64_t start_time, duration, nb_frames;
+	int width, height, pix_fmt;
+	AVRational sample_aspect_ratio;
+	int has_b_frames, profile, level;
+	int colorspace, color_range, color_primaries, color_trc, field_order;
+	int sample_rate, channels;
+	unsigned long long channel_layout;
+	int sample_fmt, block_align, frame_size, bit_rate, bits_per_coded_sample;
+	uint8_t *extradata;
+	int extradata_size;
+} CachedStream;
+
+static void cache_lock() {
+	SDL_AtomicLock(&create_lock);
+	if(!cache_mutex) {
+		cache_mutex = SDL_CreateMutex();
+	}
+	SDL_AtomicUnlock(&create_lock);
+
+	SDL_LockMutex(cache_mutex);
+}
+
+static void cache_unlock() {
+	SDL_UnlockMutex(cache_mutex);
+}
+
+static int file_key(const char *filename, int64_t *size, int64_t *mtime) {
+#ifdef _WIN32
+	struct _stat64 st;
+	if(_stat64(filename, &st) != 0) {
+		return 0;
+	}
+#else
+	struct stat st;
+	if(stat(filename, &st) != 0) {
+		return 0;
+	}
+#endif
+
+	*size = st.st_size;
+	*mtime = st.st_mtime;
+	return 1;
+}
+
+// Returns 0 at the end of the file, and -1 for a line too long for buf,
+// which is skipped rather than read in pieces. Every line is written with
+// a newline, so one without is cut short.
+static int read_line(FILE *f, char *buf) {
+	size_t len;
+
+	if(!fgets(buf, STREAM_CACHE_LINE_SIZE, f)) {
+		return 0;
+	}
+
+	len = strlen(buf);
+	if(len == 0 || buf[len - 1] != '\n') {
+		while(len > 0 && buf[len - 1] != '\n' && fgets(buf, STREAM_CACHE_LINE_SIZE, f)) {
+			len = strlen(buf);
+		}
+		buf[0] = 0;
+		return -1;
+	}
+
+	buf[strcspn(buf, "\r\n")] = 0;
+	return 1;
+}
+
+static int64_t next_number(char **p) {
+	return strtoll(*p, p, 10);
+}
+
+static AVRational next_rational(char **p) {
+	AVRational r;
+	r.num = (int)next_number(p);
+	r.den = (int)next_number(p);
+	return r;
+}
+
+static int hex_digit(char c) {
+	if(c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	if(c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	return -1;
+}
+
+static void cached_stream_free(CachedStream *cs) {
+	av_freep(&cs->extradata);
+}
+
+// Parses the rest of a "stream" line, the inverse of stream_cache_describe().
+static int parse_stream(char *p, CachedStream *cs) {
+	memset(cs, 0, sizeof(CachedStream));
+
+	cs->type = (int)next_number(&p);
+	cs->codec_id = (int)next_number(&p);
+	cs->codec_tag = (int)next_number(&p);
+	cs->time_base = next_rational(&p);
+	cs->codec_time_base = next_rational(&p);
+	cs->ticks_per_frame = (int)next_number(&p);
+	cs->avg_frame_rate = next_rational(&p);
+	cs->r_frame_rate = next_rational(&p);
+	cs->start_time = next_number(&p);
+	cs->duration = next_number(&p);
+	cs->nb_frames = next_number(&p);
+	cs->width = (int)next_number(&p);
+	cs->height = (int)next_number(&p);
+	cs->pix_fmt = (int)next_number(&p);
+	cs->sample_aspect_ratio = next_rational(&p);
+	cs->has_b_frames = (int)next_number(&p);
+	cs->profile = (int)next_number(&p);
+	cs->level = (int)next_number(&p);
+	cs->colorspace = (int)next_number(&p);
+	cs->color_range = (int)next_number(&p);
+	cs->color_primaries = (int)next_number(&p);
+	cs->color_trc = (int)next_number(&p);
+	cs->field_order = (int)next_number(&p);
+	cs->sample_rate = (int)next_number(&p);
+	cs->channels = (int)next_number(&p);
+	cs->channel_layout = strtoull(p, &p, 10);
+	cs->sample_fmt = (int)next_number(&p);
+	cs->block_align = (int)next_number(&p);
+	cs->frame_size = (int)next_number(&p);
+	cs->bit_rate = (int)next_number(&p);
+	cs->bits_per_coded_sample = (int)next_number(&p);
+
+	while(*p == ' ') {
+		p++;
+	}
+	if(*p == '-' || !*p) {
+		return 1;
+	}
+
+	int len = (int)strlen(p);
+	if(len % 2) {
+		return 0;
+	}
+	cs->extradata_size = len / 2;
+	cs->extradata = (uint8_t*)av_mallocz(cs->extradata_size + FF_INPUT_BUFFER_PADDING_SIZE);
+	for(int i = 0; i < cs->extradata_size; i++) {
+		int hi = hex_digit(p[2 * i]), lo = hex_digit(p[2 * i + 1]);
+		if(hi < 0 || lo < 0) {
+			cached_stream_free(cs);
+			return 0;
+		}
+		cs->extradata[i] = (uint8_t)(hi << 4 | lo);
+	}
+
+	return 1;
+}
+
+// Only the decoders need extradata. Other streams' can be big, e.g. a
+// Matroska attachment's is the whole font file.
+static int stream_has_extradata(AVCodecContext *c) {
+	return c->extradata_size > 0 && (c->codec_type == AVMEDIA_TYPE_AUDIO || c->codec_type == AVMEDIA_TYPE_VIDEO);
+}
+
+char *stream_cache_describe(AVFormatContext *fmt) {
+	size_t size = 128;
+	char *desc, *p;
+
+	for(unsigned int i = 0; i < fmt->nb_streams; i++) {
+		AVCodecContext *c = fmt->streams[i]->codec;
+
+		// A line has to fit in STREAM_CACHE_LINE_SIZE to be read back.
+		if(stream_has_extradata(c)) {
+			if(512 + 2 * c->extradata_size >= STREAM_CACHE_LINE_SIZE) {
+				return NULL;
+			}
+			size += 2 * c->extradata_size;
+		}
+		size += 512;
+	}
+
+	desc = p = (char*)av_malloc(size);
+	if(!desc) {
+		return NULL;
+	}
+
+	p += sprintf(p, "format %lld %lld %d %u\n", (long long)fmt->duration, (long long)fmt->start_time,
+				 fmt->bit_rate, fmt->nb_streams);
+
+	for(unsigned int i = 0; i < fmt->nb_streams; i++) {
+		AVStream *st = fmt->streams[i];
+		AVCodecContext *c = st->codec;
+
+		p += sprintf(p, "stream %d %d %d %d %d %d %d %d %d %d %d %d %lld %lld %lld %d %d %d %d %d %d %d %d "
+					 "%d %d %d %d %d %d %d %llu %d %d %d %d %d ",
+					 c->codec_type, c->codec_id, c->codec_tag,
+					 st->time_base.num, st->time_base.den, c->time_base.num, c->time_base.den,
+					 c->ticks_per_frame,
+					 st->avg_frame_rate.num, st->avg_frame_rate.den, st->r_frame_rate.num, st->r_frame_rate.den,
+					 (long long)st->start_time, (long long)st->duration, (long long)st->nb_frames,
+					 c->width, c->height, c->pix_fmt, c->sample_aspect_ratio.num, c->sample_aspect_ratio.den,
+					 c->has_b_frames, c->profile, c->level,
+					 c->colorspace, c->color_range, c->color_primaries, c->color_trc, c->field_order,
+					 c->sample_rate, c->channels, (unsigned long long)c->channel_layout, c->sample_fmt,
+					 c->block_align, c->frame_size, c->bit_rate, c->bits_per_coded_sample);
+
+		if(stream_has_extradata(c)) {
+			for(int j = 0; j < c->extradata_size; j++) {
+				p += sprintf(p, "%02x", c->extradata[j]);
+			}
+		} else {
+			*p++ = '-';
+		}
+		*p++ = '\n';
+	}
+
+	*p = 0;
+	return desc;
+}
+
+void stream_cache_store(const char *cachePath, const char *filename, const char *description,
+						int64_t firstKeyframePos) {
+	int64_t size, mtime;
+	char tmpPath[1024];
+	FILE *in, *out;
+	int entries = 1;
+
+	if(!cachePath || !description || !file_key(filename, &size, &mtime)) {
+		return;
+	}
+
+	SDL_snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", cachePath);
+
+	cache_lock();
+
+	out = fopen(tmpPath, "w");
+	if(!out) {
+		cache_unlock();
+		return;
+	}
+
+	// Newest first, then whatever else was there.
+	fprintf(out, "file %lld %lld %lld %s\n%send\n", (long long)size, (long long)mtime,
+			(long long)firstKeyframePos, filename, description);
+
+	in = fopen(cachePath, "r");
+	if(in) {
+		char *line = (char*)av_malloc(STREAM_CACHE_LINE_SIZE);
+		int copying = 0, got;
+
+		while((got = read_line(in, line)) != 0) {
+			// Left out, so the entry it was in is short a stream and never
+			// matches.
+			if(got < 0) {
+				continue;
+			}
+			if(!strncmp(line, "file ", 5)) {
+				char *p = line + 5;
+				next_number(&p);
+				next_number(&p);
+				next_number(&p);
+				copying = strcmp(p + 1, filename) != 0 && entries < STREAM_CACHE_MAX_ENTRIES;
+				if(copying) {
+					entries++;
+				}
+			}
+			if(copying) {
+				fprintf(out, "%s\n", line);
+			}
+		}
+
+		av_free(line);
+		fclose(in);
+	}
+
+	fclose(out);
+
+#ifdef _WIN32
+	MoveFileExA(tmpPath, cachePath, MOVEFILE_REPLACE_EXISTING);
+#else
+	rename(tmpPath, cachePath);
+#endif
+
+	cache_unlock();
+}
+
+int stream_cache_apply(const char *cachePath, const char *filename, AVFormatContext *fmt,
+					   int64_t *firstKeyframePos) {
+	int64_t size, mtime;
+	int64_t duration = 0, start_time = 0, keyframePos = -1;
+	int bit_rate = 0, nb_streams = -1, found = 0, ended = 0, parsed = 0, ok = 1, got;
+	CachedStream *streams;
+	FILE *in;
+	char *line;
+
+	if(!cachePath || (fmt->ctx_flags & AVFMTCTX_NOHEADER) || !file_key(filename, &size, &mtime)) {
+		return 0;
+	}
+
+	streams = (CachedStream*)av_mallocz(fmt->nb_streams * sizeof(CachedStream) + 1);
+	line = (char*)av_malloc(STREAM_CACHE_LINE_SIZE);
+
+	cache_lock();
+
+	in = fopen(cachePath, "r");
+	if(in) {
+		while((got = read_line(in, line)) != 0) {
+			char *p = line;
+
+			if(!found) {
+				if(!strncmp(line, "file ", 5)) {
+					p += 5;
+					int64_t entrySize = next_number(&p);
+					int64_t entryMtime = next_number(&p);
+					int64_t entryPos = next_number(&p);
+					if(!strcmp(p + 1, filename)) {
+						// Only the newest entry for a path is ever kept.
+						if(entrySize != size || entryMtime != mtime) {
+							break;
+						}
+						found = 1;
+						keyframePos = entryPos;
+					}
+				}
+				continue;
+			}
+
+			// A line that didn't fit, or the next entry starting before
+			// this one ended, means it can't be trusted.
+			if(got < 0 || !strncmp(line, "file ", 5)) {
+				ok = 0;
+				break;
+			}
+
+			if(!strcmp(line, "end")) {
+				ended = 1;
+				break;
+
+			} else if(!strncmp(line, "format ", 7)) {
+				p += 7;
+				duration = next_number(&p);
+				start_time = next_number(&p);
+				bit_rate = (int)next_number(&p);
+				nb_streams = (int)next_number(&p);
+				if(nb_streams != (int)fmt->nb_streams) {
+					ok = 0;
+					break;
+				}
+
+			} else if(!strncmp(line, "stream ", 7)) {
+				if(parsed >= (int)fmt->nb_streams || !parse_stream(line + 7, &streams[parsed])) {
+					ok = 0;
+					break;
+				}
+				parsed++;
+			}
+		}
+		fclose(in);
+	}
+
+	cache_unlock();
+	av_free(line);
+
+	ok = ok && found && ended && parsed == (int)fmt->nb_streams;
+
+	// The demuxer has read the header, so whatever it's already decided
+	// about the streams has to agree with the entry.
+	for(int i = 0; ok && i < parsed; i++) {
+		AVStream *st = fmt->streams[i];
+		CachedStream *cs = &streams[i];
+
+		if(cs->type != st->codec->codec_type
+				|| (st->codec->codec_id != AV_CODEC_ID_NONE && cs->codec_id != st->codec->codec_id)
+				|| av_cmp_q(cs->time_base, st->time_base) != 0) {
+			ok = 0;
+		}
+	}
+
+	for(int i = 0; ok && i < parsed; i++) {
+		AVStream *st = fmt->streams[i];
+		AVCodecContext *c = st->codec;
+		CachedStream *cs = &streams[i];
+
+		c->codec_id = (enum AVCodecID)cs->codec_id;
+		c->codec_tag = cs->codec_tag;
+		c->time_base = cs->codec_time_base;
+		c->ticks_per_frame = cs->ticks_per_frame;
+		st->avg_frame_rate = cs->avg_frame_rate;
+		st->r_frame_rate = cs->r_frame_rate;
+		st->start_time = cs->start_time;
+		st->duration = cs->duration;
+		st->nb_frames = cs->nb_frames;
+		c->width = cs->width;
+		c->height = cs->height;
+		c->pix_fmt = (enum AVPixelFormat)cs->pix_fmt;
+		c->sample_aspect_ratio = cs->sample_aspect_ratio;
+		c->has_b_frames = cs->has_b_frames;
+		c->profile = cs->profile;
+		c->level = cs->level;
+		c->colorspace = (enum AVColorSpace)cs->colorspace;
+		c->color_range = (enum AVColorRange)cs->color_range;
+		c->color_primaries = (enum AVColorPrimaries)cs->color_primaries;
+		c->color_trc = (enum AVColorTransferCharacteristic)cs->color_trc;
+		c->field_order = (enum AVFieldOrder)cs->field_order;
+		c->sample_rate = cs->sample_rate;
+		c->channels = cs->channels;
+		c->channel_layout = cs->channel_layout;
+		c->sample_fmt = (enum AVSampleFormat)cs->sample_fmt;
+		c->block_align = cs->block_align;
+		c->frame_size = cs->frame_size;
+		c->bit_rate = cs->bit_rate;
+		c->bits_per_coded_sample = cs->bits_per_coded_sample;
+
+		// Extradata from the header takes precedence, it's the same thing.
+		if(!c->extradata && cs->extradata) {
+			c->extradata = cs->extradata;
+			c->extradata_size = cs->extradata_size;
+			cs->extradata = NULL;
+		}
+	}
+
+	if(ok) {
+		fmt->duration = duration;
+		fmt->start_time = start_time;
+		fmt->bit_rate = bit_rate;
+		*firstKeyframePos = keyframePos;
+	}
+
+	for(int i = 0; i < parsed; i++) {
+		cached_stream_free(&streams[i]);
+	}
+	av_free(streams);
+
+	return ok;
+}
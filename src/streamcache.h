@@ -0,0 +1,29 @@
+#ifndef STREAMCACHE_H
+#define STREAMCACHE_H
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+// What avformat_find_stream_info() works out about a file, kept on disk
+// so opening it again can skip the probing. Entries are keyed by path,
+// size and modification time, so a changed file is probed afresh. Also
+// remembers where the first video keyframe is, so the packets before it
+// can be skipped without decoding.
+
+// Describes fmt's streams for stream_cache_store(). Call straight after
+// probing, before the codecs are opened. Free with av_free().
+char *stream_cache_describe(AVFormatContext *fmt);
+
+// Writes the entry for filename, replacing any older one for it.
+// firstKeyframePos is a byte offset, -1 if there's no video.
+void stream_cache_store(const char *cachePath, const char *filename, const char *description,
+						int64_t firstKeyframePos);
+
+// Looks up filename. If the entry matches the file and the streams the
+// demuxer found in its header, fills the streams in from it and returns
+// 1. Formats whose streams only turn up while reading are never cached.
+int stream_cache_apply(const char *cachePath, const char *filename, AVFormatContext *fmt,
+					   int64_t *firstKeyframePos);
+
+#endif // STREAMCACHE_H
@@ -0,0 +1,184 @@
+#include "trace.h"
+
+#ifdef CINEMA_TRACE
+
+#include <SDL_atomic.h>
+#include <SDL_thread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Events kept per thread, after that the oldest are overwritten.
+#define TRACE_RING_SIZE (1 << 15)
+// Every thread that records gets a buffer, and they're kept after the
+// thread exits so a playlist's earlier players still show up.
+#define TRACE_MAX_THREADS 256
+
+typedef struct TraceEvent {
+	const char *name;
+	Uint64      start;
+	Uint64      duration;
+	int         instant;
+} TraceEvent;
+
+// Only its own thread writes to a buffer, so there's nothing to lock.
+// trace_stop() reads them once recording is off.
+typedef struct TraceBuffer {
+	SDL_threadID tid;
+	char         name[32];
+	TraceEvent   *events;
+	unsigned int written;
+} TraceBuffer;
+
+static TraceBuffer *buffers[TRACE_MAX_THREADS];
+static int nb_buffers;
+static SDL_SpinLock buffers_lock;
+static SDL_TLSID buffer_tls;
+
+static SDL_atomic_t recording;
+static Uint64 epoch;
+static char trace_path[1024];
+
+// The calling thread's buffer, set up the first time it records.
+static TraceBuffer *trace_buffer() {
+	TraceBuffer *buf = (TraceBuffer *)SDL_TLSGet(buffer_tls);
+
+	if(buf) {
+		return buf;
+	}
+
+	buf = (TraceBuffer *)calloc(1, sizeof(TraceBuffer));
+	buf->events = (TraceEvent *)malloc(TRACE_RING_SIZE * sizeof(TraceEvent));
+	buf->tid = SDL_ThreadID();
+
+	SDL_AtomicLock(&buffers_lock);
+	if(nb_buffers < TRACE_MAX_THREADS) {
+		buffers[nb_buffers++] = buf;
+	} else {
+		free(buf->events);
+		free(buf);
+		buf = NULL;
+	}
+	SDL_AtomicUnlock(&buffers_lock);
+
+	SDL_TLSSet(buffer_tls, buf, NULL);
+	return buf;
+}
+
+static void trace_push(const char *name, Uint64 start, Uint64 duration, int instant) {
+	TraceBuffer *buf = trace_buffer();
+	TraceEvent *e;
+
+	if(!buf) {
+		return;
+	}
+
+	e = &buf->events[buf->written++ & (TRACE_RING_SIZE - 1)];
+	e->name = name;
+	e->start = start;
+	e->duration = duration;
+	e->instant = instant;
+}
+
+void trace_start(const char *path) {
+	if(!buffer_tls) {
+		buffer_tls = SDL_TLSCreate();
+	}
+
+	SDL_AtomicLock(&buffers_lock);
+	for(int i = 0; i < nb_buffers; i++) {
+		buffers[i]->written = 0;
+	}
+	SDL_AtomicUnlock(&buffers_lock);
+
+	strncpy(trace_path, path, sizeof(trace_path) - 1);
+	epoch = SDL_GetPerformanceCounter();
+	SDL_AtomicSet(&recording, 1);
+}
+
+void trace_thread_name(const char *name) {
+	TraceBuffer *buf;
+
+	if(!SDL_AtomicGet(&recording) || !(buf = trace_buffer())) {
+		return;
+	}
+	strncpy(buf->name, name, sizeof(buf->name) - 1);
+}
+
+void trace_instant(const char *name) {
+	if(SDL_AtomicGet(&recording)) {
+		trace_push(name, SDL_GetPerformanceCounter(), 0, 1);
+	}
+}
+
+Uint64 trace_begin() {
+	return SDL_AtomicGet(&recording) ? SDL_GetPerformanceCounter() : 0;
+}
+
+void trace_end(const char *name, Uint64 start) {
+	if(start && SDL_AtomicGet(&recording)) {
+		trace_push(name, start, SDL_GetPerformanceCounter() - start, 0);
+	}
+}
+
+void trace_stop() {
+	double usPerTick = 1000000.0 / SDL_GetPerformanceFrequency();
+	int first = 1, events = 0;
+	FILE *f;
+
+	if(!SDL_AtomicGet(&recording)) {
+		return;
+	}
+	SDL_AtomicSet(&recording, 0);
+
+	f = fopen(trace_path, "w");
+	if(!f) {
+		fprintf(stderr, "Trace: can't write %s\n", trace_path);
+		return;
+	}
+
+	fprintf(f, "{\"traceEvents\":[\n");
+
+	SDL_AtomicLock(&buffers_lock);
+	for(int i = 0; i < nb_buffers; i++) {
+		TraceBuffer *buf = buffers[i];
+		unsigned int start = 0;
+
+		if(buf->written == 0) {
+			continue;
+		}
+
+		if(buf->name[0]) {
+			fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%lu,\"args\":{\"name\":\"%s\"}}",
+					first ? "" : ",\n", (unsigned long)buf->tid, buf->name);
+			first = 0;
+		}
+
+		if(buf->written > TRACE_RING_SIZE) {
+			start = buf->written - TRACE_RING_SIZE;
+		}
+
+		for(unsigned int n = start; n != buf->written; n++) {
+			TraceEvent *e = &buf->events[n & (TRACE_RING_SIZE - 1)];
+			double ts = (e->start - epoch) * usPerTick;
+
+			if(e->instant) {
+				fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%lu,\"ts\":%.3f}",
+						first ? "" : ",\n", e->name, (unsigned long)buf->tid, ts);
+			} else {
+				fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%lu,\"ts\":%.3f,\"dur\":%.3f}",
+						first ? "" : ",\n", e->name, (unsigned long)buf->tid, ts, e->duration * usPerTick);
+			}
+			first = 0;
+			events++;
+		}
+	}
+	SDL_AtomicUnlock(&buffers_lock);
+
+	fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+	fclose(f);
+
+	printf("Trace: %d events written to %s\n", events, trace_path);
+}
+
+#endif // CINEMA_TRACE
@@ -0,0 +1,59 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// A timeline of what each thread was doing, for seeing how the decode,
+// audio and render threads interleave around a missed frame. Built with
+// CINEMA_TRACE defined, every TRACE_SCOPE records a begin time and a
+// duration into a ring buffer belonging to the thread it ran on, and
+// trace_stop() writes the lot out as Chrome trace event JSON, which
+// chrome://tracing and ui.perfetto.dev both open. Without CINEMA_TRACE
+// the macros compile to nothing.
+//
+// Names must be string literals, only the pointer is kept.
+
+#ifdef CINEMA_TRACE
+
+#include <SDL.h>
+
+// Starts recording, to be written to path by trace_stop().
+void trace_start(const char *path);
+// Stops recording and writes the file. Anything still recording on
+// another thread by then may be left out.
+void trace_stop();
+// Labels the calling thread's row in the timeline.
+void trace_thread_name(const char *name);
+void trace_instant(const char *name);
+
+// Timestamp for TraceScope, 0 when not recording.
+Uint64 trace_begin();
+void trace_end(const char *name, Uint64 start);
+
+struct TraceScope {
+	const char *name;
+	Uint64 start;
+
+	TraceScope(const char *n) : name(n), start(trace_begin()) {}
+	~TraceScope() { trace_end(name, start); }
+};
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+
+#define TRACE_START(path) trace_start(path)
+#define TRACE_STOP() trace_stop()
+#define TRACE_THREAD_NAME(name) trace_thread_name(name)
+#define TRACE_INSTANT(name) trace_instant(name)
+// Records from here to the end of the enclosing block.
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+
+#else
+
+#define TRACE_START(path) ((void)0)
+#define TRACE_STOP() ((void)0)
+#define TRACE_THREAD_NAME(name) ((void)0)
+#define TRACE_INSTANT(name) ((void)0)
+#define TRACE_SCOPE(name) ((void)0)
+
+#endif
+
+#endif // TRACE_H
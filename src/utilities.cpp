@@ -1,6 +1,7 @@
 #include "utilities.h"
 #include "objloader.h"
 #include "loadtexture.h"
+#include "trace.h"
 
 #include <algorithm>
 #include <Windows.h>
@@ -11,6 +12,11 @@ extern GLuint program;
 extern GLint p_matrix_ufm;
 extern GLint mv_matrix_ufm;
 extern GLuint texture_ufm;
+extern GLint u_texture_ufm;
+extern GLint v_texture_ufm;
+extern GLint screen_planes_ufm;
+extern GLint yuv_matrix_ufm;
+extern GLint yuv_offset_ufm;
 extern objRenderData room, screen;
 
 GLuint createShader(GLenum eShaderType, const string &strShaderFile)
@@ -90,14 +96,34 @@ const string vertexShaderString(
 	"}"
 );
 
+// screenPlanes is 1 for RGB textures. For YUV video it's 3 (Y, U and V
+// textures) or 2 (Y and an interleaved UV texture, NV12) and the colour
+// conversion is rgb = yuvMatrix * (yuv - yuvOffset).
 const string fragmentShaderString(
 	"#version 330\n"
 	"uniform sampler2D texSampler;"
+	"uniform sampler2D uSampler;"
+	"uniform sampler2D vSampler;"
+	"uniform int screenPlanes;"
+	"uniform mat3 yuvMatrix;"
+	"uniform vec3 yuvOffset;"
 	"in vec3 vertexNormal;"
 	"in vec2 vertexUV;"
 	"out vec4 outputColor;"
 	"void main(){"
-		"outputColor = vec4(texture(texSampler, vertexUV).xyz, 1.0);"
+		"vec3 colour;"
+		"if(screenPlanes == 1) {"
+			"colour = texture(texSampler, vertexUV).xyz;"
+		"} else {"
+			"vec3 yuv;"
+			"yuv.x = texture(texSampler, vertexUV).r;"
+			"if(screenPlanes == 2)"
+				"yuv.yz = texture(uSampler, vertexUV).rg;"
+			"else "
+				"yuv.yz = vec2(texture(uSampler, vertexUV).r, texture(vSampler, vertexUV).r);"
+			"colour = clamp(yuvMatrix * (yuv - yuvOffset), 0.0, 1.0);"
+		"}"
+		"outputColor = vec4(colour, 1.0);"
 	"}"
 );
 
@@ -112,6 +138,11 @@ GLuint initializeProgram()
 	p_matrix_ufm = glGetUniformLocation(program, "p_matrix");
 	mv_matrix_ufm = glGetUniformLocation(program, "mv_matrix");
 	texture_ufm = glGetUniformLocation(program, "texSampler");
+	u_texture_ufm = glGetUniformLocation(program, "uSampler");
+	v_texture_ufm = glGetUniformLocation(program, "vSampler");
+	screen_planes_ufm = glGetUniformLocation(program, "screenPlanes");
+	yuv_matrix_ufm = glGetUniformLocation(program, "yuvMatrix");
+	yuv_offset_ufm = glGetUniformLocation(program, "yuvOffset");
 
 	return program;
 }
@@ -132,13 +163,27 @@ void initializeGeo(string geoDir, int videoWidth, int videoHeight)
 	delete[] normals;
 	delete[] uvs;
 
-	// Create the screen geo.
+	initializeScreenGeo(videoWidth, videoHeight);
+}
+
+// Set by initializeScreenGeo(), for getScreenGeometry().
+static float screenCentre[3];
+static float screenHalfWidthNow;
+
+// The screen's size follows the video's aspect ratio.
+void initializeScreenGeo(int videoWidth, int videoHeight)
+{
 	float screenHeightOffGround = 0.658f;
 	float screenHeight = 2.0f;
 	float screenHalfWidth = float(videoWidth) / float(videoHeight) * screenHeight / 2;
 	screenHalfWidth = (screenHalfWidth > 2.4f) ? 2.4f : screenHalfWidth;
 	screenHalfWidth = (screenHalfWidth < 0.1f) ? 0.1f : screenHalfWidth;
 
+	screenCentre[0] = 0.0f;
+	screenCentre[1] = screenHeightOffGround + screenHeight / 2;
+	screenCentre[2] = -2.412f;
+	screenHalfWidthNow = screenHalfWidth;
+
 	GLfloat screenVerts[] = {-screenHalfWidth, screenHeightOffGround + screenHeight, -2.412f,
 							 -screenHalfWidth, screenHeightOffGround,                -2.412f,
 							  screenHalfWidth, screenHeightOffGround,                -2.412f,
@@ -215,26 +260,137 @@ void createVAO(objRenderData &renderData, GLfloat *verts, GLfloat *normals, GLfl
 	glBindVertexArray(0);
 }
 
-void initializeTextures(string texDir, size_t screenTexWidth, size_t screenTexHeight)
+// Frees a VAO made by createVAO() along with its buffers.
+static void deleteVAO(objRenderData &renderData)
+{
+	glBindVertexArray(renderData.vao);
+	for(GLuint i = 0; i < 3; i++) {
+		GLint buffer = 0;
+		glGetVertexAttribiv(i, GL_VERTEX_ATTRIB_ARRAY_BUFFER_BINDING, &buffer);
+		GLuint bufferId = buffer;
+		glDeleteBuffers(1, &bufferId);
+	}
+	glBindVertexArray(0);
+
+	glDeleteVertexArrays(1, &renderData.vao);
+	renderData.vao = 0;
+}
+
+void initializeTextures(string texDir, size_t screenTexWidth, size_t screenTexHeight, int screenPlanes)
 {
 	room.texture = loadTexture(texDir.append("testTex.DDS"));
 
-	// Setup screen texture.
-	glGenTextures(1, &screen.texture);
-	glBindTexture(GL_TEXTURE_2D, screen.texture);
+	initializeScreenTextures(screenTexWidth, screenTexHeight, screenPlanes);
+}
+
+// Black to start with, for YUV that's a chroma of 128 rather than 0.
+static GLuint createScreenTexture(GLint internalFormat, GLenum format, size_t width, size_t height,
+								  size_t bytesPerPixel, unsigned char clearValue)
+{
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
 
-	unsigned char *pixels = (unsigned char*)malloc(screenTexWidth*screenTexHeight*4);
-	memset(pixels, 0x00, screenTexWidth*screenTexHeight*4);
+	unsigned char *pixels = (unsigned char*)malloc(width*height*bytesPerPixel);
+	memset(pixels, clearValue, width*height*bytesPerPixel);
 
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, screenTexWidth, screenTexHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, GL_UNSIGNED_BYTE, pixels);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 //	glTexStorage2D(GL_TEXTURE_2D, 2, GL_RGB, res, res);
 
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);  // Disable mipmapping.
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 	glBindTexture(GL_TEXTURE_2D, 0);
 
 	free(pixels);
+	return texture;
+}
+
+// screenPlanes is 1 for RGBA, 2 for NV12 and 3 for YUV420P.
+void initializeScreenTextures(size_t screenTexWidth, size_t screenTexHeight, int screenPlanes)
+{
+	size_t chromaWidth = (screenTexWidth + 1) / 2;
+	size_t chromaHeight = (screenTexHeight + 1) / 2;
+
+	if(screenPlanes == 1) {
+		screen.texture = createScreenTexture(GL_RGBA8, GL_RGBA, screenTexWidth, screenTexHeight, 4, 0x00);
+		return;
+	}
+
+	screen.texture = createScreenTexture(GL_R8, GL_RED, screenTexWidth, screenTexHeight, 1, 0x00);
+
+	if(screenPlanes == 2) {
+		screen.uTexture = createScreenTexture(GL_RG8, GL_RG, chromaWidth, chromaHeight, 2, 0x80);
+	} else {
+		screen.uTexture = createScreenTexture(GL_R8, GL_RED, chromaWidth, chromaHeight, 1, 0x80);
+		screen.vTexture = createScreenTexture(GL_R8, GL_RED, chromaWidth, chromaHeight, 1, 0x80);
+	}
+}
+
+// Centre of the screen in the room and half its width, in metres.
+void getScreenGeometry(float centre[3], float *halfWidth)
+{
+	for(int i = 0; i < 3; i++)
+		centre[i] = screenCentre[i];
+	*halfWidth = screenHalfWidthNow;
+}
+
+// For when the video changes to one of a different size or format.
+void resizeScreen(int videoWidth, int videoHeight, int screenPlanes)
+{
+	deleteVAO(screen);
+	initializeScreenGeo(videoWidth, videoHeight);
+
+	GLuint textures[3] = { screen.texture, screen.uTexture, screen.vTexture };
+	for(int i = 0; i < 3; i++) {
+		if(textures[i])
+			glDeleteTextures(1, &textures[i]);
+	}
+	screen.texture = screen.uTexture = screen.vTexture = 0;
+
+	initializeScreenTextures(videoWidth, videoHeight, screenPlanes);
+}
+
+static void updateScreenTexture(GLuint texture, GLenum format, const unsigned char *pixels, int pitch,
+								size_t width, size_t height, int bytesPerPixel)
+{
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, pitch / bytesPerPixel);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, format, GL_UNSIGNED_BYTE, pixels);
+}
+
+// Uploads a video frame's planes straight from wherever the decoder
+// left them, pitches are in bytes.
+void updateScreenTextures(const unsigned char *const planes[3], const int pitches[3],
+						  size_t width, size_t height, int screenPlanes)
+{
+	size_t chromaWidth = (width + 1) / 2;
+	size_t chromaHeight = (height + 1) / 2;
+
+	TRACE_SCOPE("glTexSubImage2D");
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+	if(screenPlanes == 1) {
+		updateScreenTexture(screen.texture, GL_RGBA, planes[0], pitches[0], width, height, 4);
+
+	} else {
+		updateScreenTexture(screen.texture, GL_RED, planes[0], pitches[0], width, height, 1);
+
+		if(screenPlanes == 2) {
+			updateScreenTexture(screen.uTexture, GL_RG, planes[1], pitches[1], chromaWidth, chromaHeight, 2);
+		} else {
+			updateScreenTexture(screen.uTexture, GL_RED, planes[1], pitches[1], chromaWidth, chromaHeight, 1);
+			updateScreenTexture(screen.vTexture, GL_RED, planes[2], pitches[2], chromaWidth, chromaHeight, 1);
+		}
+	}
+
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glBindTexture(GL_TEXTURE_2D, 0);
 }
 
 string pickVideo()
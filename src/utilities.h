@@ -9,14 +9,22 @@ struct objRenderData {
 	GLuint vao = 0;
 	size_t numTriangles = 0;
 	GLuint texture = 0;
+	GLuint uTexture = 0;  // Chroma planes for YUV video. With NV12 uTexture
+	GLuint vTexture = 0;  // holds both U and V and vTexture isn't used.
 };
 
 GLuint createShader(GLenum eShaderType, const std::string &strShaderFile);
 GLuint createProgram(const std::vector<GLuint> &shaderList);
 GLuint initializeProgram();
 void initializeGeo(std::string geoDir, int videoWidth, int videoHeight);
+void initializeScreenGeo(int videoWidth, int videoHeight);
+void getScreenGeometry(float centre[3], float *halfWidth);
 void createVAO(objRenderData &renderData, GLfloat *verts, GLfloat *normals, GLfloat *uvs);
-void initializeTextures(std::string texDir, size_t screenTexWidth, size_t screenTexHeight);
+void initializeTextures(std::string texDir, size_t screenTexWidth, size_t screenTexHeight, int screenPlanes);
+void initializeScreenTextures(size_t screenTexWidth, size_t screenTexHeight, int screenPlanes);
+void resizeScreen(int videoWidth, int videoHeight, int screenPlanes);
+void updateScreenTextures(const unsigned char *const planes[3], const int pitches[3],
+						  size_t width, size_t height, int screenPlanes);
 std::string pickVideo();
 
 
@@ -2,6 +2,7 @@ extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavformat/avio.h>
+#include <libavdevice/avdevice.h>
 #include <libswscale/swscale.h>
 #include <libavutil/avstring.h>
 #include <libavutil/time.h>
@@ -24,67 +25,171 @@ extern "C" {
 }
 
 #include "video.h"
+#include "packetqueue.h"
+#include "keyframeindex.h"
+#include "yuvconvert.h"
+#include "workerpool.h"
+#include "frameconvert.h"
+#include "framepool.h"
+#include "mappedio.h"
+#include "readahead.h"
+#include "pcmring.h"
+#include "audioconvert.h"
+#include "spatialaudio.h"
+#include "streamcache.h"
+#include "metrics.h"
+#include "trace.h"
 #include <SDL.h>
 #include <SDL_thread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <math.h>
+#include <string.h>
 
+/* frames per audio callback, unless video_set_audio_period() says otherwise */
 #define SDL_AUDIO_BUFFER_SIZE 2048
-#define MAX_AUDIO_FRAME_SIZE 192000
+/* periods SDL and the sound card hold between the callback and the
+   speaker, for estimating the output latency */
+#define AUDIO_DEVICE_PERIODS 2
 
-#define MAX_AUDIOQ_SIZE (5 * 16 * 1024)
-#define MAX_VIDEOQ_SIZE (5 * 256 * 1024)
+/* decoded audio audio_thread keeps ahead of the callback */
+#define AUDIO_RING_SECONDS 0.5
+
+/* decode_thread stops reading once each queue has this much in it, by
+   bytes or by time, or once they hold MAX_QUEUE_SIZE between them */
+#define MAX_AUDIOQ_SIZE (1024 * 1024)
+#define MAX_AUDIOQ_SECONDS 1.0
+#define MAX_VIDEOQ_SIZE (8 * 1024 * 1024)
+#define MAX_VIDEOQ_SECONDS 1.0
+#define MAX_QUEUE_SIZE (16 * 1024 * 1024)
 
 #define AV_SYNC_THRESHOLD 0.01
 #define AV_NOSYNC_THRESHOLD 10.0
 
+/* if the frame timer falls further behind than this, restart it from now */
+#define AV_SYNC_RESET_THRESHOLD 0.1
+
+/* presentation error histogram, 1 ms buckets */
+#define JITTER_HISTOGRAM_SIZE 20
+
+/* decoded frames later than this are dropped before conversion */
+#define EARLY_DROP_THRESHOLD 0.1
+/* but never more than this many in a row, so something still gets shown */
+#define EARLY_DROP_MAX_IN_ROW 5
+
+/* fast open: how much of the file avformat_find_stream_info() may read */
+#define FAST_OPEN_PROBESIZE (256 * 1024)
+#define FAST_OPEN_ANALYZE_DURATION 0.5
+/* libavformat's defaults, for when that wasn't enough */
+#define DEFAULT_PROBESIZE 5000000
+#define DEFAULT_ANALYZE_DURATION 5.0
+
+/* most the audio's rate is changed by to hold it in sync */
 #define SAMPLE_CORRECTION_PERCENT_MAX 10
 #define AUDIO_DIFF_AVG_NB 20
-
-#define VIDEO_PICTURE_QUEUE_SIZE 2
+/* gains of the audio sync loop, see synchronize_audio(): rate correction
+   per second of offset, and per second of offset per second. Critically
+   damped with a time constant of 5 s, so the pitch doesn't wobble */
+#define AUDIO_PLL_KP 0.4
+#define AUDIO_PLL_KI 0.04
+/* audio_comp is let go once this long has gone by without a correction,
+   and frames go back to the path they'd take without it */
+#define AUDIO_COMP_IDLE_SECONDS 2.0
+
+// One slot is held by the picture on screen (and borrowed by the renderer)
+// so this leaves two for decoded pictures waiting to be shown.
+#define VIDEO_PICTURE_QUEUE_SIZE 3
 
 #define DEFAULT_AV_SYNC_TYPE AV_SYNC_EXTERNAL_MASTER
 
-typedef struct PacketQueue {
-	AVPacketList *first_pkt, *last_pkt;
-	int nb_packets;
-	int size;
-	SDL_mutex *mutex;
-	SDL_cond *cond;
-} PacketQueue;
+// Per stage pipeline metrics, shared by every player. Looked up once by
+// the first video_open().
+static struct {
+	Metric *demux;        /* av_read_frame() */
+	Metric *decode_video; /* per packet, including the drain at the end */
+	Metric *decode_audio;
+	Metric *audio_mix;
+	Metric *spatial;      /* spatial_render(), per block */
+	Metric *convert;      /* colour conversion, swscale or yuvconvert */
+	Metric *videoq;       /* packets, sampled once per refresh */
+	Metric *audioq;
+	Metric *pictq;        /* pictures waiting to be shown */
+	Metric *av_drift;     /* ms the picture going up is ahead of the audio */
+	Metric *audio_ring;   /* ms of audio decoded ahead, sampled per callback */
+	Metric *audio_underruns;
+	Metric *audio_callback; /* ms between audio callbacks */
+	Metric *audio_sync;   /* ms the audio is ahead of the master clock, smoothed */
+	Metric *audio_correction; /* ppm the audio's slowed down by to hold sync */
+} metrics;
 
 typedef struct VideoPicture {
 	unsigned char *bmp;
+	AVFrame *frame; /* the decoder's frame, when its planes are passed straight through */
+	const unsigned char *planes[3];
+	int pitches[3];
 	int width, height; /* source height & width */
 	int allocated;
 	double pts;
+	int refs; /* display + renderer references, guarded by pictq_mutex */
 } VideoPicture;
 
-typedef struct VideoState {
+struct VideoState {
 
 	AVFormatContext *pFormatCtx;
 	int             videoStream, audioStream;
 
 	int             av_sync_type;
-	double          external_clock; /* external clock base */
-	int64_t         external_clock_time;
+	SDL_SpinLock    external_clock_lock;
+	double          external_clock; /* pts at external_clock_time, see get_external_clock() */
+	int64_t         external_clock_time; /* 0 until the first picture's up */
 
-	double          audio_clock;
+	double          audio_clock;    /* pts at the end of what audio_thread has decoded */
 	AVStream        *audio_st;
 	PacketQueue     audioq;
+	PacketQueueSpace queue_space;   /* decode_thread sleeps on this when the queues are full */
 	AVFrame         audio_frame;
-	uint8_t         audio_buf[(MAX_AUDIO_FRAME_SIZE * 3) / 2];
-	unsigned int    audio_buf_size;
-	unsigned int    audio_buf_index;
+	int             audio_path;     /* how decoded frames become the device's format, see AudioPath */
+	enum AVSampleFormat audio_out_fmt; /* the device's, always packed */
+	int             audio_out_channels;
+	uint64_t        audio_out_layout;
+	int             audio_frame_bytes; /* one sample for every channel, in the device's format */
+	int             audio_out_rate;
+	float           audio_matrix[AUDIO_OUT_MAX_CHANNELS * AUDIO_MIX_MAX_CHANNELS]; /* for AUDIO_PATH_MIX */
+	uint8_t         *audio_converted; /* AUDIO_PATH_INTERLEAVE and AUDIO_PATH_MIX output */
+	unsigned int    audio_converted_size;
+	PcmRing         audio_ring;     /* from audio_thread to the callback */
+	SDL_sem         *audio_ring_space; /* audio_thread sleeps on this when the ring is full, */
+	SDL_atomic_t    audio_ring_waiting; /* and sets this first so it gets posted */
+	SpatialRenderer *spatial;       /* turns the ring's channels into the device's stereo */
+	float           spatial_out[SPATIAL_BLOCK * 2];
+	int             spatial_out_pos; /* bytes of spatial_out the device has had */
+	int             audio_bytes_per_sec; /* of what's in the ring, which is the device's format */
+	SDL_SpinLock    audio_clock_lock;
+	double          audio_clock_pts; /* pts of the byte at audio_clock_pos, see get_audio_clock() */
+	unsigned int    audio_clock_pos;
+	unsigned int    audio_played_pos;    /* where in the ring the last callback handed over up to, */
+	int64_t         audio_played_time;   /* av_gettime() it ran at, 0 before the first, */
+	double          audio_played_period; /* and the seconds of audio it handed over */
+	double          audio_callback_interval; /* seconds between callbacks, averaged */
+	double          audio_latency;  /* seconds from the end of what a callback hands over to it being heard */
+	int             audio_latency_set; /* from video_set_audio_latency() rather than estimated */
+	int             audio_dev_bytes_per_sec; /* of what the device plays */
+	SDL_atomic_t    audio_primed;   /* written to since the last flush */
+	SDL_atomic_t    audio_underruns; /* callbacks that ran the ring dry */
 	AVPacket        audio_pkt;
 	uint8_t         *audio_pkt_data;
 	int             audio_pkt_size;
 	int             audio_hw_buf_size;
 	double          audio_diff_cum; /* used for AV difference average computation */
 	double          audio_diff_avg_coef;
-	double          audio_diff_threshold;
 	int             audio_diff_avg_count;
-	uint8_t         audio_need_resample;
+	double          audio_pll_rate;  /* the sync loop's integral, a fraction of the rate */
+	double          audio_comp_frac; /* compensation short of a whole sample, for the next frame */
+	int             audio_comp_failed;
+	int             audio_comp_idle; /* frames since the last correction */
+	double          audio_sync_offset;     /* smoothed, under audio_clock_lock */
+	double          audio_sync_correction; /* what the rate's being changed by, likewise */
+	double          av_offset;      /* the last picture's pts less the audio's when it went up */
 	double          frame_timer;
 	double          frame_last_pts;
 	double          frame_last_delay;
@@ -96,16 +201,49 @@ typedef struct VideoState {
 
 	VideoPicture    pictq[VIDEO_PICTURE_QUEUE_SIZE];
 	int             pictq_size, pictq_rindex, pictq_windex;
+	int             pictq_shown; /* slot currently on screen, -1 until the first picture */
+	unsigned int    frame_serial; /* bumped every time a new picture goes on screen */
 	SDL_mutex       *pictq_mutex;
 	SDL_cond        *pictq_cond;
 
+	SDL_atomic_t    frames_shown;
+	SDL_atomic_t    frames_late;          /* shown, but after they were due */
+	SDL_atomic_t    frames_dropped;       /* skipped in the picture queue */
+	SDL_atomic_t    frames_dropped_early; /* skipped by video_thread before conversion */
+	int             early_drops_in_row;
+
+	double          last_display_time;   /* from the previous video_refresh() */
+	double          display_interval;    /* smoothed time between video_refresh() calls */
+	int             jitter_histogram[JITTER_HISTOGRAM_SIZE + 1]; /* |shown - due| in ms, last is overflow */
+	double          jitter_max;
+
+	KeyframeIndex   keyframes;           /* only used by decode_thread */
+	SDL_atomic_t    seek_req;
+	double          seek_target;         /* seconds, written before seek_req is set */
+	int64_t         seek_request_time;   /* av_gettime() of the seek being done, guarded by pictq_mutex */
+	int             seek_flushed;        /* pictq has been flushed for it, guarded by pictq_mutex */
+	int             seeks;
+	double          seek_latency_last, seek_latency_max;
+	int             audio_finished;      /* got the EOF packet, nothing more until a seek */
+	SDL_atomic_t    audio_eof;           /* audio_thread has put the last of the file in the ring */
+	SDL_atomic_t    video_eof;           /* video_thread has queued the last picture in the file */
+
 	SDL_Thread      *parse_tid;
 	SDL_Thread      *video_tid;
+	SDL_Thread      *audio_tid;
 
 	char            filename[1024];
 
-	AVIOContext     *io_context;
-	struct SwsContext *sws_ctx;
+	AVIOContext     *io_context;   /* our own file I/O, NULL if libavformat does its own */
+	int             io_read_ahead; /* io_context is a read_ahead_open() one rather than memory mapped */
+	VideoOutputFormat output_format;
+	int             plane_count;   /* planes per picture handed to the renderer */
+	int             planar_passthrough; /* YUV output straight from the decoder's frames */
+	WorkerPool      *conv_pool;
+	FrameConverter  *converter;    /* NULL when planes are passed straight through */
+	FramePool       *frame_pool;   /* the video decoder's frame buffers */
+	enum AVPixelFormat conv_dst_fmt;
+	YuvCoeffs       yuv_coeffs;
 
 #ifdef __RESAMPLER__
 #ifdef __LIBAVRESAMPLE__
@@ -118,9 +256,37 @@ typedef struct VideoState {
 	uint8_t *pResampledOut;
 	int resample_lines;
 	uint64_t resample_size;
+#ifdef __LIBSWRESAMPLE__
+	SwrContext *audio_comp;    /* rate compensation for the paths that don't resample */
+	uint8_t *audio_comp_out;
+	unsigned int audio_comp_out_size;
 #endif
+#endif
+
+	int             flags;         /* from video_open() */
+	int64_t         open_time;     /* av_gettime() of video_open(), or video_start() if it was paused */
+	double          stream_info_time;   /* ms to fill in the streams, by probing or from the cache */
+	int             stream_info_cached;
+	double          time_to_first_frame; /* ms from open_time to the first picture up, 0 until then */
+	char            *stream_description; /* for the stream cache, until the first keyframe is found */
+	int64_t         first_keyframe_pos;  /* byte offset from the stream cache, -1 if not known */
+	int             keyframe_seen;       /* decode_thread has had a video keyframe */
+	SDL_AudioDeviceID audio_dev;   /* 0 when there's no audio or it's turned off */
+	SDL_SpinLock    audio_tap_lock;
+	VideoAudioTap   audio_tap;     /* see video_set_audio_tap(), under audio_tap_lock */
+	void            *audio_tap_opaque;
+	SDL_atomic_t    quit;          /* set by video_close(), every thread checks it */
+};
 
-} VideoState;
+// Decoded audio takes the cheapest way to the device's format. The
+// device is asked for the codec's sample type and channels, so
+// swresample is only needed when the sample rate has to change.
+enum AudioPath {
+	AUDIO_PATH_PASSTHROUGH, /* packed frames already in the device's format */
+	AUDIO_PATH_INTERLEAVE,  /* planar stereo of the device's sample type */
+	AUDIO_PATH_MIX,         /* any other format or layout, by audio_mix() */
+	AUDIO_PATH_RESAMPLE     /* a different rate, through swresample */
+};
 
 enum {
 	AV_SYNC_AUDIO_MASTER,
@@ -128,130 +294,126 @@ enum {
 	AV_SYNC_EXTERNAL_MASTER,
 };
 
-SDL_Window     *window;
-SDL_Renderer   *renderer;
-unsigned char  *pixelBuffer;
+// Set with video_set_conversion_threads() before video_open().
+static int conversion_threads = 0;
 
-extern bool g_running;
-
-/* Since we only have one decoding thread, the Big Struct
-   can be global in case we need it. */
-VideoState *global_video_state;
-
-uint64_t programStartTimeMs;
-
-void packet_queue_init(PacketQueue *q) {
-	memset(q, 0, sizeof(PacketQueue));
-	q->mutex = SDL_CreateMutex();
-	q->cond = SDL_CreateCond();
-}
+// Set with video_set_read_ahead() before video_open().
+static int read_ahead_window = 64 * 1024 * 1024;
 
-int packet_queue_put(PacketQueue *q, AVPacket *pkt) {
+// Set with video_set_spatial_audio() before video_open().
+static int spatial_audio = 0;
 
-	AVPacketList *pkt1;
+// Set with video_set_audio_period() and video_set_audio_latency() before
+// video_open().
+static int audio_period = SDL_AUDIO_BUFFER_SIZE;
+static double audio_latency = -1;
 
-	if(av_dup_packet(pkt) < 0) {
-		return -1;
-	}
+// Set with video_set_fast_open() and video_set_stream_cache().
+static int fast_open = 1;
+static char stream_cache_path[1024];
 
-	pkt1 = (AVPacketList*)av_malloc(sizeof(AVPacketList));
+// The pts of the audio being heard. Along with each write audio_thread
+// publishes the pts of the byte it got up to, and everything between
+// the last callback's position and there is still to be played. What was
+// handed over is heard audio_latency later. The position only moves a
+// callback's worth at a time, so the time since the last callback is
+// added on to smooth that out, which the sync loop depends on.
+double get_audio_clock(VideoState *is) {
+	double pts, period, elapsed = 0;
+	unsigned int pos, played;
+	int64_t time;
 
-	if(!pkt1) {
-		return -1;
+	if(!is->audio_bytes_per_sec) {
+		return 0;
 	}
 
-	pkt1->pkt = *pkt;
-	pkt1->next = NULL;
-
-	SDL_LockMutex(q->mutex);
-
-	if(!q->last_pkt) {
-		q->first_pkt = pkt1;
-
+	SDL_AtomicLock(&is->audio_clock_lock);
+	pts = is->audio_clock_pts;
+	pos = is->audio_clock_pos;
+	played = is->audio_played_pos;
+	time = is->audio_played_time;
+	period = is->audio_played_period;
+	SDL_AtomicUnlock(&is->audio_clock_lock);
+
+	if(time) {
+		elapsed = (av_gettime() - time) / 1000000.0;
+		elapsed = (elapsed < period) ? elapsed : period;
 	} else {
-		q->last_pkt->next = pkt1;
+		played = pcm_ring_read_pos(&is->audio_ring);
 	}
 
-	q->last_pkt = pkt1;
-	q->nb_packets++;
-	q->size += pkt1->pkt.size;
-	SDL_CondSignal(q->cond);
-
-	SDL_UnlockMutex(q->mutex);
-	return 0;
+	return pts - (int)(pos - played) / (double)is->audio_bytes_per_sec - is->audio_latency + elapsed;
 }
 
-static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block) {
-	AVPacketList *pkt1;
-	int ret;
-
-	SDL_LockMutex(q->mutex);
-
-	for(;;) {
-
-		if(!g_running) {
-			ret = -1;
-			break;
-		}
-
-		pkt1 = q->first_pkt;
-
-		if(pkt1) {
-			q->first_pkt = pkt1->next;
+// Called by the callback once it's handed len bytes to the device, with
+// held bytes read from the ring that haven't gone yet. 0 for both after
+// a flush.
+static void audio_played(VideoState *is, int len, int held) {
+	int64_t now = len ? av_gettime() : 0;
 
-			if(!q->first_pkt) {
-				q->last_pkt = NULL;
-			}
+	SDL_AtomicLock(&is->audio_clock_lock);
+	if(now && is->audio_played_time) {
+		double interval = (now - is->audio_played_time) / 1000000.0;
 
-			q->nb_packets--;
-			q->size -= pkt1->pkt.size;
-			*pkt = pkt1->pkt;
-			av_free(pkt1);
-			ret = 1;
-			break;
+		is->audio_callback_interval += (interval - is->audio_callback_interval) * 0.05;
+		metric_record(metrics.audio_callback, interval * 1000);
+	}
+	is->audio_played_pos = pcm_ring_read_pos(&is->audio_ring) - held;
+	is->audio_played_time = now;
+	is->audio_played_period = len / (double)is->audio_dev_bytes_per_sec;
+	SDL_AtomicUnlock(&is->audio_clock_lock);
+}
 
-		} else if(!block) {
-			ret = 0;
-			break;
+static void audio_clock_publish(VideoState *is, double pts, unsigned int pos) {
+	SDL_AtomicLock(&is->audio_clock_lock);
+	is->audio_clock_pts = pts;
+	is->audio_clock_pos = pos;
+	SDL_AtomicUnlock(&is->audio_clock_lock);
+}
 
-		} else {
-			SDL_CondWait(q->cond, q->mutex);
-		}
-	}
+double get_video_clock(VideoState *is) {
+	double delta;
 
-	SDL_UnlockMutex(q->mutex);
-	return ret;
+	delta = (av_gettime() - is->video_current_pts_time) / 1000000.0;
+	return is->video_current_pts + delta;
 }
 
-double get_audio_clock(VideoState *is) {
+// The wall clock, from the pts of the last picture put up at the time
+// it was due. Pictures are timed on the wall clock as well, so this is
+// where the video is, without the jitter of get_video_clock() from which
+// display refresh each one landed on.
+double get_external_clock(VideoState *is) {
 	double pts;
-	int hw_buf_size, bytes_per_sec, n;
+	int64_t time;
 
-	pts = is->audio_clock; /* maintained in the audio thread */
-	hw_buf_size = is->audio_buf_size - is->audio_buf_index;
-	bytes_per_sec = 0;
-	n = is->audio_st->codec->channels * 2;
+	SDL_AtomicLock(&is->external_clock_lock);
+	pts = is->external_clock;
+	time = is->external_clock_time;
+	SDL_AtomicUnlock(&is->external_clock_lock);
 
-	if(is->audio_st) {
-		bytes_per_sec = is->audio_st->codec->sample_rate * n;
-	}
-
-	if(bytes_per_sec) {
-		pts -= (double)hw_buf_size / bytes_per_sec;
-	}
+	return pts + (av_gettime() - time) / 1000000.0;
+}
 
-	return pts;
+static void external_clock_set(VideoState *is, double pts, double time) {
+	SDL_AtomicLock(&is->external_clock_lock);
+	is->external_clock = pts;
+	is->external_clock_time = (int64_t)(time * 1000000.0);
+	SDL_AtomicUnlock(&is->external_clock_lock);
 }
 
-double get_video_clock(VideoState *is) {
-	double delta;
+// The external clock only starts with the first picture, and stops for a
+// seek until the first picture after it.
+static int master_clock_running(VideoState *is) {
+	int64_t time;
 
-	delta = (av_gettime() - is->video_current_pts_time) / 1000000.0;
-	return is->video_current_pts + delta;
-}
+	if(is->av_sync_type != AV_SYNC_EXTERNAL_MASTER) {
+		return 1;
+	}
 
-double get_external_clock(VideoState* /*is*/) {
-	return av_gettime() / 1000000.0;
+	SDL_AtomicLock(&is->external_clock_lock);
+	time = is->external_clock_time;
+	SDL_AtomicUnlock(&is->external_clock_lock);
+	return time != 0;
 }
 
 double get_master_clock(VideoState *is) {
@@ -266,79 +428,166 @@ double get_master_clock(VideoState *is) {
 	}
 }
 
-/* Add or subtract samples to get a better sync, return new
-   audio buffer size */
+static void audio_sync_reset(VideoState *is) {
+	is->audio_diff_avg_count = 0;
+	is->audio_diff_cum = 0;
+	is->audio_pll_rate = 0;
+	is->audio_comp_frac = 0;
+	is->audio_comp_idle = 0;
+}
+
+#ifdef __LIBSWRESAMPLE__
+// A resampler from the device's format to itself, which swresample only
+// starts filtering once it's asked to compensate.
+static SwrContext *audio_comp_create(VideoState *is) {
+	SwrContext *swr = swr_alloc_set_opts(NULL, is->audio_out_layout, is->audio_out_fmt, is->audio_out_rate,
+										 is->audio_out_layout, is->audio_out_fmt, is->audio_out_rate, 0, NULL);
+
+	if(!swr || swr_init(swr) < 0) {
+		fprintf(stderr, "Can't set up audio rate compensation, the audio won't be kept in sync\n");
+		swr_free(&swr);
+		is->audio_comp_failed = 1;
+	}
+	return swr;
+}
+#endif
+
+// Plays the next distance frames with delta more in them, or fewer if
+// it's negative. A resampled stream does it in pSwrCtx. Any other has
+// audio_comp set up when it's needed, and runs through it until it's gone
+// AUDIO_COMP_IDLE_SECONDS without one, see audio_compensate().
+static void audio_set_compensation(VideoState *is, int delta, int distance) {
+#ifdef __LIBSWRESAMPLE__
+	SwrContext *swr;
 
-int synchronize_audio(VideoState *is, short *samples,
-					  int samples_size, double /*pts*/) {
+	is->audio_comp_idle = delta ? 0 : FFMIN(is->audio_comp_idle + distance,
+											(int)(AUDIO_COMP_IDLE_SECONDS * is->audio_out_rate));
 
-	int n;
-	double ref_clock;
+	if(is->audio_comp_failed) {
+		return;
+	}
 
-	n = 2 * is->audio_st->codec->channels;
+	if(is->audio_path == AUDIO_PATH_RESAMPLE) {
+		swr = is->pSwrCtx;
+	} else {
+		if(!is->audio_comp && delta != 0) {
+			is->audio_comp = audio_comp_create(is);
+		}
+		swr = is->audio_comp;
+	}
 
-	if(is->av_sync_type != AV_SYNC_AUDIO_MASTER) {
-		double diff, avg_diff;
-		int wanted_size, min_size, max_size /*, nb_samples */;
+	if(swr && swr_set_compensation(swr, delta, distance) < 0) {
+		fprintf(stderr, "Audio rate compensation failed, the audio won't be kept in sync\n");
+		is->audio_comp_failed = 1;
+	}
+#endif
+}
 
-		ref_clock = get_master_clock(is);
-		diff = get_audio_clock(is) - ref_clock;
+// Runs a converted frame through audio_comp, once there is one. Leaves
+// data pointing at the result and returns its size. Once the sync loop
+// has gone long enough without correcting, what audio_comp holds is
+// flushed out after the frame and it's freed.
+static int audio_compensate(VideoState *is, const uint8_t **data, int size) {
+#ifdef __LIBSWRESAMPLE__
+	int in = size / is->audio_frame_bytes;
+	int delay, out, flushed = 0;
 
-		if(diff < AV_NOSYNC_THRESHOLD) {
-			// accumulate the diffs
-			is->audio_diff_cum = diff + is->audio_diff_avg_coef
-								 * is->audio_diff_cum;
+	if(!is->audio_comp) {
+		return size;
+	}
 
-			if(is->audio_diff_avg_count < AUDIO_DIFF_AVG_NB) {
-				is->audio_diff_avg_count++;
+	delay = (int)swr_get_delay(is->audio_comp, is->audio_out_rate);
+	out = in + in * SAMPLE_CORRECTION_PERCENT_MAX / 100 + 2 * delay + 1;
+	av_fast_malloc(&is->audio_comp_out, &is->audio_comp_out_size, out * is->audio_frame_bytes);
+	if(!is->audio_comp_out) {
+		return -1;
+	}
 
-			} else {
-				avg_diff = is->audio_diff_cum * (1.0 - is->audio_diff_avg_coef);
+	out = swr_convert(is->audio_comp, &is->audio_comp_out, out, data, in);
+	if(out >= 0 && is->audio_comp_idle >= AUDIO_COMP_IDLE_SECONDS * is->audio_out_rate) {
+		uint8_t *rest = is->audio_comp_out + out * is->audio_frame_bytes;
+		int room = is->audio_comp_out_size / is->audio_frame_bytes - out;
 
-				if(fabs(avg_diff) >= is->audio_diff_threshold) {
-					wanted_size = samples_size + ((int)(diff * is->audio_st->codec->sample_rate) * n);
-					min_size = samples_size * ((100 - SAMPLE_CORRECTION_PERCENT_MAX) / 100);
-					max_size = samples_size * ((100 + SAMPLE_CORRECTION_PERCENT_MAX) / 100);
+		flushed = swr_convert(is->audio_comp, &rest, room, NULL, 0);
+		flushed = (flushed > 0) ? flushed : 0;
+		swr_free(&is->audio_comp);
+	}
 
-					if(wanted_size < min_size) {
-						wanted_size = min_size;
+	*data = is->audio_comp_out;
+	return out < 0 ? -1 : (out + flushed) * is->audio_frame_bytes;
+#else
+	return size;
+#endif
+}
 
-					} else if(wanted_size > max_size) {
-						wanted_size = max_size;
-					}
+// Seconds of audio the resamplers have taken in and not given out yet.
+// audio_clock has counted it already, but it isn't in the ring.
+static double audio_resampler_delay(VideoState *is) {
+	double delay = 0;
 
-					if(wanted_size < samples_size) {
-						/* remove samples */
-						samples_size = wanted_size;
+#ifdef __LIBSWRESAMPLE__
+	if(is->audio_path == AUDIO_PATH_RESAMPLE && is->pSwrCtx) {
+		delay += swr_get_delay(is->pSwrCtx, is->audio_out_rate) / (double)is->audio_out_rate;
+	}
+	if(is->audio_comp) {
+		delay += swr_get_delay(is->audio_comp, is->audio_out_rate) / (double)is->audio_out_rate;
+	}
+#endif
+	return delay;
+}
 
-					} else if(wanted_size > samples_size) {
-						uint8_t *samples_end, *q;
-						int nb;
+/* Keeps the audio on the master clock by playing it a little fast or
+   slow, with swresample stretching or squeezing it rather than samples
+   being dropped or repeated. The smoothed offset from the master clock
+   drives a proportional plus integral loop, a second order PLL, whose
+   output is the fraction the rate changes by. The integral settles on
+   the difference between the sound card's clock and the master's, so the
+   offset itself settles on zero. samples is how many frames just went
+   into the ring, and the correction is spread over as many again. */
+
+static void synchronize_audio(VideoState *is, int samples) {
+	const double max = SAMPLE_CORRECTION_PERCENT_MAX / 100.0;
+	double diff, avg_diff, correction;
+	int delta;
+
+	if(is->av_sync_type == AV_SYNC_AUDIO_MASTER || !master_clock_running(is) || samples <= 0) {
+		return;
+	}
 
-						/* add samples by copying final sample*/
-						nb = (samples_size - wanted_size);
-						samples_end = (uint8_t *)samples + samples_size - n;
-						q = samples_end + n;
+	diff = get_audio_clock(is) - get_master_clock(is);
 
-						while(nb > 0) {
-							memcpy(q, samples_end, n);
-							q += n;
-							nb -= n;
-						}
+	if(fabs(diff) >= AV_NOSYNC_THRESHOLD) {
+		/* difference is TOO big; reset diff stuff */
+		audio_sync_reset(is);
+		return;
+	}
 
-						samples_size = wanted_size;
-					}
-				}
-			}
+	// accumulate the diffs
+	is->audio_diff_cum = diff + is->audio_diff_avg_coef * is->audio_diff_cum;
 
-		} else {
-			/* difference is TOO big; reset diff stuff */
-			is->audio_diff_avg_count = 0;
-			is->audio_diff_cum = 0;
-		}
+	if(is->audio_diff_avg_count < AUDIO_DIFF_AVG_NB) {
+		is->audio_diff_avg_count++;
+		return;
 	}
+	avg_diff = is->audio_diff_cum * (1.0 - is->audio_diff_avg_coef);
+
+	// Audio ahead of the clock is slowed down, so gets more samples.
+	is->audio_pll_rate = av_clipd(is->audio_pll_rate + AUDIO_PLL_KI * avg_diff * samples / is->audio_out_rate,
+								  -max, max);
+	correction = av_clipd(is->audio_pll_rate + AUDIO_PLL_KP * avg_diff, -max, max);
+
+	is->audio_comp_frac += correction * samples;
+	delta = (int)floor(is->audio_comp_frac);
+	is->audio_comp_frac -= delta;
+	audio_set_compensation(is, delta, samples);
+
+	SDL_AtomicLock(&is->audio_clock_lock);
+	is->audio_sync_offset = avg_diff;
+	is->audio_sync_correction = correction;
+	SDL_AtomicUnlock(&is->audio_clock_lock);
 
-	return samples_size;
+	metric_set(metrics.audio_sync, avg_diff * 1000);
+	metric_set(metrics.audio_correction, correction * 1000000);
 }
 
 long audio_tutorial_resample(VideoState *is, struct AVFrame *inframe) {
@@ -361,30 +610,36 @@ long audio_tutorial_resample(VideoState *is, struct AVFrame *inframe) {
 
 	int resample_nblen = 0;
 	long resample_long_bytes = 0;
+	int64_t resample_needed;
 
-	if( is->pResampledOut == NULL || inframe->nb_samples > is->resample_size) {
+	// Room for what's held over from the last frame and for rate
+	// compensation, see synchronize_audio().
 #if __LIBAVRESAMPLE__
-		is->resample_size = av_rescale_rnd(avresample_get_delay(is->pSwrCtx) +
-										   inframe->nb_samples,
-										   is->audio_st->codec->sample_rate,
-										   is->audio_st->codec->sample_rate,
-										   AV_ROUND_UP);
+	resample_needed = av_rescale_rnd(avresample_get_delay(is->pSwrCtx) +
+									 inframe->nb_samples,
+									 is->audio_out_rate,
+									 is->audio_st->codec->sample_rate,
+									 AV_ROUND_UP);
 #else
-		is->resample_size = av_rescale_rnd(swr_get_delay(is->pSwrCtx,
-										   is->audio_st->codec->sample_rate) +
-										   inframe->nb_samples,
-										   is->audio_st->codec->sample_rate,
-										   is->audio_st->codec->sample_rate,
-										   AV_ROUND_UP);
+	resample_needed = av_rescale_rnd(swr_get_delay(is->pSwrCtx,
+									 is->audio_st->codec->sample_rate) +
+									 inframe->nb_samples,
+									 is->audio_out_rate,
+									 is->audio_st->codec->sample_rate,
+									 AV_ROUND_UP);
 #endif
+	resample_needed += resample_needed * SAMPLE_CORRECTION_PERCENT_MAX / 100 + 1;
+
+	if( is->pResampledOut == NULL || resample_needed > (int64_t)is->resample_size) {
+		is->resample_size = resample_needed;
 
 		if(is->pResampledOut != NULL) {
 			av_free(is->pResampledOut);
 			is->pResampledOut = NULL;
 		}
 
-		av_samples_alloc(&is->pResampledOut, &is->resample_lines, 2, int(is->resample_size),
-						 AV_SAMPLE_FMT_S16, 0);
+		av_samples_alloc(&is->pResampledOut, &is->resample_lines, is->audio_out_channels, int(is->resample_size),
+						 is->audio_out_fmt, 0);
 
 	}
 
@@ -412,8 +667,8 @@ long audio_tutorial_resample(VideoState *is, struct AVFrame *inframe) {
 								 (const uint8_t **)resample_input_bytes, inframe->nb_samples);
 #endif
 
-	resample_long_bytes = av_samples_get_buffer_size(NULL, 2, resample_nblen,
-						 AV_SAMPLE_FMT_S16, 1);
+	resample_long_bytes = av_samples_get_buffer_size(NULL, is->audio_out_channels, resample_nblen,
+						 is->audio_out_fmt, 1);
 
 	if (resample_nblen < 0) {
 		fprintf(stderr, "reSample to another sample format failed!\n");
@@ -427,24 +682,112 @@ long audio_tutorial_resample(VideoState *is, struct AVFrame *inframe) {
 #endif
 }
 
-int audio_decode_frame(VideoState *is, double *pts_ptr) {
-	static bool finishedStream = false;
-	if ( finishedStream ) return -1;
+// Throws away the decoder's state and the decoded audio after a seek.
+static void audio_flush(VideoState *is) {
+	avcodec_flush_buffers(is->audio_st->codec);
+	is->audio_pkt_size = 0;
+	is->audio_finished = 0;
+	SDL_AtomicSet(&is->audio_primed, 0);
+	SDL_AtomicSet(&is->audio_eof, 0);
+	pcm_ring_discard(&is->audio_ring);
+	audio_played(is, 0, 0);
+
+	// The sync loop starts again, and what the compensation was holding
+	// is as stale as the rest.
+	audio_sync_reset(is);
+#ifdef __LIBSWRESAMPLE__
+	swr_free(&is->audio_comp);
+	if(is->pSwrCtx) {
+		swr_set_compensation(is->pSwrCtx, 0, 0);
+	}
+#endif
+}
+
+// Takes a frame of whatever the codec decodes to the device's format,
+// in place where it can. Leaves data pointing at the result, which stays
+// valid until the next call, and returns its size in bytes.
+static int audio_convert_frame(VideoState *is, AVFrame *frame, const uint8_t **data) {
+	int size = frame->nb_samples * is->audio_frame_bytes;
+
+	switch(is->audio_path) {
+		case AUDIO_PATH_PASSTHROUGH:
+			*data = frame->data[0];
+			return size;
+
+		case AUDIO_PATH_INTERLEAVE:
+			av_fast_malloc(&is->audio_converted, &is->audio_converted_size, size);
+			if(!is->audio_converted) {
+				return -1;
+			}
+			if(is->audio_out_fmt == AV_SAMPLE_FMT_FLT) {
+				audio_interleave_f32((float *)is->audio_converted, (const float *)frame->data[0],
+									 (const float *)frame->data[1], frame->nb_samples);
+			} else {
+				audio_interleave_s16((int16_t *)is->audio_converted, (const int16_t *)frame->data[0],
+									 (const int16_t *)frame->data[1], frame->nb_samples);
+			}
+			*data = is->audio_converted;
+			return size;
+
+		case AUDIO_PATH_MIX: {
+			Uint64 mixStart = metric_time_begin();
+
+			av_fast_malloc(&is->audio_converted, &is->audio_converted_size, size);
+			if(!is->audio_converted) {
+				return -1;
+			}
+			audio_mix(is->audio_converted, is->audio_out_fmt, is->audio_out_channels,
+					  frame->extended_data, (enum AVSampleFormat)frame->format, is->audio_st->codec->channels,
+					  is->audio_matrix, frame->nb_samples);
+			metric_time_end(metrics.audio_mix, mixStart);
+
+			*data = is->audio_converted;
+			return size;
+		}
+
+		default:
+#ifdef __RESAMPLER__
+			if(is->pSwrCtx) {
+				size = audio_tutorial_resample(is, frame);
+				*data = is->pResampledOut;
+				return size;
+			}
+#endif
+			return -1;
+	}
+}
+
+int audio_decode_frame(VideoState *is, const uint8_t **data, double *pts_ptr) {
+	while(is->audio_finished) {
+		// Nothing more comes until a seek flushes the queue.
+		if(packet_queue_get(&is->audioq, &is->audio_pkt, 1) < 0) {
+			return -1;
+		}
+		if(packet_is_flush(&is->audio_pkt)) {
+			audio_flush(is);
+		} else {
+			av_free_packet(&is->audio_pkt);
+		}
+	}
 
 	/* For example with wma audio package size can be
 	   like 100 000 bytes */
-	long len1, data_size = 0;
 	AVPacket *pkt = &is->audio_pkt;
-	double pts;
-	int n = 0;
-#ifdef __RESAMPLER__
-	long resample_size = 0;
-#endif
+	AVPacket pkt_temp;
+	int len1, data_size;
 
 	for(;;) {
 		while(is->audio_pkt_size > 0) {
 			int got_frame = 0;
-			len1 = avcodec_decode_audio4(is->audio_st->codec, &is->audio_frame, &got_frame, pkt);
+
+			// What's left of the packet, which can hold several frames.
+			pkt_temp = *pkt;
+			pkt_temp.data = is->audio_pkt_data;
+			pkt_temp.size = is->audio_pkt_size;
+
+			Uint64 decodeStart = metric_time_begin();
+			len1 = avcodec_decode_audio4(is->audio_st->codec, &is->audio_frame, &got_frame, &pkt_temp);
+			metric_time_end(metrics.decode_audio, decodeStart);
 
 			if(len1 < 0) {
 				/* if error, skip frame */
@@ -452,77 +795,31 @@ int audio_decode_frame(VideoState *is, double *pts_ptr) {
 				break;
 			}
 
-			if(got_frame) {
-				data_size =
-					av_samples_get_buffer_size
-					(
-						NULL,
-						is->audio_st->codec->channels,
-						is->audio_frame.nb_samples,
-						is->audio_st->codec->sample_fmt,
-						1
-					);
-
-				if(data_size <= 0) {
-					/* No data yet, get more frames */
-					continue;
-				}
-
-#ifdef __RESAMPLER__
-
-				if(is->audio_need_resample == 1) {
-					resample_size = audio_tutorial_resample(is, &is->audio_frame);
-
-					if( resample_size > 0 ) {
-						memcpy(is->audio_buf, is->pResampledOut, resample_size);
-						memset(is->pResampledOut, 0x00, resample_size);
-					}
-
-				} else {
-#endif
-
-					memcpy(is->audio_buf, is->audio_frame.data[0], data_size);
-#ifdef __RESAMPLER__
-				}
-
-#endif
-			}
-
 			is->audio_pkt_data += len1;
 			is->audio_pkt_size -= len1;
 
-			pts = is->audio_clock;
-			*pts_ptr = pts;
-			n = 2 * is->audio_st->codec->channels;
-
-#ifdef __RESAMPLER__
-
-			/* If you just return original data_size you will suffer
-			   for clicks because you don't have that much data in
-			   queue incoming so return resampled size. */
-			if(is->audio_need_resample == 1) {
-				is->audio_clock += (double)resample_size /
-								   (double)(n * is->audio_st->codec->sample_rate);
-				return resample_size;
+			if(!got_frame || is->audio_frame.nb_samples <= 0) {
+				/* No data yet, get more frames */
+				continue;
+			}
 
-			} else {
-#endif
-				/* We have data, return it and come back for more later */
-				is->audio_clock += (double)data_size /
-								   (double)(n * is->audio_st->codec->sample_rate);
-				return data_size;
-#ifdef __RESAMPLER__
+			data_size = audio_convert_frame(is, &is->audio_frame, data);
+			if(data_size <= 0) {
+				continue;
 			}
 
-#endif
+			*pts_ptr = is->audio_clock;
+			is->audio_clock += (double)is->audio_frame.nb_samples / is->audio_st->codec->sample_rate;
 
+			/* We have data, return it and come back for more later */
+			return data_size;
 		}
 
 		if(pkt->data) {
 			av_free_packet(pkt);
 		}
 
-		if(!g_running) {
+		if(SDL_AtomicGet(&is->quit)) {
 			return -1;
 		}
 
@@ -530,8 +827,12 @@ int audio_decode_frame(VideoState *is, double *pts_ptr) {
 		if(packet_queue_get(&is->audioq, pkt, 1) < 0) {
 			return -1;
 		}
+		if(packet_is_flush(pkt)) {
+			audio_flush(is);
+			continue;
+		}
 		if( pkt->duration == 0 ) {
-			finishedStream = true;
+			is->audio_finished = 1;
 			return -1;
 		}
 
@@ -545,206 +846,504 @@ int audio_decode_frame(VideoState *is, double *pts_ptr) {
 	}
 }
 
-void audio_callback(void *userdata, Uint8 *stream, int len) {
+// Wakes audio_thread if it's waiting for room in the ring. Only posts
+// when it is waiting, so it's cheap enough for every callback and never
+// blocks.
+static void audio_ring_wake(VideoState *is) {
+	if(SDL_AtomicCAS(&is->audio_ring_waiting, 1, 0)) {
+		SDL_SemPost(is->audio_ring_space);
+	}
+}
 
-	VideoState *is = (VideoState *)userdata;
-	long len1, audio_size;
+// Copies into the ring as the callback makes room. The rest is given up
+// if a seek's flush is waiting, it's stale, and then it returns 0.
+static int audio_ring_put(VideoState *is, const uint8_t *data, int size) {
+	for(;;) {
+		int written = pcm_ring_write(&is->audio_ring, data, size);
+
+		if(written > 0) {
+			SDL_AtomicSet(&is->audio_primed, 1);
+		}
+		data += written;
+		size -= written;
+
+		if(size == 0) {
+			return 1;
+		}
+		if(SDL_AtomicGet(&is->quit) || SDL_AtomicGet(&is->audioq.flush_pending) > 0) {
+			return 0;
+		}
+
+		// Sleep until the callback reads, a flush or video_close().
+		// waiting is set before checking again, so whatever comes in
+		// either happens before the check or sees us waiting and posts.
+		SDL_AtomicSet(&is->audio_ring_waiting, 1);
+		if(pcm_ring_space(&is->audio_ring) > 0 || SDL_AtomicGet(&is->quit)
+				|| SDL_AtomicGet(&is->audioq.flush_pending) > 0) {
+			SDL_AtomicSet(&is->audio_ring_waiting, 0);
+			continue;
+		}
+		TRACE_SCOPE("audio_ring_full");
+		SDL_SemWait(is->audio_ring_space);
+	}
+}
+
+// This thread does the audio decoding, format conversion and sync
+// correction and puts the result in audio_ring, so a slow packet or a
+// wait on the queue never holds up the callback.
+//
+// It gets started from video_open() once the resampler is set up.
+int audio_thread(void *arg) {
+	VideoState *is = (VideoState *)arg;
+	const uint8_t *data;
+	int audio_size;
 	double pts;
 
-	while(len > 0) {
+	TRACE_THREAD_NAME("audio_thread");
 
-		if(is->audio_buf_index >= is->audio_buf_size) {
-			/* We have already sent all our data; get more */
-			audio_size = audio_decode_frame(is, &pts);
+	while(!SDL_AtomicGet(&is->quit)) {
+		audio_size = audio_decode_frame(is, &data, &pts);
 
-			if(audio_size < 0) {
-				/* If error, output silence */
-				is->audio_buf_size = 1024;
-				memset(is->audio_buf, 0, is->audio_buf_size);
-			} else {
-				audio_size = synchronize_audio(is, (int16_t *)is->audio_buf,
-											   audio_size, pts);
-				is->audio_buf_size = audio_size;
+		if(audio_size < 0) {
+			if(is->audio_finished) {
+				SDL_AtomicSet(&is->audio_eof, 1);
 			}
-
-			is->audio_buf_index = 0;
+			continue;
 		}
 
-		len1 = is->audio_buf_size - is->audio_buf_index;
-
-		if(len1 > len) {
-			len1 = len;
+		audio_size = audio_compensate(is, &data, audio_size);
+		if(audio_size < 0 || !audio_ring_put(is, data, audio_size)) {
+			continue;
 		}
 
-		memcpy(stream, (uint8_t *)is->audio_buf + is->audio_buf_index, len1);
-		len -= len1;
-		stream += len1;
-		is->audio_buf_index += len1;
+		audio_clock_publish(is, is->audio_clock - audio_resampler_delay(is), pcm_ring_write_pos(&is->audio_ring));
+		synchronize_audio(is, audio_size / is->audio_frame_bytes);
 	}
 
+	return 0;
 }
 
-static Uint32 sdl_refresh_timer_cb(Uint32 /*interval*/, void *opaque) {
-	SDL_Event event;
-	event.type = FF_REFRESH_EVENT;
-	event.user.data1 = opaque;
-	SDL_PushEvent(&event);
-	return 0; // 0 means stop timer
-}
-
-/* schedule a video refresh in 'delay' ms */
-static void schedule_refresh(VideoState *is, int delay) {
-	SDL_AddTimer(delay, sdl_refresh_timer_cb, is);
+// Running dry at the end of the file, or while a seek refills the ring,
+// isn't an underrun.
+static void audio_ran_dry(VideoState *is) {
+	if(SDL_AtomicGet(&is->audio_primed) && !SDL_AtomicGet(&is->audio_eof)
+			&& SDL_AtomicGet(&is->audioq.flush_pending) == 0) {
+		SDL_AtomicAdd(&is->audio_underruns, 1);
+		metric_add(metrics.audio_underruns, 1);
+	}
 }
 
+// Spatial audio is rendered here rather than in audio_thread so that it
+// follows the head as closely as it can. It goes a block at a time, the
+// rest of the last block first, so the ring is read up to one block
+// ahead of the device. audio_played() is told how much of it is left.
+static void audio_callback_spatial(VideoState *is, Uint8 *stream, int len) {
+	float block[SPATIAL_BLOCK * AUDIO_OUT_MAX_CHANNELS];
+	int blockBytes = SPATIAL_BLOCK * is->audio_frame_bytes;
+	int dry = 0;
 
-// This does some sync-ing stuff, copies the image into pixelBuffer,
-// decrements the picture queue size
-// and lets queue_picture() know that there's a free spot in the queue.
-//
-// This gets called in the main thread after an FF_REFRESH_EVENT.
-void video_refresh_timer(void *userdata) {
-
-	VideoState *is = (VideoState *)userdata;
-	VideoPicture *vp;
-	double actual_delay, delay, sync_threshold, ref_clock, diff;
-
-	if(is->video_st) {
-		if(is->pictq_size == 0) {
-			schedule_refresh(is, 10);
-
-		} else {
-			vp = &is->pictq[is->pictq_rindex];
-
-			is->video_current_pts = vp->pts;
-			is->video_current_pts_time = av_gettime();
+	while(len > 0) {
+		int n;
 
-			delay = vp->pts - is->frame_last_pts; /* the pts from last time */
+		if(is->spatial_out_pos == sizeof(is->spatial_out)) {
+			int got = pcm_ring_read(&is->audio_ring, (Uint8 *)block, blockBytes);
+			Uint64 start;
 
-			if(delay <= 0 || delay >= 1.0) {
-				/* if incorrect delay, use previous one */
-				delay = is->frame_last_delay;
+			if(got < blockBytes) {
+				memset((uint8_t *)block + got, 0, blockBytes - got);
+				dry = 1;
 			}
 
-			/* save for next time */
-			is->frame_last_delay = delay;
-			is->frame_last_pts = vp->pts;
-
-			/* update delay to sync to audio if not master source */
-			if(is->av_sync_type != AV_SYNC_VIDEO_MASTER) {
-				ref_clock = get_master_clock(is);
-				diff = vp->pts - ref_clock;
+			start = metric_time_begin();
+			spatial_render(is->spatial, is->spatial_out, block);
+			metric_time_end(metrics.spatial, start);
+			is->spatial_out_pos = 0;
+		}
 
-				/* Skip or repeat the frame. Take delay into account
-				   FFPlay still doesn't "know if this is the best guess." */
-				sync_threshold = (delay > AV_SYNC_THRESHOLD) ? delay : AV_SYNC_THRESHOLD;
+		n = FFMIN(len, (int)sizeof(is->spatial_out) - is->spatial_out_pos);
+		memcpy(stream, (uint8_t *)is->spatial_out + is->spatial_out_pos, n);
+		is->spatial_out_pos += n;
+		stream += n;
+		len -= n;
+	}
 
-				if(fabs(diff) < AV_NOSYNC_THRESHOLD) {
-					if(diff <= -sync_threshold) {
-						delay = 0;
+	if(dry) {
+		audio_ran_dry(is);
+	}
+}
 
-					} else if(diff >= sync_threshold) {
-						delay = 2 * delay;
-					}
-				}
-			}
+// Hands what's about to go to the device to the tap, if there is one.
+// The lock's only ever held for as long as it takes to swap the pointers.
+static void audio_tap_call(VideoState *is, const Uint8 *stream, int len) {
+	VideoAudioTap tap;
+	void *opaque;
+	int isFloat = is->spatial || is->audio_out_fmt == AV_SAMPLE_FMT_FLT;
+	int channels = is->spatial ? 2 : is->audio_out_channels;
+	int frameBytes = channels * (isFloat ? sizeof(float) : sizeof(int16_t));
+	int frames = len / frameBytes;
+
+	SDL_AtomicLock(&is->audio_tap_lock);
+	tap = is->audio_tap;
+	opaque = is->audio_tap_opaque;
+	SDL_AtomicUnlock(&is->audio_tap_lock);
+
+	if(tap) {
+		tap(opaque, stream, frames, channels, isFloat, is->audio_out_rate,
+			video_get_time() + is->audio_latency - frames / (double)is->audio_out_rate);
+	}
+}
 
-			is->frame_timer += delay;
-			/* computer the REAL delay */
-			actual_delay = is->frame_timer - (av_gettime() / 1000000.0);
+// Runs on SDL's audio thread, which mustn't wait for anything, so all it
+// does is copy out what audio_thread has decoded.
+void audio_callback(void *userdata, Uint8 *stream, int len) {
 
-			if(actual_delay < 0.010) {
-				/* Really it should skip the picture instead */
-				actual_delay = 0.010;
-			}
+	VideoState *is = (VideoState *)userdata;
+	int got, held = 0;
 
-			// Since the callback tends to happen a bit later than requested,
-			// add a 5ms fudge factor.
-			const int fudge = -5;
-			schedule_refresh(is, (int)(actual_delay * 1000 + 0.5 + fudge));
-			/* show the picture! */
-			memcpy(pixelBuffer, is->pictq[is->pictq_rindex].bmp, vp->width* vp->height*4);
+	TRACE_THREAD_NAME("audio_callback");
+	TRACE_SCOPE("audio_callback");
 
-			/* update queue for next picture! */
-			if(++is->pictq_rindex == VIDEO_PICTURE_QUEUE_SIZE) {
-				is->pictq_rindex = 0;
-			}
+	if(is->spatial) {
+		audio_callback_spatial(is, stream, len);
+	} else {
+		got = pcm_ring_read(&is->audio_ring, stream, len);
 
-			SDL_LockMutex(is->pictq_mutex);
-			is->pictq_size--;
-			SDL_CondSignal(is->pictq_cond);
-			SDL_UnlockMutex(is->pictq_mutex);
+		if(got < len) {
+			memset(stream + got, 0, len - got);
+			audio_ran_dry(is);
 		}
+	}
+	audio_ring_wake(is);
 
-	} else {
-		schedule_refresh(is, 100);
+	audio_tap_call(is, stream, len);
+
+	// Stereo float frames of the last spatial block the device hasn't
+	// had yet, as ring bytes.
+	if(is->spatial) {
+		held = (int)((sizeof(is->spatial_out) - is->spatial_out_pos) / (2 * sizeof(float))) * is->audio_frame_bytes;
 	}
+	audio_played(is, len, held);
+	metric_set(metrics.audio_ring, pcm_ring_fill(&is->audio_ring) * 1000.0 / is->audio_bytes_per_sec);
 }
 
-void alloc_picture(VideoState *is) {
-
-	VideoPicture *vp;
+// Gives back the device and what was set up to feed it, for when the
+// audio stream can't be played after all. Before audio_thread starts.
+static void audio_device_close(VideoState *is) {
+	SDL_CloseAudioDevice(is->audio_dev);
+	is->audio_dev = 0;
+	spatial_destroy(is->spatial);
+	is->spatial = NULL;
+	pcm_ring_destroy(&is->audio_ring);
+	is->audio_bytes_per_sec = 0;
+}
 
-	for(size_t i = 0; i < VIDEO_PICTURE_QUEUE_SIZE; i++) {
-		vp = &is->pictq[i];
-		vp->width = is->video_st->codec->width;
-		vp->height = is->video_st->codec->height;
-		vp->bmp = (unsigned char*)malloc(vp->width * vp->height * 4);
-		vp->allocated = 1;
+// Gives up the picture at pictq_rindex without showing it. Its slot
+// never got a display reference so queue_picture() can reuse it straight
+// away. Called with pictq_mutex held.
+static void drop_picture(VideoState *is) {
+	if(++is->pictq_rindex == VIDEO_PICTURE_QUEUE_SIZE) {
+		is->pictq_rindex = 0;
 	}
+	is->pictq_size--;
+	SDL_CondSignal(is->pictq_cond);
 
-	pixelBuffer = (unsigned char*)malloc(vp->width * vp->height * 4);
+	SDL_AtomicAdd(&is->frames_dropped, 1);
 }
 
+// Makes the picture at pictq_rindex the one on screen and drops the
+// display reference on the previous one so queue_picture() can reuse its
+// slot once the renderer has let go of it too. Called with pictq_mutex
+// held.
+static void show_picture(VideoState *is) {
+	if(!is->time_to_first_frame) {
+		is->time_to_first_frame = (av_gettime() - is->open_time) / 1000.0;
+		printf("Time to first frame: %.1f ms%s, stream info %s in %.1f ms\n", is->time_to_first_frame,
+			   (is->flags & VIDEO_OPEN_PAUSED) ? " after video_start()" : "",
+			   is->stream_info_cached ? "from the cache" : "probed", is->stream_info_time);
+	}
 
-// This waits until the picture queue isn't full then
-// copies the video frame into the texture.
-// It somehow lets the display thread know that there is
-// a picture ready via is->pictq_windex.
-int queue_picture(VideoState *is, AVFrame *pFrame, double pts) {
-	VideoPicture *vp;
-	AVPicture pict;
+	// The first picture since a seek's flush, so the seek is done.
+	if(is->seek_flushed && is->seek_request_time) {
+		double latency = (av_gettime() - is->seek_request_time) / 1000.0;
 
-	/* wait until we have space for a new pic */
-	SDL_LockMutex(is->pictq_mutex);
-	while(is->pictq_size >= VIDEO_PICTURE_QUEUE_SIZE && g_running) {
-		SDL_CondWait(is->pictq_cond, is->pictq_mutex);
+		is->seeks++;
+		is->seek_latency_last = latency;
+		if(latency > is->seek_latency_max) {
+			is->seek_latency_max = latency;
+		}
+		is->seek_request_time = 0;
+		is->seek_flushed = 0;
+		printf("Seek: first picture at %.2f s after %.1f ms\n", is->pictq[is->pictq_rindex].pts, latency);
 	}
-	SDL_UnlockMutex(is->pictq_mutex);
 
-	if(!g_running)
-		return -1;
+	if(is->pictq_shown >= 0) {
+		is->pictq[is->pictq_shown].refs--;
+	}
+	is->pictq[is->pictq_rindex].refs++;
+	is->pictq_shown = is->pictq_rindex;
+	is->frame_serial++;
 
-	// windex vidState set to 0 initially
-	vp = &is->pictq[is->pictq_windex];
+	/* update queue for next picture! */
+	if(++is->pictq_rindex == VIDEO_PICTURE_QUEUE_SIZE) {
+		is->pictq_rindex = 0;
+	}
 
-	/* We have a place to put our picture on the queue */
-	/* If we are skipping a frame, do we set this to null
-	 but still return vp->allocated = 1? */
+	is->pictq_size--;
+	SDL_CondSignal(is->pictq_cond);
 
+	SDL_AtomicAdd(&is->frames_shown, 1);
+}
 
-	// Get frame pixels into pict.data
-	int w = is->video_st->codec->width;
-	int h = is->video_st->codec->height;
+// Time a queued picture should go on screen, on the video_get_time()
+// clock. is->frame_timer is when the picture on screen was due.
+static double picture_due_time(VideoState *is, VideoPicture *vp, double *delay_out) {
+	double delay, sync_threshold, ref_clock, diff;
 
-	avpicture_fill(&pict, vp->bmp, AV_PIX_FMT_BGRA, w, h);
+	delay = vp->pts - is->frame_last_pts; /* the pts from last time */
 
-	sws_scale(is->sws_ctx, (const uint8_t * const *)pFrame->data,
-			  pFrame->linesize, 0, h,
-			  pict.data, pict.linesize);
+	if(delay <= 0 || delay >= 1.0) {
+		/* if incorrect delay, use previous one */
+		delay = is->frame_last_delay;
+	}
+	*delay_out = delay;
 
-	vp->pts = pts;
+	/* update delay to sync to audio if it's the master source. The
+	   external clock follows the pictures, see get_external_clock(), so
+	   there's nothing to correct against that */
+	if(is->av_sync_type == AV_SYNC_AUDIO_MASTER) {
+		ref_clock = get_master_clock(is);
+		diff = vp->pts - ref_clock;
 
+		/* Skip or repeat the frame. Take delay into account
+		   FFPlay still doesn't "know if this is the best guess." */
+		sync_threshold = (delay > AV_SYNC_THRESHOLD) ? delay : AV_SYNC_THRESHOLD;
 
-	// now we inform our display thread that we have a pic ready
-	if(++is->pictq_windex == VIDEO_PICTURE_QUEUE_SIZE) {
-		is->pictq_windex = 0;
+		if(fabs(diff) < AV_NOSYNC_THRESHOLD) {
+			if(diff <= -sync_threshold) {
+				delay = 0;
+
+			} else if(diff >= sync_threshold) {
+				delay = 2 * delay;
+			}
+		}
 	}
-	SDL_LockMutex(is->pictq_mutex);
-	is->pictq_size++;
-	SDL_UnlockMutex(is->pictq_mutex);
 
-	return 0;
+	return is->frame_timer + delay;
+}
+
+// Picks the picture for a frame that will be on screen at displayTime.
+// A picture goes up on the render frame nearest to when it's due, so
+// it's shown once that's less than half a render interval away. If more
+// than one queued picture is due by then only the last of them is shown
+// and the rest are dropped.
+//
+// This gets called from the render loop before it acquires the frame.
+void video_refresh(VideoState *is, double displayTime) {
+	VideoPicture *vp;
+	double delay, due, error;
+
+	TRACE_SCOPE("video_refresh");
+
+	if(is->last_display_time > 0) {
+		double interval = displayTime - is->last_display_time;
+		if(interval > 0 && interval < 0.1) {
+			is->display_interval += (interval - is->display_interval) * 0.1;
+		}
+	}
+	is->last_display_time = displayTime;
+
+	if(!is->video_st) {
+		return;
+	}
+
+	// Held throughout so video_thread can't flush the queue under us.
+	SDL_LockMutex(is->pictq_mutex);
+
+	if(is->flags & VIDEO_OPEN_UNTIMED) {
+		// The timeout covers the end of the file, which doesn't signal.
+		while(is->pictq_size == 0 && !SDL_AtomicGet(&is->video_eof) && !SDL_AtomicGet(&is->quit)) {
+			SDL_CondWaitTimeout(is->pictq_cond, is->pictq_mutex, 10);
+		}
+		if(is->pictq_size > 0) {
+			is->video_current_pts = is->pictq[is->pictq_rindex].pts;
+			is->video_current_pts_time = av_gettime();
+			show_picture(is);
+		}
+		SDL_UnlockMutex(is->pictq_mutex);
+		return;
+	}
+
+	while(is->pictq_size > 0) {
+		vp = &is->pictq[is->pictq_rindex];
+		due = picture_due_time(is, vp, &delay);
+
+		if(due > displayTime + is->display_interval / 2) {
+			break;
+		}
+
+		/* save for next time */
+		is->frame_last_delay = delay;
+		is->frame_last_pts = vp->pts;
+		is->frame_timer = due;
+
+		// Too far behind to catch up, start timing again from now rather
+		// than rushing through the next pictures.
+		if(due < displayTime - AV_SYNC_RESET_THRESHOLD) {
+			is->frame_timer = displayTime;
+		}
+
+		// If the next picture is due by then as well there's no point
+		// showing this one.
+		if(is->pictq_size > 1) {
+			int next = (is->pictq_rindex + 1) % VIDEO_PICTURE_QUEUE_SIZE;
+			double nextDue = picture_due_time(is, &is->pictq[next], &delay);
+
+			if(nextDue <= displayTime + is->display_interval / 2) {
+				drop_picture(is);
+				continue;
+			}
+		}
+
+		is->video_current_pts = vp->pts;
+		is->video_current_pts_time = av_gettime();
+		external_clock_set(is, vp->pts, is->frame_timer);
+
+		// Where the audio will be when this picture is seen.
+		if(is->audio_st) {
+			double audioAtDisplay = get_audio_clock(is) + displayTime - video_get_time();
+			is->av_offset = vp->pts - audioAtDisplay;
+			metric_set(metrics.av_drift, is->av_offset * 1000);
+		}
+
+		error = displayTime - due;
+		if(error > is->display_interval / 2) {
+			SDL_AtomicAdd(&is->frames_late, 1);
+		}
+
+		int bucket = (int)(fabs(error) * 1000);
+		is->jitter_histogram[bucket < JITTER_HISTOGRAM_SIZE ? bucket : JITTER_HISTOGRAM_SIZE]++;
+		if(fabs(error) > is->jitter_max) {
+			is->jitter_max = fabs(error);
+		}
+
+		show_picture(is);
+		break;
+	}
+
+	metric_set(metrics.pictq, is->pictq_size);
+	SDL_UnlockMutex(is->pictq_mutex);
+
+	metric_set(metrics.videoq, SDL_AtomicGet(&is->videoq.nb_packets));
+	metric_set(metrics.audioq, SDL_AtomicGet(&is->audioq.nb_packets));
+}
+
+double video_get_time() {
+	return av_gettime() / 1000000.0;
+}
+
+void alloc_picture(VideoState *is) {
+
+	VideoPicture *vp;
+
+	for(size_t i = 0; i < VIDEO_PICTURE_QUEUE_SIZE; i++) {
+		vp = &is->pictq[i];
+		vp->width = is->video_st->codec->width;
+		vp->height = is->video_st->codec->height;
+		vp->frame = av_frame_alloc();
+		vp->allocated = 1;
+		vp->refs = 0;
+
+		if(is->planar_passthrough) {
+			// Planes get filled in from the decoder's frame by queue_picture.
+			vp->bmp = NULL;
+
+		} else if(is->plane_count == 3) {
+			// Converted to YUV420P, each plane and row FRAME_ALIGN aligned.
+			int cw = (vp->width + 1) / 2;
+			int ch = (vp->height + 1) / 2;
+			vp->pitches[0] = FFALIGN(vp->width, FRAME_ALIGN);
+			vp->pitches[1] = vp->pitches[2] = FFALIGN(cw, FRAME_ALIGN);
+			vp->bmp = frame_buffer_alloc(vp->pitches[0] * vp->height + 2 * vp->pitches[1] * ch);
+			vp->planes[0] = vp->bmp;
+			vp->planes[1] = vp->bmp + vp->pitches[0] * vp->height;
+			vp->planes[2] = vp->planes[1] + vp->pitches[1] * ch;
+
+		} else {
+			vp->pitches[0] = FFALIGN(vp->width * 4, FRAME_ALIGN);
+			vp->bmp = frame_buffer_alloc(vp->pitches[0] * vp->height);
+			vp->planes[0] = vp->bmp;
+		}
+	}
+}
+
+
+// This waits until the picture queue isn't full and the next slot
+// isn't on screen or borrowed by the renderer, then converts the
+// video frame into it.
+// It somehow lets the display thread know that there is
+// a picture ready via is->pictq_windex.
+int queue_picture(VideoState *is, AVFrame *pFrame, double pts) {
+	VideoPicture *vp;
+
+	TRACE_SCOPE("queue_picture");
+
+	/* wait until we have space for a new pic */
+	SDL_LockMutex(is->pictq_mutex);
+	while((is->pictq_size >= VIDEO_PICTURE_QUEUE_SIZE
+			|| is->pictq[is->pictq_windex].refs > 0) && !SDL_AtomicGet(&is->quit)) {
+		SDL_CondWait(is->pictq_cond, is->pictq_mutex);
+	}
+	SDL_UnlockMutex(is->pictq_mutex);
+
+	if(SDL_AtomicGet(&is->quit))
+		return -1;
+
+	// windex vidState set to 0 initially
+	vp = &is->pictq[is->pictq_windex];
+
+	/* We have a place to put our picture on the queue */
+	/* If we are skipping a frame, do we set this to null
+	 but still return vp->allocated = 1? */
+
+
+	// Get frame pixels into the picture's planes
+	if(is->planar_passthrough) {
+		// Keep the decoder's reference to the frame rather than copying it,
+		// the renderer uploads the planes straight out of it.
+		av_frame_unref(vp->frame);
+		av_frame_move_ref(vp->frame, pFrame);
+
+		for(int i = 0; i < is->plane_count; i++) {
+			vp->planes[i] = vp->frame->data[i];
+			vp->pitches[i] = vp->frame->linesize[i];
+		}
+
+	} else {
+		uint8_t *planes[3] = { vp->bmp, (uint8_t*)vp->planes[1], (uint8_t*)vp->planes[2] };
+
+		TRACE_SCOPE("frame_convert");
+		Uint64 convertStart = metric_time_begin();
+		frame_convert(is->converter, (const uint8_t * const *)pFrame->data,
+					  pFrame->linesize, planes, vp->pitches);
+		metric_time_end(metrics.convert, convertStart);
+	}
+
+	vp->pts = pts;
+
+
+	// now we inform our display thread that we have a pic ready
+	if(++is->pictq_windex == VIDEO_PICTURE_QUEUE_SIZE) {
+		is->pictq_windex = 0;
+	}
+	SDL_LockMutex(is->pictq_mutex);
+	is->pictq_size++;
+	if(is->flags & VIDEO_OPEN_UNTIMED) {
+		// video_refresh() may be waiting for it.
+		SDL_CondBroadcast(is->pictq_cond);
+	}
+	SDL_UnlockMutex(is->pictq_mutex);
+
+	return 0;
 }
 
 double synchronize_video(VideoState *is, AVFrame *src_frame, double pts) {
@@ -768,21 +1367,50 @@ double synchronize_video(VideoState *is, AVFrame *src_frame, double pts) {
 	return pts;
 }
 
-uint64_t global_video_pkt_pts = AV_NOPTS_VALUE;
 
-/* These are called whenever we allocate a frame
- * buffer. We use this to store the global_pts in
- * a frame at the time it is allocated.
- */
+// True if a frame is so late that it's not worth converting and queueing.
+// The clock it's compared against is the one the refresh is paced by: the
+// audio clock if that's master, otherwise the picture on screen plus the
+// time it's been up.
+static int frame_is_hopelessly_late(VideoState *is, double pts) {
+	double diff;
+	int seeking;
 
-int our_get_buffer(struct AVCodecContext *c, AVFrame *pic, int flags) {
-	int ret = avcodec_default_get_buffer2(c, pic, flags);
-	uint64_t *pts = (uint64_t*)av_malloc(sizeof(uint64_t));
-	*pts = global_video_pkt_pts;
-	pic->opaque = pts;
-	return ret;
+	if(is->flags & VIDEO_OPEN_UNTIMED) {
+		return 0;
+	}
+
+	// Nothing is late until the first picture since a seek is up, the
+	// clock is still running from the old position.
+	SDL_LockMutex(is->pictq_mutex);
+	seeking = (is->seek_request_time != 0);
+	SDL_UnlockMutex(is->pictq_mutex);
+
+	if(is->pictq_shown < 0 || seeking || is->early_drops_in_row >= EARLY_DROP_MAX_IN_ROW) {
+		return 0;
+	}
+
+	if(is->av_sync_type == AV_SYNC_AUDIO_MASTER) {
+		diff = pts - get_audio_clock(is);
+	} else {
+		diff = pts - get_video_clock(is);
+	}
+
+	return diff < -EARLY_DROP_THRESHOLD && diff > -AV_NOSYNC_THRESHOLD;
 }
 
+// Throws away the pictures waiting to be shown after a seek. The one on
+// screen stays up until the first picture from the new position.
+static void pictq_flush(VideoState *is) {
+	SDL_LockMutex(is->pictq_mutex);
+	is->pictq_rindex = is->pictq_windex;
+	is->pictq_size = 0;
+	is->seek_flushed = 1;
+	SDL_CondSignal(is->pictq_cond);
+	SDL_UnlockMutex(is->pictq_mutex);
+
+	is->early_drops_in_row = 0;
+}
 
 // This thread does the video decoding. It has an infinite loop where
 // it gets packets from the video queue, decodes them and puts them
@@ -795,53 +1423,144 @@ int video_thread(void *arg) {
 	int frameFinished;
 	AVFrame *pFrame;
 	double pts;
+	int eof, ret = 0;
 
 	pFrame = av_frame_alloc();
+	TRACE_THREAD_NAME("video_thread");
 
-	for(;;) {
+	while(ret >= 0) {
 		if(packet_queue_get(&is->videoq, packet, 1) < 0) {
 			// means we quit getting packets
 			break;
 		}
 
-		pts = 0;
-
-		// Save global pts to be stored in pFrame in first call
-		global_video_pkt_pts = packet->pts;
-		// Decode video frame
-		avcodec_decode_video2(is->video_st->codec, pFrame, &frameFinished,
-							  packet);
+		if(packet_is_flush(packet)) {
+			avcodec_flush_buffers(is->video_st->codec);
+			pictq_flush(is);
+			SDL_AtomicSet(&is->video_eof, 0);
+			continue;
+		}
 
-		if(packet->dts == AV_NOPTS_VALUE
-				&& pFrame->opaque && *(uint64_t*)pFrame->opaque != AV_NOPTS_VALUE) {
-			pts = double(*(uint64_t *)pFrame->opaque);
+		// An empty packet marks the end of the file. Decoding it gets back
+		// the frames the decoder is still holding on to, one per call.
+		eof = !packet->data;
+
+		do {
+			// Decode video frame
+			Uint64 decodeStart = metric_time_begin();
+			{
+				TRACE_SCOPE("avcodec_decode_video2");
+				avcodec_decode_video2(is->video_st->codec, pFrame, &frameFinished,
+									  packet);
+			}
+			metric_time_end(metrics.decode_video, decodeStart);
 
-		} else if(packet->dts != AV_NOPTS_VALUE) {
-//			pts = double(packet->dts);
-			pts = double(av_frame_get_best_effort_timestamp(pFrame));
+			// The decoder carries the packet timestamps through to the frame
+			// they ended up in, reordering included.
+			int64_t frame_pts = av_frame_get_best_effort_timestamp(pFrame);
+			if(frame_pts == AV_NOPTS_VALUE) {
+				frame_pts = pFrame->pkt_pts;
+			}
 
-		} else {
-			pts = 0;
-		}
+			pts = (frame_pts != AV_NOPTS_VALUE) ? double(frame_pts) : 0;
+			pts *= av_q2d(is->video_st->time_base);
 
-		pts *= av_q2d(is->video_st->time_base);
+			// Did we get a video frame?
+			if(frameFinished) {
+				pts = synchronize_video(is, pFrame, pts);
 
-		// Did we get a video frame?
-		if(frameFinished) {
-			pts = synchronize_video(is, pFrame, pts);
+				if(frame_is_hopelessly_late(is, pts)) {
+					SDL_AtomicAdd(&is->frames_dropped_early, 1);
+					is->early_drops_in_row++;
 
-			if(queue_picture(is, pFrame, pts) < 0) {
-				break;
+				} else {
+					is->early_drops_in_row = 0;
+					ret = queue_picture(is, pFrame, pts);
+				}
 			}
-		}
+		} while(eof && frameFinished && ret >= 0);
 
+		if(eof) {
+			SDL_AtomicSet(&is->video_eof, 1);
+		}
 		av_free_packet(packet);
 	}
-	av_free(pFrame);
+	av_frame_free(&pFrame);
 	return 0;
 }
 
 
+// The decoder output is the same size as the picture, so it's a pure
+// colour conversion, split into bands across is->conv_pool. For RGBA
+// output the common 4:2:0 formats go through our own SIMD kernels,
+// anything else through swscale. For YUV output 4:2:0 frames are passed
+// through as they are and the shader does the conversion, anything else
+// is converted to YUV420P first.
+static void setup_colour_conversion(VideoState *is, AVCodecContext *codecCtx) {
+	YuvMatrix matrix;
+	int fullRange;
+	int yuv420 = (codecCtx->pix_fmt == AV_PIX_FMT_YUV420P
+				  || codecCtx->pix_fmt == AV_PIX_FMT_YUVJ420P
+				  || codecCtx->pix_fmt == AV_PIX_FMT_NV12);
+
+	// Untagged streams are assumed BT.709 if they're HD, like most players do.
+	if(codecCtx->colorspace == AVCOL_SPC_BT709) {
+		matrix = YUV_MATRIX_BT709;
+
+	} else if(codecCtx->colorspace == AVCOL_SPC_BT470BG
+			  || codecCtx->colorspace == AVCOL_SPC_SMPTE170M) {
+		matrix = YUV_MATRIX_BT601;
+
+	} else {
+		matrix = (codecCtx->height >= 720) ? YUV_MATRIX_BT709 : YUV_MATRIX_BT601;
+	}
+
+	fullRange = (codecCtx->color_range == AVCOL_RANGE_JPEG
+				 || codecCtx->pix_fmt == AV_PIX_FMT_YUVJ420P);
+
+	yuv_get_coeffs(matrix, fullRange, &is->yuv_coeffs);
+
+	if(is->output_format == VIDEO_OUTPUT_YUV) {
+		is->planar_passthrough = yuv420;
+		if(yuv420) {
+			is->plane_count = (codecCtx->pix_fmt == AV_PIX_FMT_NV12) ? 2 : 3;
+			// The pictq holds on to the decoder's frames instead of copying them.
+			codecCtx->refcounted_frames = 1;
+
+			printf("Colour conversion: shader, %s %s range\n",
+				   (matrix == YUV_MATRIX_BT709) ? "BT.709" : "BT.601", fullRange ? "full" : "limited");
+			return;
+		}
+
+		is->plane_count = 3;
+		is->conv_dst_fmt = AV_PIX_FMT_YUV420P;
+
+	} else {
+		is->plane_count = 1;
+		is->conv_dst_fmt = AV_PIX_FMT_RGBA;
+	}
+
+	is->conv_pool = worker_pool_create(conversion_threads > 0 ? conversion_threads : SDL_GetCPUCount());
+	is->converter = frame_converter_create(is->conv_pool, codecCtx->width, codecCtx->height,
+										   codecCtx->pix_fmt, is->conv_dst_fmt, &is->yuv_coeffs);
+
+	printf("Colour conversion: %s to %s, %d bands, %s %s range\n",
+		   frame_converter_name(is->converter), av_get_pix_fmt_name(is->conv_dst_fmt),
+		   frame_converter_bands(is->converter),
+		   (matrix == YUV_MATRIX_BT709) ? "BT.709" : "BT.601", fullRange ? "full" : "limited");
+}
+
+// The stream's channel layout. Some files don't say, e.g. MP3 and WAV.
+static uint64_t audio_stream_layout(AVCodecContext *codecCtx) {
+	uint64_t layout = codecCtx->channel_layout;
+
+	if(!layout || av_get_channel_layout_nb_channels(layout) != codecCtx->channels) {
+		layout = av_get_default_channel_layout(codecCtx->channels);
+	}
+	return layout;
+}
+
+
 // This gets called once for the audio stream and once for the video stream.
 // It sorts out codecs, starts SDL audio stuff and starts video_thread which
 // does the actual decoding of packets on the video queue.
@@ -862,27 +1581,95 @@ int stream_component_open(VideoState *is, int stream_index) {
 	codecCtx = pFormatCtx->streams[stream_index]->codec;
 
 	if(codecCtx->codec_type == AVMEDIA_TYPE_AUDIO) {
-		// Set audio settings from codec info
+		// Set audio settings from codec info. 16 bit codecs get a 16 bit
+		// device and everything else float, see AudioPath.
+		enum AVSampleFormat codecFmt = av_get_packed_sample_fmt(codecCtx->sample_fmt);
+		int channels = codecCtx->channels;
 		wanted_spec.freq = codecCtx->sample_rate; // Resampling to this
-		wanted_spec.format = AUDIO_S16SYS;
-		wanted_spec.channels = 2;  // Resampling to this
+		wanted_spec.format = (codecFmt == AV_SAMPLE_FMT_S16) ? AUDIO_S16SYS : AUDIO_F32SYS;
+		// The stream's own channels where SDL has a layout for them. Odd
+		// counts go up to the next one, with the missing channels silent.
+		wanted_spec.channels = channels >= 7 ? 8 : channels >= 5 ? 6 : channels >= 3 ? 4 : channels == 1 ? 1 : 2;
+		// Spatial audio is always float stereo for headphones.
+		if(spatial_audio) {
+			wanted_spec.format = AUDIO_F32SYS;
+			wanted_spec.channels = 2;
+		}
 		wanted_spec.silence = 0;
-		wanted_spec.samples = SDL_AUDIO_BUFFER_SIZE;
+		wanted_spec.samples = audio_period;
 		wanted_spec.callback = audio_callback;
 		wanted_spec.userdata = is;
 
-		if(SDL_OpenAudio(&wanted_spec, &spec) < 0) {
-			fprintf(stderr, "SDL_OpenAudio: %s\n", SDL_GetError());
-			return -1;
+		// The device can come back with fewer channels than asked for, and
+		// the rest get mixed down into them. Older SDLs can't open 8 at
+		// all, so it falls back through 6 to stereo. A count there's no
+		// layout for is reopened as plain stereo.
+		for(;;) {
+			int allowed = (wanted_spec.channels > 2) ? SDL_AUDIO_ALLOW_CHANNELS_CHANGE : 0;
+
+			is->audio_dev = SDL_OpenAudioDevice(NULL, 0, &wanted_spec, &spec, allowed);
+			if(is->audio_dev && audio_device_layout(spec.channels)) {
+				break;
+			}
+			if(is->audio_dev) {
+				SDL_CloseAudioDevice(is->audio_dev);
+				is->audio_dev = 0;
+			} else if(wanted_spec.channels <= 2) {
+				fprintf(stderr, "SDL_OpenAudioDevice: %s\n", SDL_GetError());
+				return -1;
+			}
+			wanted_spec.channels = (wanted_spec.channels > 6) ? 6 : 2;
 		}
 
 		is->audio_hw_buf_size = spec.size;
+		is->audio_callback_interval = spec.samples / (double)spec.freq;
+		is->audio_latency_set = audio_latency >= 0;
+		is->audio_latency = is->audio_latency_set ? audio_latency
+							: AUDIO_DEVICE_PERIODS * spec.samples / (double)spec.freq;
+		printf("Audio: %d frames per callback, %.1f ms output latency%s\n", spec.samples,
+			   is->audio_latency * 1000, is->audio_latency_set ? "" : " estimated");
+		is->audio_out_fmt = (spec.format == AUDIO_F32SYS) ? AV_SAMPLE_FMT_FLT : AV_SAMPLE_FMT_S16;
+		is->audio_out_channels = spec.channels;
+		is->audio_out_layout = audio_device_layout(spec.channels);
+		is->audio_frame_bytes = spec.channels * SDL_AUDIO_BITSIZE(spec.format) / 8;
+		is->audio_out_rate = spec.freq;
+		is->audio_bytes_per_sec = spec.freq * spec.channels * SDL_AUDIO_BITSIZE(spec.format) / 8;
+		is->audio_dev_bytes_per_sec = is->audio_bytes_per_sec;
+
+		// With spatial audio the ring holds float in the stream's own
+		// layout, up to 7.1, for the callback to render.
+		if(spatial_audio && spec.format == AUDIO_F32SYS && spec.channels == 2) {
+			uint64_t layout = audio_stream_layout(codecCtx);
+
+			if(av_get_channel_layout_nb_channels(layout) > AUDIO_OUT_MAX_CHANNELS) {
+				layout = audio_device_layout(AUDIO_OUT_MAX_CHANNELS);
+			}
+			is->spatial = spatial_create(layout, spec.freq);
+			if(is->spatial) {
+				is->spatial_out_pos = sizeof(is->spatial_out);
+				is->audio_out_layout = layout;
+				is->audio_out_channels = av_get_channel_layout_nb_channels(layout);
+				is->audio_frame_bytes = is->audio_out_channels * sizeof(float);
+				is->audio_bytes_per_sec = spec.freq * is->audio_frame_bytes;
+			}
+		}
+		pcm_ring_init(&is->audio_ring, (int)(is->audio_bytes_per_sec * AUDIO_RING_SECONDS));
 	}
 
 	codec = avcodec_find_decoder(codecCtx->codec_id);
 
+	if(codec && codecCtx->codec_type == AVMEDIA_TYPE_VIDEO) {
+		is->frame_pool = frame_pool_create();
+		frame_pool_attach(is->frame_pool, codecCtx, codec);
+	}
+
 	if(!codec || (avcodec_open2(codecCtx, codec, &optionsDict) < 0)) {
 		fprintf(stderr, "Unsupported codec!\n");
+
+		// The device was opened to know what to decode to, give it back.
+		if(codecCtx->codec_type == AVMEDIA_TYPE_AUDIO) {
+			audio_device_close(is);
+		}
 		return -1;
 	}
 
@@ -890,46 +1677,38 @@ int stream_component_open(VideoState *is, int stream_index) {
 		case AVMEDIA_TYPE_AUDIO:
 			is->audioStream = stream_index;
 			is->audio_st = pFormatCtx->streams[stream_index];
-			is->audio_buf_size = 0;
-			is->audio_buf_index = 0;
+			packet_queue_set_limits(&is->audioq, MAX_AUDIOQ_SIZE, MAX_AUDIOQ_SECONDS,
+									is->audio_st->time_base, &is->queue_space);
 
 			// averaging filter for audio sync
-			is->audio_diff_avg_coef = exp(log(0.01 / AUDIO_DIFF_AVG_NB));
-			is->audio_diff_avg_count = 0;
-			// Correct audio only if larger error than this
-			is->audio_diff_threshold = 2.0 * SDL_AUDIO_BUFFER_SIZE / codecCtx->sample_rate;
+			is->audio_diff_avg_coef = exp(log(0.01) / AUDIO_DIFF_AVG_NB);
+			audio_sync_reset(is);
 
 			memset(&is->audio_pkt, 0, sizeof(is->audio_pkt));
-			packet_queue_init(&is->audioq);
 
-			SDL_PauseAudio(0);
+			// Paused players start with video_start().
+			if(!(is->flags & VIDEO_OPEN_PAUSED)) {
+				SDL_PauseAudioDevice(is->audio_dev, 0);
+			}
 			break;
 
 		case AVMEDIA_TYPE_VIDEO:
 			is->videoStream = stream_index;
 			is->video_st = pFormatCtx->streams[stream_index];
+			packet_queue_set_limits(&is->videoq, MAX_VIDEOQ_SIZE, MAX_VIDEOQ_SECONDS,
+									is->video_st->time_base, &is->queue_space);
 
 			is->frame_timer = (double)av_gettime() / 1000000.0;
 			is->frame_last_delay = 40e-3;
 			is->video_current_pts_time = av_gettime();
 
-			packet_queue_init(&is->videoq);
+			keyframe_index_load(&is->keyframes, pFormatCtx, is->video_st);
+			if(is->keyframes.nb_entries > 0) {
+				printf("Keyframe index: %d keyframes from the container\n", is->keyframes.nb_entries);
+			}
+
+			setup_colour_conversion(is, codecCtx);
 			is->video_tid = SDL_CreateThread(video_thread, "video_thread", is);
-			is->sws_ctx =
-				sws_getContext
-				(
-					is->video_st->codec->width,
-					is->video_st->codec->height,
-					is->video_st->codec->pix_fmt,
-					is->video_st->codec->width,
-					is->video_st->codec->height,
-					AV_PIX_FMT_RGBA,
-					SWS_BILINEAR,
-					NULL,
-					NULL,
-					NULL
-				);
-			codecCtx->get_buffer2 = our_get_buffer;
 
 			break;
 
@@ -943,12 +1722,85 @@ int stream_component_open(VideoState *is, int stream_index) {
 
 // The ffmpeg functions which block routinely call this
 // function to see if they should quit or not.
-int decode_interrupt_cb(void* /*opaque*/) {
-	return (global_video_state && (!g_running));
+int decode_interrupt_cb(void *opaque) {
+	VideoState *is = (VideoState *)opaque;
+	return SDL_AtomicGet(&is->quit);
 }
 
 
 
+// Writes the file's stream cache entry now the first keyframe's position
+// is known, -1 if it never will be.
+static void save_stream_info(VideoState *is, int64_t firstKeyframePos) {
+	if(is->stream_description) {
+		stream_cache_store(stream_cache_path, is->filename, is->stream_description, firstKeyframePos);
+		av_freep(&is->stream_description);
+	}
+}
+
+// Seeks the demuxer to the keyframe at or before target (seconds) and
+// tells the decoders to flush. The keyframe index gives the exact
+// timestamp to seek to when it knows it, otherwise the demuxer searches.
+static void stream_seek(VideoState *is, double target) {
+	int stream = (is->videoStream >= 0) ? is->videoStream : is->audioStream;
+	AVStream *st = is->pFormatCtx->streams[stream];
+	int64_t ts = (int64_t)(target / av_q2d(st->time_base));
+	int64_t keyframe;
+	int indexed = 0;
+
+	if(stream == is->videoStream && keyframe_index_lookup(&is->keyframes, ts, &keyframe)) {
+		ts = keyframe;
+		indexed = 1;
+	}
+
+	if(av_seek_frame(is->pFormatCtx, stream, ts, AVSEEK_FLAG_BACKWARD) < 0) {
+		fprintf(stderr, "%s: error while seeking to %.2f s\n", is->filename, target);
+
+		SDL_LockMutex(is->pictq_mutex);
+		is->seek_request_time = 0;
+		SDL_UnlockMutex(is->pictq_mutex);
+		return;
+	}
+
+	keyframe_index_discontinuity(&is->keyframes);
+
+	if(!is->keyframe_seen) {
+		is->keyframe_seen = 1;
+		save_stream_info(is, -1);
+	}
+
+	if(is->audioStream >= 0) {
+		packet_queue_flush(&is->audioq);
+		audio_ring_wake(is);
+	}
+	if(is->videoStream >= 0) {
+		packet_queue_flush(&is->videoq);
+	}
+
+	printf("Seek to %.2f s using the %s\n", target, indexed ? "keyframe index" : "demuxer's search");
+}
+
+// True while decode_thread has nothing to do: the queues have enough in
+// them or it's at the end of the file, and there's no seek to do.
+static int decode_should_wait(VideoState *is, int eof) {
+	if(SDL_AtomicGet(&is->quit) || SDL_AtomicGet(&is->seek_req) || SDL_AtomicGet(&is->videoq.abort_request)) {
+		return 0;
+	}
+
+	if(eof) {
+		return 1;
+	}
+
+	// Each queue is checked on its own so a stream that's running low
+	// keeps getting packets even when the other one is full.
+	if(SDL_AtomicGet(&is->audioq.size) + SDL_AtomicGet(&is->videoq.size) > MAX_QUEUE_SIZE) {
+		return 1;
+	}
+
+	return (is->audioStream < 0 || packet_queue_is_full(&is->audioq))
+		   && (is->videoStream < 0 || packet_queue_is_full(&is->videoq));
+}
+
 // This thread opens the file. It finds the audio and video
 // streams, calls stream_component_open() on them, sets up
 // resampling. Then it runs in a loop reading the packets
@@ -958,32 +1810,88 @@ int decode_interrupt_cb(void* /*opaque*/) {
 int decode_thread(void *arg) {
 	VideoState *is = (VideoState *)arg;
 	AVPacket pkt1, *packet = &pkt1;
+	int eof = 0;
+
+	TRACE_THREAD_NAME("decode_thread");
 
 	// main decode loop
 	for(;;) {
-		if(!g_running) {
+		if(SDL_AtomicGet(&is->quit)) {
 			break;
 		}
 
-		// seek stuff goes here
-		if(is->audioq.size > MAX_AUDIOQ_SIZE ||
-				is->videoq.size > MAX_VIDEOQ_SIZE) {
-			SDL_Delay(10);
+		// The request is claimed before the target is read, so a
+		// video_seek() that comes in during stream_seek() sets it again
+		// and is done next time round rather than lost.
+		while(SDL_AtomicCAS(&is->seek_req, 1, 0)) {
+			SDL_MemoryBarrierAcquire();
+			stream_seek(is, is->seek_target);
+			eof = 0;
+		}
+
+		// Sleep until a consumer takes its queue back under its limits,
+		// or at the end of the file until there's a seek back into it.
+		// waiters is bumped before checking, so a get that makes space
+		// either happens before the check or sees us waiting and signals.
+		if(decode_should_wait(is, eof)) {
+			SDL_LockMutex(is->queue_space.mutex);
+			SDL_AtomicAdd(&is->queue_space.waiters, 1);
+			while(decode_should_wait(is, eof)) {
+				SDL_CondWait(is->queue_space.cond, is->queue_space.mutex);
+			}
+			SDL_AtomicAdd(&is->queue_space.waiters, -1);
+			SDL_UnlockMutex(is->queue_space.mutex);
 			continue;
 		}
 
-		if(av_read_frame(is->pFormatCtx, packet) < 0) {
-			if(is->pFormatCtx->pb->error == 0) {
+		Uint64 demuxStart = metric_time_begin();
+		int readResult;
+		{
+			TRACE_SCOPE("av_read_frame");
+			readResult = av_read_frame(is->pFormatCtx, packet);
+		}
+		metric_time_end(metrics.demux, demuxStart);
+
+		if(readResult < 0) {
+			if(!is->pFormatCtx->pb || is->pFormatCtx->pb->error == 0) {
 				// If end of stream, put packet with duration 0 on the audio queue
 				// to signal EOF to packet decode function.
-				packet->duration = 0;
-				packet_queue_put(&is->audioq, packet);
-				break;
+				if(is->audioStream >= 0) {
+					packet->duration = 0;
+					packet_queue_put(&is->audioq, packet);
+				}
+			}
+			// And an empty one on the video queue to drain the decoder.
+			if(is->videoStream >= 0) {
+				AVPacket empty;
+				av_init_packet(&empty);
+				empty.data = NULL;
+				empty.size = 0;
+				packet_queue_put(&is->videoq, &empty);
 			}
+			// A read error, or video_close() interrupting the read, stops
+			// reading the same as the end of the file does.
+			eof = 1;
+			continue;
 		}
 
 		// Is this a packet from the video stream?
 		if(packet->stream_index == is->videoStream) {
+			if(!is->keyframe_seen) {
+				// Nothing before the first keyframe can be decoded. The cache
+				// says where it is, so the packets before it go straight in
+				// the bin.
+				if(packet->flags & AV_PKT_FLAG_KEY) {
+					is->keyframe_seen = 1;
+					save_stream_info(is, packet->pos);
+
+				} else if(packet->pos >= 0 && packet->pos < is->first_keyframe_pos) {
+					av_free_packet(packet);
+					continue;
+				}
+			}
+
+			keyframe_index_add_packet(&is->keyframes, packet);
 			packet_queue_put(&is->videoq, packet);
 
 		} else if(packet->stream_index == is->audioStream) {
@@ -999,28 +1907,188 @@ int decode_thread(void *arg) {
 	return 0;
 }
 
-int video_initialize(const char *filepath) {
+void video_set_conversion_threads(int threads) {
+	conversion_threads = threads;
+}
+
+void video_set_read_ahead(int megabytes) {
+	read_ahead_window = megabytes * 1024 * 1024;
+}
+
+void video_set_audio_period(int frames) {
+	audio_period = 64;
+	while(audio_period < frames && audio_period < 8192) {
+		audio_period *= 2;
+	}
+}
+
+void video_set_audio_latency(double seconds) {
+	audio_latency = seconds;
+}
+
+void video_set_spatial_audio(int enable) {
+	spatial_audio = enable;
+}
+
+void video_set_fast_open(int enable) {
+	fast_open = enable;
+}
+
+void video_set_stream_cache(const char *path) {
+	av_strlcpy(stream_cache_path, path ? path : "", sizeof(stream_cache_path));
+}
+
+// True if the decoders have what they need to open for every audio and
+// video stream.
+static int stream_info_complete(AVFormatContext *fmt) {
+	for(unsigned int i = 0; i < fmt->nb_streams; i++) {
+		AVCodecContext *c = fmt->streams[i]->codec;
+
+		if(c->codec_type == AVMEDIA_TYPE_VIDEO && (c->width <= 0 || c->pix_fmt == AV_PIX_FMT_NONE)) {
+			return 0;
+		}
+		if(c->codec_type == AVMEDIA_TYPE_AUDIO
+				&& (c->sample_rate <= 0 || c->channels <= 0 || c->sample_fmt == AV_SAMPLE_FMT_NONE)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+// Fills in the streams from the cache if the file's in it, otherwise
+// probes. With fast open the probing is bounded, and only if that isn't
+// enough does it go again with libavformat's usual limits.
+static int find_stream_info(VideoState *is, AVFormatContext *fmt) {
+	int64_t start = av_gettime();
+	const char *cache = stream_cache_path[0] ? stream_cache_path : NULL;
+
+	is->first_keyframe_pos = -1;
+	is->stream_info_cached = stream_cache_apply(cache, is->filename, fmt, &is->first_keyframe_pos);
+
+	if(!is->stream_info_cached) {
+		if(avformat_find_stream_info(fmt, NULL) < 0) {
+			return -1;
+		}
+
+		if(fast_open && !stream_info_complete(fmt)) {
+			printf("Fast open: stream info incomplete, probing again\n");
+			fmt->probesize = DEFAULT_PROBESIZE;
+			fmt->max_analyze_duration = (int)(DEFAULT_ANALYZE_DURATION * AV_TIME_BASE);
+			if(avformat_find_stream_info(fmt, NULL) < 0) {
+				return -1;
+			}
+		}
+
+		if(cache) {
+			is->stream_description = stream_cache_describe(fmt);
+		}
+	}
+
+	is->stream_info_time = (av_gettime() - start) / 1000.0;
+	return 0;
+}
+
+static void close_io(VideoState *is) {
+	if(is->io_read_ahead) {
+		read_ahead_close(&is->io_context);
+	} else {
+		mapped_io_close(&is->io_context);
+	}
+}
 
-	programStartTimeMs = av_gettime()/1000;
+// avcodec_open2() and avcodec_close() aren't safe to call from two
+// threads at once without a lock manager, and players open and close
+// their codecs on whichever thread they're opened and closed on.
+static int codec_lock_manager(void **mutex, enum AVLockOp op) {
+	switch(op) {
+		case AV_LOCK_CREATE:
+			*mutex = SDL_CreateMutex();
+			return *mutex ? 0 : 1;
+		case AV_LOCK_OBTAIN:
+			return SDL_LockMutex((SDL_mutex *)*mutex) != 0;
+		case AV_LOCK_RELEASE:
+			return SDL_UnlockMutex((SDL_mutex *)*mutex) != 0;
+		case AV_LOCK_DESTROY:
+			SDL_DestroyMutex((SDL_mutex *)*mutex);
+			*mutex = NULL;
+			return 0;
+	}
+	return 1;
+}
+
+// Registration isn't thread safe either, so it's done once under a lock
+// in case two players are opened at the same time.
+static void register_codecs() {
+	static SDL_SpinLock lock;
+	static int registered = 0;
+
+	SDL_AtomicLock(&lock);
+	if(!registered) {
+		av_register_all();
+		avdevice_register_all();
+		if(av_lockmgr_register(codec_lock_manager) < 0) {
+			fprintf(stderr, "Can't register a lock manager with FFmpeg, players opened together may fail\n");
+		}
+		registered = 1;
+	}
+	SDL_AtomicUnlock(&lock);
+}
+
+VideoState *video_open(const char *filepath, VideoOutputFormat outputFormat, int flags) {
 
 	VideoState *is;
 
 	is = (VideoState*)av_mallocz(sizeof(VideoState));
+	if(!is) {
+		return NULL;
+	}
 
-	av_register_all();
+	register_codecs();
+	yuv_set_impl(YUV_IMPL_AUTO);
+
+	if(!metrics.demux) {
+		metrics.demux = metric_timer("demux");
+		metrics.decode_video = metric_timer("decode_video");
+		metrics.decode_audio = metric_timer("decode_audio");
+		metrics.audio_mix = metric_timer("audio_mix");
+		metrics.spatial = metric_timer("spatial");
+		metrics.convert = metric_timer("convert");
+		metrics.videoq = metric_gauge("videoq_packets");
+		metrics.audioq = metric_gauge("audioq_packets");
+		metrics.pictq = metric_gauge("pictq_pictures");
+		metrics.av_drift = metric_gauge("av_drift_ms");
+		metrics.audio_ring = metric_gauge("audio_ring_ms");
+		metrics.audio_underruns = metric_counter("audio_underruns");
+		metrics.audio_callback = metric_timer("audio_callback_interval");
+		metrics.audio_sync = metric_gauge("audio_sync_ms");
+		metrics.audio_correction = metric_gauge("audio_correction_ppm");
+	}
 
 	strncpy_s(is->filename, filepath, 1024);
 
 	is->pictq_mutex = SDL_CreateMutex();
 	is->pictq_cond = SDL_CreateCond();
+	is->pictq_shown = -1;
+	keyframe_index_init(&is->keyframes);
+	is->display_interval = 1.0 / 75;
 
-	schedule_refresh(is, 40);
+	// Both queues always exist, whichever streams there are, so nothing
+	// has to check before waking or flushing them.
+	packet_queue_init(&is->audioq, PACKET_QUEUE_DEFAULT_CAPACITY);
+	packet_queue_init(&is->videoq, PACKET_QUEUE_DEFAULT_CAPACITY);
+	packet_queue_space_init(&is->queue_space);
+	is->audio_ring_space = SDL_CreateSemaphore(0);
 
 	is->av_sync_type = DEFAULT_AV_SYNC_TYPE;
+	is->output_format = outputFormat;
+	is->flags = flags;
+	is->open_time = av_gettime();
 
 	AVFormatContext *pFormatCtx = NULL;
+	AVInputFormat *inputFormat = NULL;
+	const char *url = is->filename;
 
-	AVDictionary *io_dict = NULL;
 	AVIOInterruptCB callback;
 
 	int video_index = -1;
@@ -1029,28 +2097,68 @@ int video_initialize(const char *filepath) {
 
 	is->videoStream = -1;
 	is->audioStream = -1;
-	is->audio_need_resample = 0;
 
-	global_video_state = is;
 	// will interrupt blocking functions if we quit!
 	callback.callback = decode_interrupt_cb;
 	callback.opaque = is;
 
-	if(avio_open2(&is->io_context, is->filename, 0, &callback, &io_dict)) {
-		fprintf(stderr, "Unable to open I/O for %s\n", is->filename);
-		return -1;
+	pFormatCtx = avformat_alloc_context();
+	pFormatCtx->interrupt_callback = callback;
+	if(fast_open) {
+		pFormatCtx->probesize = FAST_OPEN_PROBESIZE;
+		pFormatCtx->max_analyze_duration = (int)(FAST_OPEN_ANALYZE_DURATION * AV_TIME_BASE);
+	}
+
+	// A generated source, which has no file to do I/O on.
+	if(strncmp(is->filename, "lavfi:", 6) == 0) {
+		inputFormat = av_find_input_format("lavfi");
+		url = is->filename + 6;
+	}
+
+	// Local files are read ahead by an I/O thread, or through a memory map
+	// with it turned off. Anything that can't be opened either way falls
+	// back to libavformat's own I/O. CINEMA_IO_THROTTLE makes the read
+	// ahead source pretend to be slow storage, see
+	// read_ahead_parse_throttle().
+	if(inputFormat) {
+		printf("I/O: lavfi\n");
+
+	} else {
+		if(read_ahead_window > 0) {
+			ReadAheadThrottle throttle;
+			int throttled = read_ahead_parse_throttle(getenv("CINEMA_IO_THROTTLE"), &throttle);
+
+			is->io_context = read_ahead_open(is->filename, read_ahead_window, throttled ? &throttle : NULL, &callback);
+			is->io_read_ahead = is->io_context != NULL;
+		}
+		if(!is->io_context) {
+			is->io_context = mapped_io_open(is->filename);
+		}
+
+		if(is->io_context) {
+			pFormatCtx->pb = is->io_context;
+			if(is->io_read_ahead) {
+				printf("I/O: read ahead, %d MB window\n", read_ahead_window / (1024 * 1024));
+			} else {
+				printf("I/O: memory mapped\n");
+			}
+		} else {
+			printf("I/O: libavformat\n");
+		}
 	}
 
 	// Open video file
-	if(avformat_open_input(&pFormatCtx, is->filename, NULL, NULL) != 0) {
-		return -1;    // Couldn't open file
+	if(avformat_open_input(&pFormatCtx, url, inputFormat, NULL) != 0) {
+		video_close(is);
+		return NULL;    // Couldn't open file
 	}
 
 	is->pFormatCtx = pFormatCtx;
 
 	// Retrieve stream information
-	if(avformat_find_stream_info(pFormatCtx, NULL) < 0) {
-		return -1;    // Couldn't find stream information
+	if(find_stream_info(is, pFormatCtx) < 0) {
+		video_close(is);
+		return NULL;    // Couldn't find stream information
 	}
 
 	// Dump information about file onto standard error
@@ -1066,7 +2174,7 @@ int video_initialize(const char *filepath) {
 		}
 
 		if(pFormatCtx->streams[i]->codec->codec_type == AVMEDIA_TYPE_AUDIO &&
-				audio_index < 0) {
+				audio_index < 0 && !(flags & VIDEO_OPEN_NO_AUDIO)) {
 			audio_index = i;
 		}
 	}
@@ -1081,14 +2189,41 @@ int video_initialize(const char *filepath) {
 
 	if(is->videoStream < 0 && is->audioStream < 0) {
 		fprintf(stderr, "%s: could not open codecs\n", is->filename);
-		return -1;
+		video_close(is);
+		return NULL;
+	}
+
+	if(is->audioStream >= 0) {
+		AVCodecContext *audioCtx = is->audio_st->codec;
+		enum AVSampleFormat fmt = audioCtx->sample_fmt;
+		uint64_t layout = audio_stream_layout(audioCtx);
+		int identity = -1;
+
+		if(layout) {
+			identity = audio_mix_matrix(is->audio_matrix, is->audio_out_layout, layout);
+		}
+
+		is->audio_path = AUDIO_PATH_RESAMPLE;
+		if(identity >= 0 && is->audio_bytes_per_sec == audioCtx->sample_rate * is->audio_frame_bytes) {
+			if(identity && fmt == is->audio_out_fmt) {
+				is->audio_path = AUDIO_PATH_PASSTHROUGH;
+			} else if(identity && audioCtx->channels == 2 && fmt == av_get_planar_sample_fmt(is->audio_out_fmt)) {
+				is->audio_path = AUDIO_PATH_INTERLEAVE;
+			} else {
+				is->audio_path = AUDIO_PATH_MIX;
+			}
+		}
+
+		printf("Audio: %s %d Hz %d channels to %d%s, %s\n", av_get_sample_fmt_name(fmt), audioCtx->sample_rate,
+			   audioCtx->channels, is->audio_out_channels, is->spatial ? " spatial" : "",
+			   is->audio_path == AUDIO_PATH_PASSTHROUGH ? "passed through" :
+			   is->audio_path == AUDIO_PATH_INTERLEAVE ? "interleaved" :
+			   is->audio_path == AUDIO_PATH_MIX ? "mixed" : "resampled");
 	}
 
 #ifdef __RESAMPLER__
 
-//	if( audio_index >= 0
-//			&& pFormatCtx->streams[audio_index]->codec->sample_fmt != AV_SAMPLE_FMT_S16) {
-		is->audio_need_resample = 1;
+	if(is->audioStream >= 0 && is->audio_path == AUDIO_PATH_RESAMPLE) {
 		is->pResampledOut = NULL;
 		is->pSwrCtx = NULL;
 
@@ -1128,9 +2263,9 @@ int video_initialize(const char *filepath) {
 					   pFormatCtx->streams[audio_index]->codec->sample_rate, 0);
 
 		printf("channel layout: %d\n", pFormatCtx->streams[audio_index]->codec->channel_layout);
-		av_opt_set_int(is->pSwrCtx, "out_channel_layout", AV_CH_LAYOUT_STEREO, 0);
-		av_opt_set_int(is->pSwrCtx, "out_sample_fmt", AV_SAMPLE_FMT_S16, 0);
-		av_opt_set_int(is->pSwrCtx, "out_sample_rate",  pFormatCtx->streams[audio_index]->codec->sample_rate, 0);
+		av_opt_set_int(is->pSwrCtx, "out_channel_layout", is->audio_out_layout, 0);
+		av_opt_set_int(is->pSwrCtx, "out_sample_fmt", is->audio_out_fmt, 0);
+		av_opt_set_int(is->pSwrCtx, "out_sample_rate", is->audio_out_rate, 0);
 
 #ifdef __LIBAVRESAMPLE__
 
@@ -1142,56 +2277,386 @@ int video_initialize(const char *filepath) {
 			fprintf(stderr, " ERROR!! From Samplert: %d Hz Sample format: %s\n",
 					pFormatCtx->streams[audio_index]->codec->sample_rate,
 					av_get_sample_fmt_name(pFormatCtx->streams[audio_index]->codec->sample_fmt));
-			fprintf(stderr, "         To Sample format: s16\n");
-			is->audio_need_resample = 0;
-			is->pSwrCtx = NULL;;
+			fprintf(stderr, "         To Sample format: %s\n", av_get_sample_fmt_name(is->audio_out_fmt));
+#ifdef __LIBAVRESAMPLE__
+			avresample_free(&is->pSwrCtx);
+#else
+			swr_free(&is->pSwrCtx);
+#endif
+
+			// No audio rather than noise, the same as VIDEO_OPEN_NO_AUDIO,
+			// so nothing decodes it just to throw it away.
+			audio_device_close(is);
+			avcodec_close(is->audio_st->codec);
+			is->audio_st = NULL;
+			is->audioStream = -1;
 		}
 
-//	}
+	}
 
 #endif
 
+	if(is->videoStream < 0 && is->audioStream < 0) {
+		fprintf(stderr, "%s: no stream can be played\n", is->filename);
+		video_close(is);
+		return NULL;
+	}
+
+	if(is->audioStream >= 0) {
+		is->audio_tid = SDL_CreateThread(audio_thread, "audio_thread", is);
+	}
+
+	if(is->video_st) {
 		alloc_picture(is);
+	} else {
+		is->keyframe_seen = 1;
+		save_stream_info(is, -1);
+	}
 
-		is->parse_tid = SDL_CreateThread(decode_thread, "decode_thread", is);
-		if(!is->parse_tid) {
-			av_free(is);
-			return -1;
-		}
+	is->parse_tid = SDL_CreateThread(decode_thread, "decode_thread", is);
+	if(!is->parse_tid) {
+		video_close(is);
+		return NULL;
+	}
+
+	return is;
+}
 
-	return 0;
 
+// Starts a player opened with VIDEO_OPEN_PAUSED. Its pictures are
+// timed from now and its audio starts playing.
+void video_start(VideoState *is) {
+	SDL_LockMutex(is->pictq_mutex);
+	is->open_time = av_gettime();
+	is->frame_timer = video_get_time();
+	is->video_current_pts_time = av_gettime();
+	SDL_UnlockMutex(is->pictq_mutex);
+
+	if(is->audio_dev) {
+		SDL_PauseAudioDevice(is->audio_dev, 0);
+	}
 }
 
+// What's been decoded into the ring and not yet heard: the bytes past the
+// last callback's position, less what the device has played of them
+// since, plus what it holds on to. Counted the same way as
+// get_audio_clock().
+double video_get_audio_remaining(VideoState *is) {
+	double remaining, period, elapsed = 0;
+	unsigned int played;
+	int64_t time;
 
-unsigned char * video_get_frame_pixels() {
-	if(pixelBuffer)
-		return pixelBuffer;
-	else
+	if(!is->audio_dev || !is->audio_bytes_per_sec) {
 		return 0;
+	}
+
+	SDL_AtomicLock(&is->audio_clock_lock);
+	played = is->audio_played_pos;
+	time = is->audio_played_time;
+	period = is->audio_played_period;
+	SDL_AtomicUnlock(&is->audio_clock_lock);
+
+	if(time) {
+		elapsed = (av_gettime() - time) / 1000000.0;
+		elapsed = (elapsed < period) ? elapsed : period;
+	} else {
+		played = pcm_ring_read_pos(&is->audio_ring);
+	}
+
+	remaining = (int)(pcm_ring_write_pos(&is->audio_ring) - played) / (double)is->audio_bytes_per_sec
+				+ is->audio_latency - elapsed;
+	return (remaining > 0) ? remaining : 0;
+}
+
+// True once the last picture in the file has been on screen for as long
+// as it should be at displayTime, or for audio only files once the audio
+// has run out.
+int video_is_finished(VideoState *is, double displayTime) {
+	int finished;
+
+	if(SDL_AtomicGet(&is->seek_req)) {
+		return 0;
+	}
+
+	if(!is->video_st) {
+		return SDL_AtomicGet(&is->audio_eof) && pcm_ring_fill(&is->audio_ring) == 0;
+	}
+
+	SDL_LockMutex(is->pictq_mutex);
+	finished = SDL_AtomicGet(&is->video_eof) && is->pictq_size == 0 && !is->seek_request_time
+			   && ((is->flags & VIDEO_OPEN_UNTIMED) || displayTime >= is->frame_timer + is->frame_last_delay);
+	SDL_UnlockMutex(is->pictq_mutex);
+
+	return finished;
 }
 
-int video_get_width() {
-	VideoPicture *vp = &global_video_state->pictq[global_video_state->pictq_rindex];
+// Borrows the picture currently on screen. Its slot in pictq won't be
+// reused until video_release_frame() is called, so the renderer can
+// upload straight out of it. Returns 0 if nothing has been shown yet.
+int video_acquire_frame(VideoState *is, VideoFrame *frame) {
+	VideoPicture *vp;
+
+	SDL_LockMutex(is->pictq_mutex);
+
+	if(is->pictq_shown < 0) {
+		SDL_UnlockMutex(is->pictq_mutex);
+		return 0;
+	}
+
+	vp = &is->pictq[is->pictq_shown];
+	vp->refs++;
+
+	for(int i = 0; i < 3; i++) {
+		frame->planes[i] = (i < is->plane_count) ? vp->planes[i] : NULL;
+		frame->pitches[i] = (i < is->plane_count) ? vp->pitches[i] : 0;
+	}
+	frame->plane_count = is->plane_count;
+	frame->width = vp->width;
+	frame->height = vp->height;
+	frame->pts = vp->pts;
+	frame->index = is->pictq_shown;
+	frame->serial = is->frame_serial;
+
+	SDL_UnlockMutex(is->pictq_mutex);
+	return 1;
+}
+
+// Changes every time a new picture goes on screen, so the renderer can
+// skip the texture upload when it's already got this one. 0 means
+// nothing has been shown yet.
+unsigned int video_get_frame_serial(VideoState *is) {
+	unsigned int serial;
+
+	SDL_LockMutex(is->pictq_mutex);
+	serial = is->frame_serial;
+	SDL_UnlockMutex(is->pictq_mutex);
+
+	return serial;
+}
+
+void video_release_frame(VideoState *is, VideoFrame *frame) {
+
+	SDL_LockMutex(is->pictq_mutex);
+	is->pictq[frame->index].refs--;
+	SDL_CondSignal(is->pictq_cond);
+	SDL_UnlockMutex(is->pictq_mutex);
+
+	frame->planes[0] = NULL;
+}
+
+// 1 for RGBA, 2 for NV12 (Y + interleaved UV), 3 for YUV420P.
+int video_get_plane_count(VideoState *is) {
+	return is->plane_count;
+}
+
+// The matrix and offset the shader needs to turn YUV texels into RGB:
+// rgb = matrix * (yuv - offset), matrix row major. Same coefficients as
+// the CPU conversion in yuvconvert.cpp.
+void video_get_yuv_matrix(VideoState *is, float matrix[9], float offset[3]) {
+	yuv_get_matrix(&is->yuv_coeffs, matrix, offset);
+}
+
+void video_set_audio_tap(VideoState *is, VideoAudioTap tap, void *opaque) {
+	SDL_AtomicLock(&is->audio_tap_lock);
+	is->audio_tap = tap;
+	is->audio_tap_opaque = opaque;
+	SDL_AtomicUnlock(&is->audio_tap_lock);
+}
+
+int video_get_width(VideoState *is) {
+	VideoPicture *vp = &is->pictq[is->pictq_rindex];
 
 	return vp->width;
 }
 
-int video_get_height() {
-	VideoPicture *vp = &global_video_state->pictq[global_video_state->pictq_rindex];
+int video_get_height(VideoState *is) {
+	VideoPicture *vp = &is->pictq[is->pictq_rindex];
 
 	return vp->height;
 }
 
 
-void video_shutdown()
-{
-	VideoPicture *vp;
+// Seeks to pos seconds, or pos seconds from the picture on screen if
+// relative is set. The decode thread does the actual seeking.
+void video_seek(VideoState *is, double pos, int relative) {
+	double duration = is->pFormatCtx->duration / (double)AV_TIME_BASE;
+	double start = 0;
+
+	// Positions are stream timestamps, which start at start_time rather
+	// than 0 in e.g. MPEG-TS.
+	if(is->pFormatCtx->start_time != AV_NOPTS_VALUE) {
+		start = is->pFormatCtx->start_time / (double)AV_TIME_BASE;
+	}
+
+	if(relative) {
+		pos += is->video_st ? is->video_current_pts : get_audio_clock(is);
+	}
+	if(duration > 0 && pos > start + duration) {
+		pos = start + duration;
+	}
+	if(pos < start) {
+		pos = start;
+	}
+
+	SDL_LockMutex(is->pictq_mutex);
+	is->seek_request_time = av_gettime();
+	is->seek_flushed = 0;
+	SDL_UnlockMutex(is->pictq_mutex);
+
+	// Stopped until the first picture after the seek, so the audio isn't
+	// pulled towards where it was.
+	external_clock_set(is, 0, 0);
+
+	is->seek_target = pos;
+	SDL_AtomicSet(&is->seek_req, 1);
+	packet_queue_space_signal(&is->queue_space);
+}
+
+void video_get_stats(VideoState *is, VideoStats *stats) {
+
+	stats->frames_shown = SDL_AtomicGet(&is->frames_shown);
+	stats->frames_late = SDL_AtomicGet(&is->frames_late);
+	stats->frames_dropped = SDL_AtomicGet(&is->frames_dropped);
+	stats->frames_dropped_early = SDL_AtomicGet(&is->frames_dropped_early);
+
+	SDL_LockMutex(is->pictq_mutex);
+	stats->seeks = is->seeks;
+	stats->seek_latency_last = is->seek_latency_last;
+	stats->seek_latency_max = is->seek_latency_max;
+	stats->time_to_first_frame = is->time_to_first_frame;
+	stats->av_offset = is->av_offset * 1000;
+	SDL_UnlockMutex(is->pictq_mutex);
+
+	stats->stream_info_time = is->stream_info_time;
+	stats->stream_info_cached = is->stream_info_cached;
+
+	stats->audio_underruns = SDL_AtomicGet(&is->audio_underruns);
+	stats->audio_buffered = is->audio_bytes_per_sec
+							? pcm_ring_fill(&is->audio_ring) * 1000.0 / is->audio_bytes_per_sec : 0;
+
+	stats->audio_latency = is->audio_latency * 1000;
+	stats->audio_latency_measured = is->audio_latency_set;
+
+	SDL_AtomicLock(&is->audio_clock_lock);
+	stats->audio_callback_interval = is->audio_callback_interval * 1000;
+	stats->audio_sync_offset = is->audio_sync_offset * 1000;
+	stats->audio_correction = is->audio_sync_correction * 1000000;
+	SDL_AtomicUnlock(&is->audio_clock_lock);
+
+	stats->io_hits = stats->io_misses = 0;
+	stats->io_stall = 0;
+	if(is->io_read_ahead) {
+		ReadAheadStats io;
+		read_ahead_get_stats(is->io_context, &io);
+		stats->io_hits = io.hits;
+		stats->io_misses = io.misses;
+		stats->io_stall = io.stall_seconds;
+	}
+}
+
+// How far from when they were due pictures actually went on screen,
+// which shows how well presentation lines up with the display.
+void video_print_jitter_histogram(VideoState *is) {
+	int total = 0, peak = 1;
+
+	for(int i = 0; i <= JITTER_HISTOGRAM_SIZE; i++) {
+		total += is->jitter_histogram[i];
+		if(is->jitter_histogram[i] > peak) {
+			peak = is->jitter_histogram[i];
+		}
+	}
+
+	printf("Presentation error (|shown - due|), %d pictures, max %.2f ms:\n", total, is->jitter_max * 1000);
+	for(int i = 0; i <= JITTER_HISTOGRAM_SIZE; i++) {
+		char bar[41];
+		int len = is->jitter_histogram[i] * 40 / peak;
+
+		memset(bar, '#', len);
+		bar[len] = 0;
+		if(i < JITTER_HISTOGRAM_SIZE) {
+			printf("  %2d-%2d ms %6d %s\n", i, i + 1, is->jitter_histogram[i], bar);
+		} else {
+			printf("  >=%2d ms  %6d %s\n", i, is->jitter_histogram[i], bar);
+		}
+	}
+}
+
+// Stops the threads, then frees everything. Also used to clean up after
+// video_open() fails part way, so anything may not have been set up yet.
+void video_close(VideoState *is) {
+	if(!is) {
+		return;
+	}
+
+	SDL_AtomicSet(&is->quit, 1);
+	packet_queue_abort(&is->audioq);
+	packet_queue_abort(&is->videoq);
+	packet_queue_space_signal(&is->queue_space);
+	audio_ring_wake(is);
+	SDL_LockMutex(is->pictq_mutex);
+	SDL_CondBroadcast(is->pictq_cond);
+	SDL_UnlockMutex(is->pictq_mutex);
+
+	// Closing the device waits for the callback to return.
+	if(is->audio_dev) {
+		SDL_CloseAudioDevice(is->audio_dev);
+	}
+	if(is->parse_tid) {
+		SDL_WaitThread(is->parse_tid, NULL);
+	}
+	if(is->video_tid) {
+		SDL_WaitThread(is->video_tid, NULL);
+	}
+	if(is->audio_tid) {
+		SDL_WaitThread(is->audio_tid, NULL);
+	}
+
 	for(size_t i = 0; i < VIDEO_PICTURE_QUEUE_SIZE; i++) {
-		vp = &global_video_state->pictq[i];
-		free(vp->bmp);
+		frame_buffer_free(is->pictq[i].bmp);
+		av_frame_free(&is->pictq[i].frame);
 	}
 
-	SDL_CondSignal(global_video_state->audioq.cond);
-	SDL_CondSignal(global_video_state->videoq.cond);
+	frame_converter_destroy(is->converter);
+	worker_pool_destroy(is->conv_pool);
+
+	if(is->audio_pkt.data) {
+		av_free_packet(&is->audio_pkt);
+	}
+	if(is->audio_st) {
+		avcodec_close(is->audio_st->codec);
+	}
+	if(is->video_st) {
+		avcodec_close(is->video_st->codec);
+	}
+	// Buffers still out in frames go back to the pool as they're freed.
+	frame_pool_destroy(is->frame_pool);
+
+	avformat_close_input(&is->pFormatCtx);
+	close_io(is);
+
+#ifdef __RESAMPLER__
+#ifdef __LIBAVRESAMPLE__
+	avresample_free(&is->pSwrCtx);
+#endif
+#ifdef __LIBSWRESAMPLE__
+	swr_free(&is->pSwrCtx);
+	swr_free(&is->audio_comp);
+	av_free(is->audio_comp_out);
+#endif
+	av_free(is->pResampledOut);
+#endif
+	av_freep(&is->audio_converted);
+
+	av_freep(&is->stream_description);
+	keyframe_index_destroy(&is->keyframes);
+	pcm_ring_destroy(&is->audio_ring);
+	spatial_destroy(is->spatial);
+	packet_queue_destroy(&is->audioq);
+	packet_queue_destroy(&is->videoq);
+	packet_queue_space_destroy(&is->queue_space);
+	SDL_DestroySemaphore(is->audio_ring_space);
+	SDL_DestroyCond(is->pictq_cond);
+	SDL_DestroyMutex(is->pictq_mutex);
+
+	av_free(is);
 }
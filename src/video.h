@@ -1,15 +1,140 @@
 #ifndef VIDEO_H
 #define VIDEO_H
 
-#define FF_REFRESH_EVENT (SDL_USEREVENT)
+// RGBA converts every picture on the CPU. YUV hands the renderer the
+// 4:2:0 planes (Y, U, V or Y + interleaved UV for NV12) so the shader
+// can do the colour conversion, see video_get_yuv_matrix().
+enum VideoOutputFormat {
+	VIDEO_OUTPUT_RGBA,
+	VIDEO_OUTPUT_YUV
+};
 
-int video_initialize(const char *filepath);
+// A player for one file, with its own queues, clocks and threads. Any
+// number can be open at once, e.g. a picture-in-picture second screen or
+// the next item preloading, and each decodes on its own threads.
+typedef struct VideoState VideoState;
 
-unsigned char *video_get_frame_pixels();
-void video_refresh_timer(void *userdata);
+// Flags for video_open().
+enum {
+	VIDEO_OPEN_NO_AUDIO = 1, /* leave the audio stream alone, e.g. for a second screen */
+	VIDEO_OPEN_PAUSED   = 2, /* decode up to the first pictures, then wait for video_start() */
+	VIDEO_OPEN_UNTIMED  = 4  /* every picture in order as soon as it's ready, for benchmarks */
+};
 
-int video_get_width();
-int video_get_height();
-void video_shutdown();
+// Threads each player uses for CPU colour conversion, 0 for one per
+// core. Applies to players opened after it's called.
+void video_set_conversion_threads(int threads);
+// Size of the window the I/O thread keeps read ahead of the demuxer, 0
+// to memory map the file instead. Applies to players opened after it's
+// called.
+void video_set_read_ahead(int megabytes);
+// Plays audio for headphones with each channel coming from a speaker
+// around the screen, see spatialaudio.h. The listener is set with
+// spatial_set_screen() and spatial_set_orientation(). Off by default,
+// applies to players opened after it's called.
+void video_set_spatial_audio(int enable);
+// Frames the audio device is handed per callback, rounded up to a power
+// of two. Smaller cuts the latency but needs the callback to keep up.
+// 2048 by default, applies to players opened after it's called.
+void video_set_audio_period(int frames);
+// Seconds from the callback handing audio over to it being heard, as
+// measured on the machine, e.g. with syncbench and a camera. Negative to
+// estimate it from the period, which is the default.
+void video_set_audio_latency(double seconds);
+// Bounds how much of a file is read to work out its streams, so the
+// first picture comes up sooner. Files that need more get it. On by
+// default.
+void video_set_fast_open(int enable);
+// File to keep what was worked out about each file's streams in, so
+// opening it again skips that. NULL to turn it off, which is the default.
+void video_set_stream_cache(const char *path);
+
+// Returns NULL if the file can't be played. "lavfi:" followed by a filter
+// graph opens a generated source instead of a file, e.g.
+// "lavfi:testsrc=size=1920x1080:rate=60:duration=10".
+VideoState *video_open(const char *filepath, VideoOutputFormat outputFormat, int flags);
+void video_close(VideoState *is);
+void video_start(VideoState *is);
+// True once everything in the file has been shown, as of displayTime.
+int video_is_finished(VideoState *is, double displayTime);
+// Seconds of decoded audio still to be heard, including what the device
+// holds. Closing the player sooner cuts it off.
+double video_get_audio_remaining(VideoState *is);
+
+// A borrowed reference to the picture on screen. The planes stay valid
+// until the frame is released. With a single plane it's RGBA.
+typedef struct VideoFrame {
+	const unsigned char *planes[3];
+	int pitches[3]; /* bytes per row of each plane */
+	int plane_count;
+	int width, height;
+	double pts;
+	int index; /* pictq slot, used by video_release_frame() */
+	unsigned int serial; /* see video_get_frame_serial() */
+} VideoFrame;
+
+int video_acquire_frame(VideoState *is, VideoFrame *frame);
+void video_release_frame(VideoState *is, VideoFrame *frame);
+unsigned int video_get_frame_serial(VideoState *is);
+
+// Called once per rendered frame with the time that frame is expected to
+// be on screen, on the video_get_time() clock. Puts up whichever picture
+// is due nearest to then. Opened with VIDEO_OPEN_UNTIMED it puts up the
+// next picture instead, waiting for it if it isn't ready yet.
+void video_refresh(VideoState *is, double displayTime);
+double video_get_time();
+void video_print_jitter_histogram(VideoState *is);
+
+int video_get_plane_count(VideoState *is);
+void video_get_yuv_matrix(VideoState *is, float matrix[9], float offset[3]);
+
+// Running totals since video_open(). Late pictures were still shown,
+// dropped ones were skipped in the picture queue because the one after
+// was due too, early drops were skipped by the decode thread before
+// colour conversion.
+typedef struct VideoStats {
+	int frames_shown;
+	int frames_late;
+	int frames_dropped;
+	int frames_dropped_early;
+	int seeks;
+	double seek_latency_last; /* ms from video_seek() to the first picture up */
+	double seek_latency_max;
+	double time_to_first_frame; /* ms from video_open(), or video_start() if opened paused */
+	double stream_info_time;    /* ms of that spent filling in the streams */
+	int stream_info_cached;     /* they came from the stream cache */
+	int audio_underruns;        /* times the audio ran dry and was padded with silence */
+	double audio_buffered;      /* ms of audio decoded ahead of the device right now */
+	double av_offset;           /* ms the last picture went up ahead of the audio with it */
+	double audio_sync_offset;   /* ms the audio's ahead of the clock it's synced to, smoothed */
+	double audio_correction;    /* ppm it's being slowed down by to hold sync, negative for faster */
+	double audio_latency;       /* ms from the callback to the speaker, see video_set_audio_latency() */
+	int audio_latency_measured; /* it was set rather than estimated */
+	double audio_callback_interval; /* ms between callbacks, averaged */
+	long long io_hits;     /* demuxer reads served from the read ahead window */
+	long long io_misses;   /* ones that had to wait for the I/O thread */
+	double io_stall;       /* seconds spent waiting, all zero without read ahead */
+} VideoStats;
+
+void video_get_stats(VideoState *is, VideoStats *stats);
+
+// Called on the audio callback's thread with each buffer handed to the
+// device, for tests to see what's actually played. samples are the
+// device's interleaved frames, float if isFloat is set or 16 bit
+// otherwise. heardTime is when the first of them is expected to be
+// heard, on the video_get_time() clock, counting the output latency. It
+// mustn't block.
+typedef void (*VideoAudioTap)(void *opaque, const void *samples, int frames, int channels, int isFloat,
+							  int sampleRate, double heardTime);
+// NULL to remove it. Can be called at any time.
+void video_set_audio_tap(VideoState *is, VideoAudioTap tap, void *opaque);
+
+// Seeks to the keyframe at or before pos seconds, or pos seconds from
+// the current picture if relative is set. pos is a stream timestamp, so
+// counts from the file's start time, and is kept within the file.
+void video_seek(VideoState *is, double pos, int relative);
+
+int video_get_width(VideoState *is);
+int video_get_height(VideoState *is);
 
 #endif // VIDEO_H
@@ -0,0 +1,117 @@
+#include "workerpool.h"
+
+#include <SDL.h>
+#include <SDL_atomic.h>
+#include <SDL_thread.h>
+#include <stdio.h>
+
+#define MAX_WORKER_THREADS 64
+
+struct WorkerPool {
+	int          nb_threads;  /* including the thread calling worker_pool_run() */
+	SDL_Thread   *threads[MAX_WORKER_THREADS];
+	SDL_sem      *start_sem;
+	SDL_sem      *done_sem;
+	int          quit;
+
+	/* The job being run */
+	WorkerFunc   func;
+	void         *arg;
+	int          pieces;
+	SDL_atomic_t next_piece;
+};
+
+// Takes pieces until there are none left.
+static void worker_pool_work(WorkerPool *pool) {
+	int piece;
+
+	while((piece = SDL_AtomicAdd(&pool->next_piece, 1)) < pool->pieces) {
+		pool->func(pool->arg, piece);
+	}
+}
+
+static int worker_thread(void *arg) {
+	WorkerPool *pool = (WorkerPool *)arg;
+
+	for(;;) {
+		SDL_SemWait(pool->start_sem);
+		if(pool->quit) {
+			break;
+		}
+
+		worker_pool_work(pool);
+		SDL_SemPost(pool->done_sem);
+	}
+
+	return 0;
+}
+
+WorkerPool *worker_pool_create(int threads) {
+	WorkerPool *pool = new WorkerPool();
+
+	if(threads < 1) {
+		threads = 1;
+	} else if(threads > MAX_WORKER_THREADS) {
+		threads = MAX_WORKER_THREADS;
+	}
+
+	pool->nb_threads = threads;
+	pool->start_sem = SDL_CreateSemaphore(0);
+	pool->done_sem = SDL_CreateSemaphore(0);
+	pool->quit = 0;
+
+	for(int i = 1; i < threads; i++) {
+		char name[32];
+		sprintf(name, "worker_thread_%d", i);
+		pool->threads[i] = SDL_CreateThread(worker_thread, name, pool);
+	}
+
+	return pool;
+}
+
+void worker_pool_destroy(WorkerPool *pool) {
+	if(!pool) {
+		return;
+	}
+
+	pool->quit = 1;
+	for(int i = 1; i < pool->nb_threads; i++) {
+		SDL_SemPost(pool->start_sem);
+	}
+	for(int i = 1; i < pool->nb_threads; i++) {
+		SDL_WaitThread(pool->threads[i], NULL);
+	}
+
+	SDL_DestroySemaphore(pool->start_sem);
+	SDL_DestroySemaphore(pool->done_sem);
+	delete pool;
+}
+
+int worker_pool_size(WorkerPool *pool) {
+	return pool->nb_threads;
+}
+
+void worker_pool_run(WorkerPool *pool, WorkerFunc func, void *arg, int pieces) {
+	int helpers = pool->nb_threads - 1;
+
+	if(helpers > pieces - 1) {
+		helpers = pieces - 1;
+	}
+
+	pool->func = func;
+	pool->arg = arg;
+	pool->pieces = pieces;
+	SDL_AtomicSet(&pool->next_piece, 0);
+
+	// The semaphores are the barriers: posting publishes the job to the
+	// workers and waiting on done_sem makes their writes visible here.
+	for(int i = 0; i < helpers; i++) {
+		SDL_SemPost(pool->start_sem);
+	}
+
+	worker_pool_work(pool);
+
+	for(int i = 0; i < helpers; i++) {
+		SDL_SemWait(pool->done_sem);
+	}
+}
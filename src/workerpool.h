@@ -0,0 +1,22 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+// A fixed set of threads for splitting one job into pieces that run in
+// parallel, e.g. converting the bands of a picture. The calling thread
+// works on pieces too, so a pool of size 1 has no extra threads and
+// just runs everything inline.
+
+typedef void (*WorkerFunc)(void *arg, int piece);
+
+struct WorkerPool;
+
+WorkerPool *worker_pool_create(int threads);
+void worker_pool_destroy(WorkerPool *pool);
+int worker_pool_size(WorkerPool *pool);
+
+// Calls func(arg, piece) for every piece in [0, pieces) spread across the
+// pool and returns once they've all finished. Only one thread at a time
+// may run jobs on a pool.
+void worker_pool_run(WorkerPool *pool, WorkerFunc func, void *arg, int pieces);
+
+#endif // WORKERPOOL_H
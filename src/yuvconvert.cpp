@@ -0,0 +1,441 @@
+#include "yuvconvert.h"
+
+#include <emmintrin.h>
+#include <immintrin.h>
+#include <math.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+// GCC and clang only emit AVX2 instructions for functions marked for it,
+// MSVC emits whatever intrinsics it's given.
+#if defined(__GNUC__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
+typedef void (*YuvRowFunc)(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+						   uint8_t *dst, int width, const YuvCoeffs *c, int bgra);
+
+/**************************/
+// Coefficients
+
+void yuv_get_coeffs(YuvMatrix matrix, int fullRange, YuvCoeffs *coeffs)
+{
+	double kr = (matrix == YUV_MATRIX_BT709) ? 0.2126 : 0.299;
+	double kb = (matrix == YUV_MATRIX_BT709) ? 0.0722 : 0.114;
+	double kg = 1.0 - kr - kb;
+	double yScale = fullRange ? 1.0 : 255.0 / 219.0;
+	double cScale = fullRange ? 1.0 : 255.0 / 224.0;
+
+	coeffs->y_offset = fullRange ? 0 : 16;
+	coeffs->y_mul = (int16_t)floor(yScale * 16384.0 + 0.5);
+	coeffs->rv = (int16_t)floor(2.0 * (1.0 - kr) * cScale * 8192.0 + 0.5);
+	coeffs->gu = (int16_t)floor(2.0 * (1.0 - kb) * kb / kg * cScale * 8192.0 + 0.5);
+	coeffs->gv = (int16_t)floor(2.0 * (1.0 - kr) * kr / kg * cScale * 8192.0 + 0.5);
+	coeffs->bu = (int16_t)floor(2.0 * (1.0 - kb) * cScale * 8192.0 + 0.5);
+}
+
+void yuv_get_matrix(const YuvCoeffs *coeffs, float matrix[9], float offset[3])
+{
+	float y = coeffs->y_mul / 16384.0f;
+
+	matrix[0] = y; matrix[1] = 0.0f;                     matrix[2] = coeffs->rv / 8192.0f;
+	matrix[3] = y; matrix[4] = -coeffs->gu / 8192.0f;    matrix[5] = -coeffs->gv / 8192.0f;
+	matrix[6] = y; matrix[7] = coeffs->bu / 8192.0f;     matrix[8] = 0.0f;
+
+	offset[0] = coeffs->y_offset / 255.0f;
+	offset[1] = 128.0f / 255.0f;
+	offset[2] = 128.0f / 255.0f;
+}
+
+/**************************/
+// Scalar reference. Does exactly the same fixed point maths as the SIMD
+// kernels: luma is (Y - offset) << 7 and chroma (C - 128) << 8, each
+// multiplied by its coefficient keeping the high 16 bits (like
+// _mm_mulhi_epi16), which leaves everything in Q5.
+
+static inline int mulhi(int a, int b)
+{
+	return (a * b) >> 16;
+}
+
+static inline uint8_t clamp8(int v)
+{
+	return (uint8_t)(v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+static inline void pixel_scalar(uint8_t *dst, int y, int u, int v, const YuvCoeffs *c, int bgra)
+{
+	int yq = mulhi((y - c->y_offset) * 128, c->y_mul);
+	int uq = (u - 128) * 256;
+	int vq = (v - 128) * 256;
+
+	uint8_t r = clamp8((yq + mulhi(vq, c->rv) + 16) >> 5);
+	uint8_t g = clamp8((yq - (mulhi(uq, c->gu) + mulhi(vq, c->gv)) + 16) >> 5);
+	uint8_t b = clamp8((yq + mulhi(uq, c->bu) + 16) >> 5);
+
+	dst[0] = bgra ? b : r;
+	dst[1] = g;
+	dst[2] = bgra ? r : b;
+	dst[3] = 0xff;
+}
+
+static void row420_scalar(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+						  uint8_t *dst, int width, const YuvCoeffs *c, int bgra)
+{
+	for(int x = 0; x < width; x++)
+		pixel_scalar(dst + x*4, y[x], u[x/2], v[x/2], c, bgra);
+}
+
+static void rownv12_scalar(const uint8_t *y, const uint8_t *uv, const uint8_t * /*unused*/,
+						   uint8_t *dst, int width, const YuvCoeffs *c, int bgra)
+{
+	for(int x = 0; x < width; x++)
+		pixel_scalar(dst + x*4, y[x], uv[(x/2)*2], uv[(x/2)*2 + 1], c, bgra);
+}
+
+/**************************/
+// SSE2, 16 pixels at a time.
+
+struct SseCoeffs {
+	__m128i y_offset, y_mul, rv, gu, gv, bu;
+};
+
+static inline void load_coeffs_sse2(SseCoeffs &k, const YuvCoeffs *c)
+{
+	k.y_offset = _mm_set1_epi16(c->y_offset);
+	k.y_mul = _mm_set1_epi16(c->y_mul);
+	k.rv = _mm_set1_epi16(c->rv);
+	k.gu = _mm_set1_epi16(c->gu);
+	k.gv = _mm_set1_epi16(c->gv);
+	k.bu = _mm_set1_epi16(c->bu);
+}
+
+// 8 bit chroma in 16 bit lanes to (C - 128) << 8.
+static inline __m128i chroma_sse2(__m128i c)
+{
+	return _mm_xor_si128(_mm_slli_epi16(c, 8), _mm_set1_epi16((short)0x8000));
+}
+
+static inline __m128i luma_sse2(__m128i y, const SseCoeffs &k)
+{
+	return _mm_mulhi_epi16(_mm_slli_epi16(_mm_sub_epi16(y, k.y_offset), 7), k.y_mul);
+}
+
+static inline __m128i channel_sse2(__m128i ylo, __m128i yhi, __m128i t)
+{
+	const __m128i round = _mm_set1_epi16(16);
+	__m128i lo = _mm_srai_epi16(_mm_adds_epi16(_mm_adds_epi16(ylo, _mm_unpacklo_epi16(t, t)), round), 5);
+	__m128i hi = _mm_srai_epi16(_mm_adds_epi16(_mm_adds_epi16(yhi, _mm_unpackhi_epi16(t, t)), round), 5);
+	return _mm_packus_epi16(lo, hi);
+}
+
+// 16 luma bytes and 8 prepared chroma samples of each to 64 bytes of RGBA.
+static inline void convert16_sse2(__m128i y8, __m128i u, __m128i v, const SseCoeffs &k,
+								  uint8_t *dst, int bgra)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i ylo = luma_sse2(_mm_unpacklo_epi8(y8, zero), k);
+	__m128i yhi = luma_sse2(_mm_unpackhi_epi8(y8, zero), k);
+
+	// Each chroma sample covers two pixels, channel_sse2() duplicates it.
+	__m128i rt = _mm_mulhi_epi16(v, k.rv);
+	__m128i gt = _mm_adds_epi16(_mm_mulhi_epi16(u, k.gu), _mm_mulhi_epi16(v, k.gv));
+	__m128i bt = _mm_mulhi_epi16(u, k.bu);
+
+	__m128i r = channel_sse2(ylo, yhi, rt);
+	__m128i g = channel_sse2(ylo, yhi, _mm_sub_epi16(zero, gt));
+	__m128i b = channel_sse2(ylo, yhi, bt);
+	__m128i a = _mm_set1_epi8((char)0xff);
+
+	if(bgra) {
+		__m128i t = r;
+		r = b;
+		b = t;
+	}
+
+	__m128i rg_lo = _mm_unpacklo_epi8(r, g);
+	__m128i rg_hi = _mm_unpackhi_epi8(r, g);
+	__m128i ba_lo = _mm_unpacklo_epi8(b, a);
+	__m128i ba_hi = _mm_unpackhi_epi8(b, a);
+
+	_mm_storeu_si128((__m128i*)dst + 0, _mm_unpacklo_epi16(rg_lo, ba_lo));
+	_mm_storeu_si128((__m128i*)dst + 1, _mm_unpackhi_epi16(rg_lo, ba_lo));
+	_mm_storeu_si128((__m128i*)dst + 2, _mm_unpacklo_epi16(rg_hi, ba_hi));
+	_mm_storeu_si128((__m128i*)dst + 3, _mm_unpackhi_epi16(rg_hi, ba_hi));
+}
+
+static void row420_sse2(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+						uint8_t *dst, int width, const YuvCoeffs *c, int bgra)
+{
+	const __m128i zero = _mm_setzero_si128();
+	SseCoeffs k;
+	int x = 0;
+
+	load_coeffs_sse2(k, c);
+
+	for(; x + 16 <= width; x += 16) {
+		__m128i y8 = _mm_loadu_si128((const __m128i*)(y + x));
+		__m128i u16 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(u + x/2)), zero);
+		__m128i v16 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(v + x/2)), zero);
+		convert16_sse2(y8, chroma_sse2(u16), chroma_sse2(v16), k, dst + x*4, bgra);
+	}
+
+	row420_scalar(y + x, u + x/2, v + x/2, dst + x*4, width - x, c, bgra);
+}
+
+static void rownv12_sse2(const uint8_t *y, const uint8_t *uv, const uint8_t * /*unused*/,
+						 uint8_t *dst, int width, const YuvCoeffs *c, int bgra)
+{
+	const __m128i lowBytes = _mm_set1_epi16(0x00ff);
+	SseCoeffs k;
+	int x = 0;
+
+	load_coeffs_sse2(k, c);
+
+	for(; x + 16 <= width; x += 16) {
+		__m128i y8 = _mm_loadu_si128((const __m128i*)(y + x));
+		__m128i uv8 = _mm_loadu_si128((const __m128i*)(uv + x));
+		__m128i u16 = _mm_and_si128(uv8, lowBytes);
+		__m128i v16 = _mm_srli_epi16(uv8, 8);
+		convert16_sse2(y8, chroma_sse2(u16), chroma_sse2(v16), k, dst + x*4, bgra);
+	}
+
+	rownv12_scalar(y + x, uv + x, NULL, dst + x*4, width - x, c, bgra);
+}
+
+/**************************/
+// AVX2, 32 pixels at a time. The unpack and pack instructions work
+// within 128 bit lanes, so chroma is reordered up front and the output
+// lanes are put back in order just before storing.
+
+struct AvxCoeffs {
+	__m256i y_offset, y_mul, rv, gu, gv, bu;
+};
+
+TARGET_AVX2 static inline void load_coeffs_avx2(AvxCoeffs &k, const YuvCoeffs *c)
+{
+	k.y_offset = _mm256_set1_epi16(c->y_offset);
+	k.y_mul = _mm256_set1_epi16(c->y_mul);
+	k.rv = _mm256_set1_epi16(c->rv);
+	k.gu = _mm256_set1_epi16(c->gu);
+	k.gv = _mm256_set1_epi16(c->gv);
+	k.bu = _mm256_set1_epi16(c->bu);
+}
+
+// 16 chroma samples in 16 bit lanes to (C - 128) << 8, with the 64 bit
+// quarters swapped to 0 2 1 3 so unpacklo/hi below duplicate them back
+// into pixel order.
+TARGET_AVX2 static inline __m256i chroma_avx2(__m256i c)
+{
+	c = _mm256_xor_si256(_mm256_slli_epi16(c, 8), _mm256_set1_epi16((short)0x8000));
+	return _mm256_permute4x64_epi64(c, 0xd8);
+}
+
+TARGET_AVX2 static inline __m256i luma_avx2(__m128i y8, const AvxCoeffs &k)
+{
+	__m256i y = _mm256_cvtepu8_epi16(y8);
+	return _mm256_mulhi_epi16(_mm256_slli_epi16(_mm256_sub_epi16(y, k.y_offset), 7), k.y_mul);
+}
+
+TARGET_AVX2 static inline __m256i channel_avx2(__m256i ylo, __m256i yhi, __m256i t)
+{
+	const __m256i round = _mm256_set1_epi16(16);
+	__m256i lo = _mm256_srai_epi16(_mm256_adds_epi16(_mm256_adds_epi16(ylo, _mm256_unpacklo_epi16(t, t)), round), 5);
+	__m256i hi = _mm256_srai_epi16(_mm256_adds_epi16(_mm256_adds_epi16(yhi, _mm256_unpackhi_epi16(t, t)), round), 5);
+	return _mm256_packus_epi16(lo, hi);
+}
+
+TARGET_AVX2 static inline void convert32_avx2(__m256i y8, __m256i u, __m256i v, const AvxCoeffs &k,
+											  uint8_t *dst, int bgra)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i ylo = luma_avx2(_mm256_castsi256_si128(y8), k);
+	__m256i yhi = luma_avx2(_mm256_extracti128_si256(y8, 1), k);
+
+	__m256i rt = _mm256_mulhi_epi16(v, k.rv);
+	__m256i gt = _mm256_adds_epi16(_mm256_mulhi_epi16(u, k.gu), _mm256_mulhi_epi16(v, k.gv));
+	__m256i bt = _mm256_mulhi_epi16(u, k.bu);
+
+	// Byte order after packing is pixels 0-7 16-23 | 8-15 24-31.
+	__m256i r = channel_avx2(ylo, yhi, rt);
+	__m256i g = channel_avx2(ylo, yhi, _mm256_sub_epi16(zero, gt));
+	__m256i b = channel_avx2(ylo, yhi, bt);
+	__m256i a = _mm256_set1_epi8((char)0xff);
+
+	if(bgra) {
+		__m256i t = r;
+		r = b;
+		b = t;
+	}
+
+	__m256i rg_lo = _mm256_unpacklo_epi8(r, g);  // 0-7 | 8-15
+	__m256i rg_hi = _mm256_unpackhi_epi8(r, g);  // 16-23 | 24-31
+	__m256i ba_lo = _mm256_unpacklo_epi8(b, a);
+	__m256i ba_hi = _mm256_unpackhi_epi8(b, a);
+
+	__m256i p0 = _mm256_unpacklo_epi16(rg_lo, ba_lo);  // 0-3 | 8-11
+	__m256i p1 = _mm256_unpackhi_epi16(rg_lo, ba_lo);  // 4-7 | 12-15
+	__m256i p2 = _mm256_unpacklo_epi16(rg_hi, ba_hi);  // 16-19 | 24-27
+	__m256i p3 = _mm256_unpackhi_epi16(rg_hi, ba_hi);  // 20-23 | 28-31
+
+	_mm256_storeu_si256((__m256i*)dst + 0, _mm256_permute2x128_si256(p0, p1, 0x20));
+	_mm256_storeu_si256((__m256i*)dst + 1, _mm256_permute2x128_si256(p0, p1, 0x31));
+	_mm256_storeu_si256((__m256i*)dst + 2, _mm256_permute2x128_si256(p2, p3, 0x20));
+	_mm256_storeu_si256((__m256i*)dst + 3, _mm256_permute2x128_si256(p2, p3, 0x31));
+}
+
+TARGET_AVX2 static void row420_avx2(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+									uint8_t *dst, int width, const YuvCoeffs *c, int bgra)
+{
+	AvxCoeffs k;
+	int x = 0;
+
+	load_coeffs_avx2(k, c);
+
+	for(; x + 32 <= width; x += 32) {
+		__m256i y8 = _mm256_loadu_si256((const __m256i*)(y + x));
+		__m256i u16 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(u + x/2)));
+		__m256i v16 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(v + x/2)));
+		convert32_avx2(y8, chroma_avx2(u16), chroma_avx2(v16), k, dst + x*4, bgra);
+	}
+
+	row420_sse2(y + x, u + x/2, v + x/2, dst + x*4, width - x, c, bgra);
+}
+
+TARGET_AVX2 static void rownv12_avx2(const uint8_t *y, const uint8_t *uv, const uint8_t * /*unused*/,
+									 uint8_t *dst, int width, const YuvCoeffs *c, int bgra)
+{
+	const __m256i lowBytes = _mm256_set1_epi16(0x00ff);
+	AvxCoeffs k;
+	int x = 0;
+
+	load_coeffs_avx2(k, c);
+
+	for(; x + 32 <= width; x += 32) {
+		__m256i y8 = _mm256_loadu_si256((const __m256i*)(y + x));
+		__m256i uv8 = _mm256_loadu_si256((const __m256i*)(uv + x));
+		__m256i u16 = _mm256_and_si256(uv8, lowBytes);
+		__m256i v16 = _mm256_srli_epi16(uv8, 8);
+		convert32_avx2(y8, chroma_avx2(u16), chroma_avx2(v16), k, dst + x*4, bgra);
+	}
+
+	rownv12_sse2(y + x, uv + x, NULL, dst + x*4, width - x, c, bgra);
+}
+
+/**************************/
+// Runtime dispatch
+
+static void cpuid(int leaf, int subleaf, int regs[4])
+{
+#if defined(_MSC_VER)
+	__cpuidex(regs, leaf, subleaf);
+#else
+	unsigned int a = 0, b = 0, c = 0, d = 0;
+	__cpuid_count(leaf, subleaf, a, b, c, d);
+	regs[0] = a; regs[1] = b; regs[2] = c; regs[3] = d;
+#endif
+}
+
+static uint64_t xgetbv0()
+{
+#if defined(_MSC_VER)
+	return _xgetbv(0);
+#else
+	unsigned int lo, hi;
+	__asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+	return ((uint64_t)hi << 32) | lo;
+#endif
+}
+
+static bool cpu_has_sse2()
+{
+	int regs[4];
+	cpuid(1, 0, regs);
+	return (regs[3] & (1 << 26)) != 0;
+}
+
+static bool cpu_has_avx2()
+{
+	int regs[4];
+
+	cpuid(0, 0, regs);
+	if(regs[0] < 7)
+		return false;
+
+	// The OS has to save the YMM registers too.
+	cpuid(1, 0, regs);
+	if(!(regs[2] & (1 << 27)) || (xgetbv0() & 0x6) != 0x6)
+		return false;
+
+	cpuid(7, 0, regs);
+	return (regs[1] & (1 << 5)) != 0;
+}
+
+static YuvImpl currentImpl = YUV_IMPL_SCALAR;
+static YuvRowFunc row420 = row420_scalar;
+static YuvRowFunc rownv12 = rownv12_scalar;
+
+YuvImpl yuv_set_impl(YuvImpl impl)
+{
+	if(impl == YUV_IMPL_AUTO)
+		impl = YUV_IMPL_AVX2;
+	if(impl == YUV_IMPL_AVX2 && !cpu_has_avx2())
+		impl = YUV_IMPL_SSE2;
+	if(impl == YUV_IMPL_SSE2 && !cpu_has_sse2())
+		impl = YUV_IMPL_SCALAR;
+
+	switch(impl) {
+	case YUV_IMPL_AVX2:
+		row420 = row420_avx2;
+		rownv12 = rownv12_avx2;
+		break;
+	case YUV_IMPL_SSE2:
+		row420 = row420_sse2;
+		rownv12 = rownv12_sse2;
+		break;
+	default:
+		row420 = row420_scalar;
+		rownv12 = rownv12_scalar;
+		break;
+	}
+
+	currentImpl = impl;
+	return impl;
+}
+
+const char *yuv_impl_name(YuvImpl impl)
+{
+	switch(impl) {
+	case YUV_IMPL_AUTO: return yuv_impl_name(currentImpl);
+	case YUV_IMPL_SCALAR: return "scalar";
+	case YUV_IMPL_SSE2: return "SSE2";
+	case YUV_IMPL_AVX2: return "AVX2";
+	}
+	return "unknown";
+}
+
+void yuv_convert(const uint8_t *const planes[3], const int pitches[3], YuvFormat format,
+				 const YuvCoeffs *coeffs, uint8_t *dst, int dstPitch, RgbFormat dstFormat,
+				 int width, int rowStart, int rowEnd)
+{
+	int bgra = (dstFormat == RGB_FORMAT_BGRA);
+
+	for(int row = rowStart; row < rowEnd; row++) {
+		const uint8_t *y = planes[0] + row * pitches[0];
+		const uint8_t *u = planes[1] + (row/2) * pitches[1];
+		uint8_t *out = dst + row * dstPitch;
+
+		if(format == YUV_FORMAT_NV12) {
+			rownv12(y, u, NULL, out, width, coeffs, bgra);
+		} else {
+			const uint8_t *v = planes[2] + (row/2) * pitches[2];
+			row420(y, u, v, out, width, coeffs, bgra);
+		}
+	}
+}
@@ -0,0 +1,58 @@
+#ifndef YUVCONVERT_H
+#define YUVCONVERT_H
+
+#include <stdint.h>
+
+// Colour conversion from the decoder's YUV 4:2:0 output to 8 bit RGBA or
+// BGRA at the same size. Chroma is replicated, not interpolated, which
+// is what swscale's unscaled YUV->RGB path does too.
+
+enum YuvFormat {
+	YUV_FORMAT_YUV420P,  /* planes[0] = Y, planes[1] = U, planes[2] = V */
+	YUV_FORMAT_NV12      /* planes[0] = Y, planes[1] = interleaved UV */
+};
+
+enum YuvMatrix {
+	YUV_MATRIX_BT601,
+	YUV_MATRIX_BT709
+};
+
+enum RgbFormat {
+	RGB_FORMAT_RGBA,
+	RGB_FORMAT_BGRA
+};
+
+enum YuvImpl {
+	YUV_IMPL_AUTO,  /* best the CPU supports */
+	YUV_IMPL_SCALAR,
+	YUV_IMPL_SSE2,
+	YUV_IMPL_AVX2
+};
+
+// Fixed point conversion coefficients, shared by every kernel so they all
+// give bit identical results.
+typedef struct YuvCoeffs {
+	int16_t y_offset;        /* 16 for limited range, 0 for full range */
+	int16_t y_mul;           /* luma scale, Q14 */
+	int16_t rv, gu, gv, bu;  /* chroma contributions, Q13 */
+} YuvCoeffs;
+
+void yuv_get_coeffs(YuvMatrix matrix, int fullRange, YuvCoeffs *coeffs);
+
+// The same coefficients as a float matrix for doing the conversion in a
+// shader on normalised texels: rgb = matrix * (yuv - offset), row major.
+void yuv_get_matrix(const YuvCoeffs *coeffs, float matrix[9], float offset[3]);
+
+// Picks the kernel. YUV_IMPL_AUTO checks the CPU features at runtime.
+// Returns the implementation actually selected, which falls back to
+// something the CPU supports if the requested one isn't.
+YuvImpl yuv_set_impl(YuvImpl impl);
+const char *yuv_impl_name(YuvImpl impl);
+
+// Converts rows [rowStart, rowEnd) of the image. rowStart must be even
+// so that slices line up with the chroma rows.
+void yuv_convert(const uint8_t *const planes[3], const int pitches[3], YuvFormat format,
+				 const YuvCoeffs *coeffs, uint8_t *dst, int dstPitch, RgbFormat dstFormat,
+				 int width, int rowStart, int rowEnd);
+
+#endif // YUVCONVERT_H